@@ -647,7 +647,7 @@ MainAssistant.prototype.listMounts = function(payload)
 				var mountPoint = trim(fields[1]);
 				var mountType = trim(fields[2]);
 
-				if ((mountType == "ext3") || (mountType == "vfat")) {
+				if ((mountType == "ext3") || (mountType == "ext4") || (mountType == "vfat")) {
 
 					if (this.mountNames[mountSource]) {
 						this.mountsModel.items.push({label: this.mountNames[mountSource], title: mountPoint, name: mountSource, labelClass: 'left', titleClass: 'right'});
@@ -988,34 +988,39 @@ MainAssistant.prototype.checkMedia = function(payload)
 	}
 	else if (payload.stdOut) {
 		this.status.innerHTML = payload.stdOut;
-		if (payload.stdOut.match(/^\s+\d+ bytes per cluster$/)) {
-			var matches = payload.stdOut.match(/\d+/g);
-			if (matches.length == 1) {
-				this.clusterSize = Math.floor(matches[0]);
+		// Status lines arrive in batches.
+		var lines = payload.stdOutLines || [ payload.stdOut ];
+		for (var l = 0; l < lines.length; l++) {
+			var line = lines[l];
+			if (line.match(/^\s+\d+ bytes per cluster$/)) {
+				var matches = line.match(/\d+/g);
+				if (matches.length == 1) {
+					this.clusterSize = Math.floor(matches[0]);
+				}
 			}
-		}
-		if (payload.stdOut.match(/^Data area starts at byte \d+ .sector \d+.$/)) {
-			var matches = payload.stdOut.match(/\d+/g);
-			if (matches.length == 2) {
-				this.dataOffset = Math.floor(matches[0]);
+			if (line.match(/^Data area starts at byte \d+ .sector \d+.$/)) {
+				var matches = line.match(/\d+/g);
+				if (matches.length == 2) {
+					this.dataOffset = Math.floor(matches[0]);
+				}
 			}
-		}
-		if (payload.stdOut.match(/ \d+ files, \d+.\d+ clusters/)) {
-			var matches = payload.stdOut.match(/\d+/g);
-			if (matches.length == 3) {
-				var totalSpace = Math.floor(((matches[2]*this.clusterSize)+this.dataOffset)/1048756);
-				// Allow for a 1MB margin of calculation error
-				if ((this.partitionSize[this.targetPartition] - totalSpace) < 1) {
-					totalSpace = this.partitionSize[this.targetPartition];
+			if (line.match(/ \d+ files, \d+.\d+ clusters/)) {
+				var matches = line.match(/\d+/g);
+				if (matches.length == 3) {
+					var totalSpace = Math.floor(((matches[2]*this.clusterSize)+this.dataOffset)/1048756);
+					// Allow for a 1MB margin of calculation error
+					if ((this.partitionSize[this.targetPartition] - totalSpace) < 1) {
+						totalSpace = this.partitionSize[this.targetPartition];
+					}
+					var freeSpace = Math.floor(((matches[2]-matches[1])*this.clusterSize)/1048756);
+					var usedSpace = totalSpace - freeSpace;
+					// this.filesystemSizeField.innerHTML = totalSpace+" MiB";
+					// this.filesystemUsedField.innerHTML = usedSpace+" MiB";
+					// this.filesystemFreeField.innerHTML = freeSpace+" MiB";
+					this.filesystemSize[this.targetPartition] = totalSpace;
+					this.filesystemUsed[this.targetPartition] = usedSpace;
+					this.filesystemFree[this.targetPartition] = freeSpace;
 				}
-				var freeSpace = Math.floor(((matches[2]-matches[1])*this.clusterSize)/1048756);
-				var usedSpace = totalSpace - freeSpace;
-				// this.filesystemSizeField.innerHTML = totalSpace+" MiB";
-				// this.filesystemUsedField.innerHTML = usedSpace+" MiB";
-				// this.filesystemFreeField.innerHTML = freeSpace+" MiB";
-				this.filesystemSize[this.targetPartition] = totalSpace;
-				this.filesystemUsed[this.targetPartition] = usedSpace;
-				this.filesystemFree[this.targetPartition] = freeSpace;
 			}
 		}
 	}
@@ -1085,27 +1090,32 @@ MainAssistant.prototype.checkExt3fs = function(payload)
 	}
 	else if (payload.stdOut) {
 		this.status.innerHTML = payload.stdOut;
-		if (payload.stdOut.match(/.+ files .+ blocks/)) {
-			var data = payload.stdOut.split(":", 2);
-			var matches = data[1].match(/[0-9.]+/g);
-			if (matches.length == 5) {
-				var totalSpace = Math.ceil(4 * matches[4] / 1024);
-				var usedSpace  = Math.ceil(4 * matches[3] / 1024);
-				if ((totalSpace - this.partitionSize[this.targetPartition]) > 0) {
-					totalSpace = Math.ceil(2 * matches[4] / 1024);
-					usedSpace  = Math.ceil(2 * matches[3] / 1024);
-				}
-				if ((totalSpace - this.partitionSize[this.targetPartition]) > 0) {
-					totalSpace = Math.ceil(1 * matches[4] / 1024);
-					usedSpace  = Math.ceil(1 * matches[3] / 1024);
+		// Status lines arrive in batches.
+		var lines = payload.stdOutLines || [ payload.stdOut ];
+		for (var l = 0; l < lines.length; l++) {
+			var line = lines[l];
+			if (line.match(/.+ files .+ blocks/)) {
+				var data = line.split(":", 2);
+				var matches = data[1].match(/[0-9.]+/g);
+				if (matches.length == 5) {
+					var totalSpace = Math.ceil(4 * matches[4] / 1024);
+					var usedSpace  = Math.ceil(4 * matches[3] / 1024);
+					if ((totalSpace - this.partitionSize[this.targetPartition]) > 0) {
+						totalSpace = Math.ceil(2 * matches[4] / 1024);
+						usedSpace  = Math.ceil(2 * matches[3] / 1024);
+					}
+					if ((totalSpace - this.partitionSize[this.targetPartition]) > 0) {
+						totalSpace = Math.ceil(1 * matches[4] / 1024);
+						usedSpace  = Math.ceil(1 * matches[3] / 1024);
+					}
+					var freeSpace = totalSpace - usedSpace;
+					// this.filesystemSizeField.innerHTML = totalSpace+" MiB";
+					// this.filesystemUsedField.innerHTML = usedSpace+" MiB";
+					// this.filesystemFreeField.innerHTML = freeSpace+" MiB";
+					this.filesystemSize[this.targetPartition] = totalSpace;
+					this.filesystemUsed[this.targetPartition] = usedSpace;
+					this.filesystemFree[this.targetPartition] = freeSpace;
 				}
-				var freeSpace = totalSpace - usedSpace;
-				// this.filesystemSizeField.innerHTML = totalSpace+" MiB";
-				// this.filesystemUsedField.innerHTML = usedSpace+" MiB";
-				// this.filesystemFreeField.innerHTML = freeSpace+" MiB";
-				this.filesystemSize[this.targetPartition] = totalSpace;
-				this.filesystemUsed[this.targetPartition] = usedSpace;
-				this.filesystemFree[this.targetPartition] = freeSpace;
 			}
 		}
 	}
@@ -1386,21 +1396,30 @@ MainAssistant.prototype.resizePartition = function(payload)
 	}
 
 	if (payload.stdErr) {
-		if (!payload.stdErr.match(/WARNING: Reducing active logical volume to/) &&
-			!payload.stdErr.match(/THIS MAY DESTROY YOUR DATA/) &&
-			!payload.stdErr.match(/leaked on lvresize invocation/) &&
-			!payload.stdErr.match(/Run .* for more information/)) {
-			this.status.innerHTML = payload.stdErr;
-			// this.errorMessage(payload.stdErr);
-		}
-		if (payload.stdErr.match(/New size .* matches existing size/)) {
-			this.resizePartitionOverrideError = true;
+		// Status lines arrive in batches.
+		var lines = payload.stdErrLines || [ payload.stdErr ];
+		for (var l = 0; l < lines.length; l++) {
+			var line = lines[l];
+			if (!line.match(/WARNING: Reducing active logical volume to/) &&
+				!line.match(/THIS MAY DESTROY YOUR DATA/) &&
+				!line.match(/leaked on lvresize invocation/) &&
+				!line.match(/Run .* for more information/)) {
+				this.status.innerHTML = line;
+				// this.errorMessage(line);
+			}
+			if (line.match(/New size .* matches existing size/)) {
+				this.resizePartitionOverrideError = true;
+			}
 		}
 	}
 	else if (payload.stdOut) {
-		if (!payload.stdOut.match(/Rounding up size to full physical extent/)) {
-			this.status.innerHTML = payload.stdOut;
-			// this.errorMessage(payload.stdOut);
+		var lines = payload.stdOutLines || [ payload.stdOut ];
+		for (var l = 0; l < lines.length; l++) {
+			var line = lines[l];
+			if (!line.match(/Rounding up size to full physical extent/)) {
+				this.status.innerHTML = line;
+				// this.errorMessage(line);
+			}
 		}
 	}
 	
@@ -1454,16 +1473,25 @@ MainAssistant.prototype.resizeFilesystem = function(payload)
 	}
 
 	if (payload.stdErr) {
-		if (!payload.stdErr.match(/resize2fs/)) {
-			this.status.innerHTML = payload.stdErr;
-			// this.errorMessage(payload.stdErr);
+		// Status lines arrive in batches.
+		var lines = payload.stdErrLines || [ payload.stdErr ];
+		for (var l = 0; l < lines.length; l++) {
+			var line = lines[l];
+			if (!line.match(/resize2fs/)) {
+				this.status.innerHTML = line;
+				// this.errorMessage(line);
+			}
 		}
 	}
 	else if (payload.stdOut) {
-		if (!payload.stdOut.match(/dosfsck/) &&
-			!payload.stdOut.match(/percent complete/)) {
-			this.status.innerHTML = payload.stdOut;
-			// this.errorMessage(payload.stdOut);
+		var lines = payload.stdOutLines || [ payload.stdOut ];
+		for (var l = 0; l < lines.length; l++) {
+			var line = lines[l];
+			if (!line.match(/dosfsck/) &&
+				!line.match(/percent complete/)) {
+				this.status.innerHTML = line;
+				// this.errorMessage(line);
+			}
 		}
 	}
 	
@@ -1613,8 +1641,12 @@ MainAssistant.prototype.createPartition = function(payload)
 	}
 
 	if (payload.stdErr) {
-		if (!payload.stdErr.match(/leaked on lvcreate invocation/)) {
-			this.status.innerHTML = payload.stdErr;
+		// Status lines arrive in batches.
+		var lines = payload.stdErrLines || [ payload.stdErr ];
+		for (var l = 0; l < lines.length; l++) {
+			if (!lines[l].match(/leaked on lvcreate invocation/)) {
+				this.status.innerHTML = lines[l];
+			}
 		}
 	}
 	else if (payload.stdOut) {
@@ -1713,8 +1745,12 @@ MainAssistant.prototype.deletePartition = function(payload)
 	}
 
 	if (payload.stdErr) {
-		if (!payload.stdErr.match(/leaked on lvremove invocation/)) {
-			this.status.innerHTML = payload.stdErr;
+		// Status lines arrive in batches.
+		var lines = payload.stdErrLines || [ payload.stdErr ];
+		for (var l = 0; l < lines.length; l++) {
+			if (!lines[l].match(/leaked on lvremove invocation/)) {
+				this.status.innerHTML = lines[l];
+			}
 		}
 	}
 	else if (payload.stdOut) {
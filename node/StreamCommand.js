@@ -0,0 +1,170 @@
+// Run a command on behalf of a subscribed request, passing its output
+// back as status responses.  Lines are gathered for up to BATCH_MSECS
+// and sent BATCH_LINES at a time, each response carrying them as
+// stdOutLines (or stdErrLines) and the last of them as stdOut (or
+// stdErr).  The bus gives no word of delivery, so the queue of unsent
+// lines is what limits the child: its output is paused once HIGH_WATER
+// lines are waiting, and resumed when they are down to LOW_WATER.  Lines
+// longer than MAX_LINE are split.  Only the tail of stderr is kept for the
+// error message, which is sent once the child has exited and both of its
+// streams have ended.
+
+var StreamCommand = {
+    BATCH_LINES: 100,
+    BATCH_MSECS: 100,
+    HIGH_WATER: 500,
+    LOW_WATER: 100,
+    MAX_LINE: 4096,
+    MAX_STDERR: 16384
+};
+
+var streamCommand = function(tag, argv, future, subscription) {
+
+    console.log(tag+": Running command: "+argv.join(' '));
+
+    var command = spawn(argv[0], argv.slice(1));
+
+    console.log(tag+": Spawned child (pid "+command.pid+")");
+
+    future.result = { stage: "start" };
+
+    var queue = [];
+    var partial = { stdOut: "", stdErr: "" };
+    var stdErrTail = "";
+    var paused = false;
+    var timer = null;
+    var exited = false;
+    var streams = 2;
+    var finished = false;
+    var exitCode = 0;
+
+    var pause = function(state) {
+	if (paused != state) {
+	    paused = state;
+	    if (state) {
+		command.stdout.pause();
+		command.stderr.pause();
+	    }
+	    else {
+		command.stdout.resume();
+		command.stderr.resume();
+	    }
+	}
+    };
+
+    var finish = function() {
+	finished = true;
+	var s = subscription.get();
+	if (exitCode !== 0) {
+	    s.exception = { "errorCode": exitCode, "message": "Command failed: "+stdErrTail };
+	}
+	else {
+	    s.result = { stage: "end" };
+	}
+    };
+
+    var flush = function() {
+	timer = null;
+
+	var count = 0;
+	while (queue.length && (count < StreamCommand.BATCH_LINES)) {
+	    var stream = queue[0].stream;
+	    var lines = [];
+	    while (queue.length && (queue[0].stream == stream) && (count < StreamCommand.BATCH_LINES)) {
+		lines.push(queue.shift().line);
+		count++;
+	    }
+	    var result = { stage: "status" };
+	    result[stream] = lines[lines.length - 1];
+	    result[stream+"Lines"] = lines;
+	    subscription.get().result = result;
+	}
+
+	if (queue.length <= StreamCommand.LOW_WATER) {
+	    pause(false);
+	}
+
+	// A backlog goes out as fast as the event loop lets it.
+	if (queue.length) {
+	    timer = setTimeout(flush, (queue.length >= StreamCommand.BATCH_LINES) ? 0 : StreamCommand.BATCH_MSECS);
+	}
+	else if (exited && !streams && !finished) {
+	    finish();
+	}
+    };
+
+    var enqueue = function(stream, line) {
+	do {
+	    queue.push({ stream: stream, line: line.slice(0, StreamCommand.MAX_LINE) });
+	    line = line.slice(StreamCommand.MAX_LINE);
+	} while (line.length);
+    };
+
+    var collect = function(stream, data) {
+	var lines = (partial[stream] + data).split('\n');
+	partial[stream] = lines.pop();
+	while (partial[stream].length > StreamCommand.MAX_LINE) {
+	    lines.push(partial[stream].slice(0, StreamCommand.MAX_LINE));
+	    partial[stream] = partial[stream].slice(StreamCommand.MAX_LINE);
+	}
+
+	for (var i = 0; i < lines.length; i++) {
+	    enqueue(stream, lines[i]);
+	}
+
+	if (queue.length >= StreamCommand.HIGH_WATER) {
+	    pause(true);
+	}
+
+	if (!timer && queue.length) {
+	    timer = setTimeout(flush, StreamCommand.BATCH_MSECS);
+	}
+    };
+
+    // Once the child has gone and its output has all been read, send
+    // whatever is left.
+    var done = function() {
+	if (!exited || streams) return;
+	pause(false);
+	if (timer) {
+	    clearTimeout(timer);
+	}
+	flush();
+    };
+
+    var end = function(stream) {
+	if (partial[stream] != "") {
+	    enqueue(stream, partial[stream]);
+	    partial[stream] = "";
+	}
+	streams--;
+	done();
+    };
+
+    command.stdout.setEncoding('utf8');
+    command.stdout.on('data', function (data) {
+	    collect("stdOut", data);
+	});
+
+    command.stderr.setEncoding('utf8');
+    command.stderr.on('data', function (data) {
+	    stdErrTail += data;
+	    if (stdErrTail.length > StreamCommand.MAX_STDERR) {
+		stdErrTail = stdErrTail.slice(-StreamCommand.MAX_STDERR);
+	    }
+	    collect("stdErr", data);
+	});
+
+    command.stdout.on('end', function () {
+	    end("stdOut");
+	});
+    command.stderr.on('end', function () {
+	    end("stdErr");
+	});
+
+    command.on('exit', function (code) {
+	    exited = true;
+	    exitCode = code;
+	    done();
+	});
+};
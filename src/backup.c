@@ -0,0 +1,701 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "calibrate.h"
+#include "thread_pool.h"
+#include "fs_probe.h"
+#include "io_policy.h"
+#include "backup.h"
+
+// Characters allowed in an image path, on top of ALLOWED_CHARS.
+#define PATH_CHARS ALLOWED_CHARS "/_"
+
+// States of a pipeline slot.
+#define SLOT_FREE  0
+#define SLOT_BUSY  1
+#define SLOT_READY 2
+
+struct backup_job;
+
+//
+// One chunk on its way through the pipeline.  The job thread reads it in
+// (raw for a backup, compressed for a restore), a pool worker converts
+// it, and the writer thread puts it out in the order it was read.
+//
+typedef struct {
+  struct backup_job *job;
+  uint32_t index;
+  uint32_t raw_len;
+  uint32_t data_len;
+  uint32_t crc;
+  unsigned char *raw;
+  unsigned char *data;
+  int state;
+  bool failed;
+} BACKUP_SLOT;
+
+typedef struct backup_job {
+  LSMessage *message;
+  bool restore;
+  int level;
+  char volume[MAXNAMLEN];
+  char device[MAXLINLEN];
+  char path[MAXLINLEN];
+  int dev_fd;
+  int img_fd;
+  BACKUP_HEADER header;
+  IO_POLICY policy;
+  IO_THROTTLE throttle;
+
+  thread_pool_t *pool;
+  BACKUP_SLOT *slots;
+  int nslots;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  unsigned long produced;
+  bool finished;
+  bool abort;
+  const char *failure;
+
+  unsigned long long done_bytes;
+  unsigned long long image_bytes;
+  time_t started;
+  time_t reported;
+} BACKUP_JOB;
+
+static pthread_mutex_t backup_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool backup_running = false;
+static bool backup_cancelled = false;
+
+static bool read_fully(int fd, void *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = read(fd, (char *)buf + done, len - done);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+
+  return true;
+}
+
+static bool write_fully(int fd, const void *buf, size_t len) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = write(fd, (const char *)buf + done, len - done);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+
+  return true;
+}
+
+//
+// Record the first failure and stop the pipeline.
+//
+static void fail_job(BACKUP_JOB *job, const char *failure) {
+  pthread_mutex_lock(&job->lock);
+  if (!job->failure) job->failure = failure;
+  job->abort = true;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+//
+// Pool task: compress a chunk for a backup, or decompress and verify it
+// for a restore.
+//
+static void convert_chunk(void *arg, int worker) {
+  BACKUP_SLOT *slot = (BACKUP_SLOT *)arg;
+  BACKUP_JOB *job = slot->job;
+
+  if (job->restore) {
+    uLongf len = slot->raw_len;
+    slot->failed = ((uncompress(slot->raw, &len, slot->data, slot->data_len) != Z_OK) ||
+		    (len != slot->raw_len) ||
+		    (crc32(0L, slot->raw, slot->raw_len) != slot->crc));
+  }
+  else {
+    uLongf len = compressBound(job->header.chunk_size);
+    slot->crc = crc32(0L, slot->raw, slot->raw_len);
+    slot->failed = (compress2(slot->data, &len, slot->raw, slot->raw_len, job->level) != Z_OK);
+    slot->data_len = len;
+  }
+
+  pthread_mutex_lock(&job->lock);
+  slot->state = SLOT_READY;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static void report_progress(BACKUP_JOB *job) {
+  char buffer[MAXLINLEN];
+  unsigned long long total = job->header.used_bytes;
+  time_t now = time(NULL);
+
+  if (now == job->reported) return;
+  job->reported = now;
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"status\", \"doneBytes\": %llu, \"totalBytes\": %llu, "
+	   "\"imageBytes\": %llu, \"percent\": %d}",
+	   job->done_bytes, total, job->image_bytes,
+	   total ? (int)(job->done_bytes * 100 / total) : 100);
+  respond_quietly(job->message, buffer);
+}
+
+//
+// Writer thread: puts converted chunks out in order.
+//
+static void *writer_thread(void *ctx) {
+  BACKUP_JOB *job = (BACKUP_JOB *)ctx;
+  unsigned long seq;
+
+  for (seq = 0; ; seq++) {
+    BACKUP_SLOT *slot = &job->slots[seq % job->nslots];
+    bool ok;
+
+    pthread_mutex_lock(&job->lock);
+    while ((slot->state != SLOT_READY) && !job->abort && !(job->finished && (seq == job->produced))) {
+      pthread_cond_wait(&job->cond, &job->lock);
+    }
+    if ((slot->state != SLOT_READY) || job->abort) {
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (slot->failed) {
+      fail_job(job, job->restore ? "Image is corrupt" : "Compression failed");
+      break;
+    }
+
+    if (job->restore) {
+      io_throttle_take(&job->throttle, slot->raw_len);
+      ok = pwrite_fully(job->dev_fd, slot->raw, slot->raw_len,
+			(unsigned long long)slot->index * job->header.chunk_size);
+    }
+    else {
+      BACKUP_RECORD record;
+      record.index = slot->index;
+      record.length = slot->data_len;
+      record.crc = slot->crc;
+      ok = write_fully(job->img_fd, &record, sizeof record) &&
+	write_fully(job->img_fd, slot->data, slot->data_len);
+    }
+
+    if (!ok) {
+      fail_job(job, job->restore ? "Unable to write volume" : "Unable to write image");
+      break;
+    }
+
+    job->done_bytes += slot->raw_len;
+    job->image_bytes += sizeof(BACKUP_RECORD) + slot->data_len;
+
+    pthread_mutex_lock(&job->lock);
+    slot->state = SLOT_FREE;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    report_progress(job);
+  }
+
+  return NULL;
+}
+
+//
+// Wait for the next slot in sequence to come free.  Returns NULL if the
+// pipeline has been stopped.
+//
+static BACKUP_SLOT *next_slot(BACKUP_JOB *job) {
+  BACKUP_SLOT *slot = &job->slots[job->produced % job->nslots];
+
+  pthread_mutex_lock(&backup_lock);
+  if (backup_cancelled) fail_job(job, "Cancelled");
+  pthread_mutex_unlock(&backup_lock);
+
+  pthread_mutex_lock(&job->lock);
+  while ((slot->state != SLOT_FREE) && !job->abort) pthread_cond_wait(&job->cond, &job->lock);
+  if (job->abort) slot = NULL;
+  pthread_mutex_unlock(&job->lock);
+
+  return slot;
+}
+
+static void submit_slot(BACKUP_JOB *job, BACKUP_SLOT *slot) {
+  pthread_mutex_lock(&job->lock);
+  slot->state = SLOT_BUSY;
+  slot->failed = false;
+  job->produced++;
+  pthread_mutex_unlock(&job->lock);
+
+  if (!pool_submit(job->pool, POOL_EXTERNAL, convert_chunk, slot)) {
+    fail_job(job, "Unable to queue chunk");
+  }
+}
+
+//
+// Read every used chunk of the volume into the pipeline.
+//
+static void produce_backup(BACKUP_JOB *job, const unsigned char *map) {
+  uint32_t index;
+
+  for (index = 0; index < job->header.chunk_count; index++) {
+    unsigned long long offset = (unsigned long long)index * job->header.chunk_size;
+    BACKUP_SLOT *slot;
+
+    if (!map[index]) continue;
+
+    slot = next_slot(job);
+    if (!slot) return;
+
+    slot->index = index;
+    slot->raw_len = job->header.chunk_size;
+    if (offset + slot->raw_len > job->header.device_bytes) slot->raw_len = job->header.device_bytes - offset;
+
+    io_throttle_take(&job->throttle, slot->raw_len);
+    if (!pread_fully(job->dev_fd, slot->raw, slot->raw_len, offset)) {
+      fail_job(job, "Unable to read volume");
+      return;
+    }
+
+    submit_slot(job, slot);
+  }
+}
+
+//
+// Read every record of the image into the pipeline.
+//
+static void produce_restore(BACKUP_JOB *job) {
+  uLong bound = compressBound(job->header.chunk_size);
+
+  for (;;) {
+    BACKUP_RECORD record;
+    unsigned long long offset;
+    BACKUP_SLOT *slot;
+
+    if (!read_fully(job->img_fd, &record, sizeof record)) {
+      fail_job(job, "Image is truncated");
+      return;
+    }
+
+    if (record.index == BACKUP_END_INDEX) return;
+
+    if ((record.index >= job->header.chunk_count) || (record.length > bound)) {
+      fail_job(job, "Image is corrupt");
+      return;
+    }
+
+    slot = next_slot(job);
+    if (!slot) return;
+
+    offset = (unsigned long long)record.index * job->header.chunk_size;
+    slot->index = record.index;
+    slot->data_len = record.length;
+    slot->crc = record.crc;
+    slot->raw_len = job->header.chunk_size;
+    if (offset + slot->raw_len > job->header.device_bytes) slot->raw_len = job->header.device_bytes - offset;
+
+    if (!read_fully(job->img_fd, slot->data, slot->data_len)) {
+      fail_job(job, "Image is truncated");
+      return;
+    }
+
+    submit_slot(job, slot);
+  }
+}
+
+//
+// Run the read / convert / write pipeline to completion (or failure).
+//
+static bool run_pipeline(BACKUP_JOB *job, const unsigned char *map) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = (cpus < 1) ? 1 : (cpus > POOL_MAX_THREADS) ? POOL_MAX_THREADS : cpus;
+  uLong bound = compressBound(job->header.chunk_size);
+  pthread_t writer;
+  bool ok = false;
+  int i;
+
+  // Enough slots to keep every worker busy while the writer catches up.
+  job->nslots = threads * 2 + 2;
+  job->slots = calloc(job->nslots, sizeof(BACKUP_SLOT));
+  if (!job->slots) return false;
+
+  for (i = 0; i < job->nslots; i++) {
+    job->slots[i].job = job;
+    job->slots[i].raw = malloc(job->header.chunk_size);
+    job->slots[i].data = malloc(bound);
+    if (!job->slots[i].raw || !job->slots[i].data) goto free_slots;
+  }
+
+  job->pool = pool_create(threads);
+  if (!job->pool) goto free_slots;
+
+  if (pthread_create(&writer, NULL, writer_thread, job)) goto free_pool;
+
+  if (job->restore) produce_restore(job);
+  else produce_backup(job, map);
+
+  pthread_mutex_lock(&job->lock);
+  job->finished = true;
+  pthread_cond_broadcast(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+
+  pthread_join(writer, NULL);
+  pool_wait(job->pool);
+
+  ok = !job->failure;
+
+ free_pool:
+  pool_destroy(job->pool);
+ free_slots:
+  for (i = 0; i < job->nslots; i++) {
+    free(job->slots[i].raw);
+    free(job->slots[i].data);
+  }
+  free(job->slots);
+  return ok;
+}
+
+static const char *backup(BACKUP_JOB *job) {
+  char partial[MAXLINLEN];
+  BACKUP_RECORD end;
+  unsigned char *map;
+  FS_INFO info;
+  uint32_t i;
+  long eta;
+  char buffer[MAXLINLEN];
+  bool known;
+
+  job->dev_fd = open(job->device, O_RDONLY);
+  if (job->dev_fd < 0) return "Unable to open volume";
+
+  fs_probe(job->dev_fd, &info);
+  if (!info.device_bytes) return "Unable to size volume";
+
+  memset(&job->header, 0, sizeof(BACKUP_HEADER));
+  strcpy(job->header.magic, BACKUP_MAGIC);
+  strncpy(job->header.fstype, fs_type_name(info.type), sizeof job->header.fstype - 1);
+  strncpy(job->header.volume, job->volume, sizeof job->header.volume - 1);
+  job->header.device_bytes = info.device_bytes;
+  job->header.chunk_size = BACKUP_CHUNK_SIZE;
+  job->header.chunk_count = (info.device_bytes + BACKUP_CHUNK_SIZE - 1) / BACKUP_CHUNK_SIZE;
+  job->header.level = job->level;
+
+  map = malloc(job->header.chunk_count);
+  if (!map) return "Out of memory";
+
+  // Without a filesystem we understand, everything has to be kept.
+  known = fs_used_extents(job->dev_fd, &info, BACKUP_CHUNK_SIZE, map);
+  if (!known) memset(map, 1, job->header.chunk_count);
+
+  for (i = 0; i < job->header.chunk_count; i++) {
+    if (!map[i]) continue;
+    job->header.used_chunks++;
+    job->header.used_bytes += ((i + 1 == job->header.chunk_count) && (info.device_bytes % BACKUP_CHUNK_SIZE)) ?
+      info.device_bytes % BACKUP_CHUNK_SIZE : BACKUP_CHUNK_SIZE;
+  }
+
+  // Assume the image comes out at about half the size of the data.
+  eta = calibration_eta(job->header.used_bytes, job->header.used_bytes / 2, 0);
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"estimate\", \"filesystem\": \"%s\", \"allocationKnown\": %s, "
+	   "\"deviceBytes\": %llu, \"usedBytes\": %llu, \"eta\": %ld}",
+	   job->header.fstype, known ? "true" : "false",
+	   (unsigned long long)job->header.device_bytes, (unsigned long long)job->header.used_bytes, eta);
+  respond_quietly(job->message, buffer);
+
+  posix_fadvise(job->dev_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // Write to a temporary name, so a failed backup never looks complete.
+  snprintf(partial, sizeof partial, "%s.part", job->path);
+  job->img_fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (job->img_fd < 0) {
+    free(map);
+    return "Unable to create image";
+  }
+
+  if (!write_fully(job->img_fd, &job->header, sizeof job->header)) {
+    free(map);
+    unlink(partial);
+    return "Unable to write image";
+  }
+  job->image_bytes = sizeof job->header;
+
+  if (!run_pipeline(job, map)) {
+    free(map);
+    unlink(partial);
+    return job->failure ? job->failure : "Unable to start pipeline";
+  }
+  free(map);
+
+  memset(&end, 0, sizeof end);
+  end.index = BACKUP_END_INDEX;
+  if (!write_fully(job->img_fd, &end, sizeof end) || fsync(job->img_fd) || rename(partial, job->path)) {
+    unlink(partial);
+    return "Unable to write image";
+  }
+  job->image_bytes += sizeof end;
+
+  return NULL;
+}
+
+static const char *restore(BACKUP_JOB *job) {
+  unsigned long long volume_bytes;
+
+  job->img_fd = open(job->path, O_RDONLY);
+  if (job->img_fd < 0) return "Unable to open image";
+
+  if (!read_fully(job->img_fd, &job->header, sizeof job->header) ||
+      strncmp(job->header.magic, BACKUP_MAGIC, sizeof job->header.magic) ||
+      !job->header.chunk_size || (job->header.chunk_size > 16 * BACKUP_CHUNK_SIZE) ||
+      (job->header.chunk_count != (job->header.device_bytes + job->header.chunk_size - 1) / job->header.chunk_size)) {
+    return "Not a volume image";
+  }
+
+  volume_bytes = lvm_volume_bytes(LVM_GROUP_NAME, job->volume);
+  if (volume_bytes < job->header.device_bytes) return "Volume is smaller than the image";
+
+  posix_fadvise(job->img_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  job->dev_fd = open(job->device, O_WRONLY);
+  if (job->dev_fd < 0) return "Unable to open volume";
+
+  if (!run_pipeline(job, NULL)) return job->failure ? job->failure : "Unable to start pipeline";
+
+  if (fsync(job->dev_fd)) return "Unable to write volume";
+
+  return NULL;
+}
+
+void *backup_thread(void *ctx) {
+  BACKUP_JOB *job = (BACKUP_JOB *)ctx;
+  char buffer[MAXLINLEN];
+  const char *failure;
+  bool cancelled;
+
+  job->dev_fd = job->img_fd = -1;
+  job->started = time(NULL);
+  pthread_mutex_init(&job->lock, NULL);
+  pthread_cond_init(&job->cond, NULL);
+
+  // The writer and the pool's workers inherit the class.
+  io_policy_apply(0, &job->policy);
+  io_throttle_init(&job->throttle, job->policy.limit);
+
+  failure = job->restore ? restore(job) : backup(job);
+
+  if (job->dev_fd >= 0) close(job->dev_fd);
+  if (job->img_fd >= 0) close(job->img_fd);
+
+  pthread_mutex_lock(&backup_lock);
+  cancelled = backup_cancelled;
+  backup_running = false;
+  backup_cancelled = false;
+  pthread_mutex_unlock(&backup_lock);
+  lvm_release();
+
+  if (failure) {
+    log_printf(LOG_ERR, "%s of %s failed: %s\n", job->restore ? "Restore" : "Backup", job->volume, failure);
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"%s\"}",
+	     failure, cancelled ? "cancelled" : "failed");
+  }
+  else {
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"completed\", \"deviceBytes\": %llu, \"usedBytes\": %llu, "
+	     "\"imageBytes\": %llu, \"seconds\": %ld}",
+	     (unsigned long long)job->header.device_bytes, (unsigned long long)job->header.used_bytes,
+	     job->image_bytes, (long)(time(NULL) - job->started));
+  }
+  respond_quietly(job->message, buffer);
+
+  io_throttle_destroy(&job->throttle);
+  pthread_mutex_destroy(&job->lock);
+  pthread_cond_destroy(&job->cond);
+  LSMessageUnref(job->message);
+  free(job);
+
+  return NULL;
+}
+
+//
+// Check the arguments common to backup and restore, and start the job.
+//
+static bool start_backup(LSMessage *message, bool restore) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem = NULL;
+  pthread_t thread;
+  BACKUP_JOB *job;
+  struct stat device, dir;
+  char *slash;
+  bool writable;
+
+  job = calloc(1, sizeof(BACKUP_JOB));
+  if (!job) {
+    problem = "Out of memory";
+    goto refuse;
+  }
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *volume = json_find_first_label(object, "volume");
+  json_t *path = json_find_first_label(object, "path");
+  json_t *level = json_find_first_label(object, "level");
+
+  job->restore = restore;
+  job->level = BACKUP_DEFAULT_LEVEL;
+
+  if (volume && (volume->child->type == JSON_STRING) && (strlen(volume->child->text) < sizeof job->header.volume) &&
+      (strspn(volume->child->text, ALLOWED_CHARS) == strlen(volume->child->text))) {
+    strcpy(job->volume, volume->child->text);
+  }
+  if (path && (path->child->type == JSON_STRING) && (path->child->text[0] == '/') &&
+      (strlen(path->child->text) < sizeof job->path - 8) && !strstr(path->child->text, "..") &&
+      (strspn(path->child->text, PATH_CHARS) == strlen(path->child->text))) {
+    strcpy(job->path, path->child->text);
+  }
+  if (level && (level->child->type == JSON_NUMBER)) {
+    job->level = atoi(level->child->text);
+    if ((job->level < 1) || (job->level > 9)) job->level = BACKUP_DEFAULT_LEVEL;
+  }
+  problem = io_policy_parse(object, &job->policy);
+
+  json_free_value(&object);
+
+  if (problem) goto refuse;
+
+  if (!job->volume[0]) { problem = "Invalid or missing volume"; goto refuse; }
+  if (!job->path[0]) { problem = "Invalid or missing path"; goto refuse; }
+
+  snprintf(job->device, sizeof job->device, "/dev/%s/%s", LVM_GROUP_NAME, job->volume);
+  if (stat(job->device, &device) || !S_ISBLK(device.st_mode)) { problem = "No such volume"; goto refuse; }
+
+  // The image must not live on the volume it is an image of.
+  slash = strrchr(job->path, '/');
+  *slash = '\0';
+  if (stat(job->path[0] ? job->path : "/", &dir)) { problem = "Image directory does not exist"; }
+  else if (dir.st_dev == device.st_rdev) { problem = "Image must be on another volume"; }
+  *slash = '/';
+  if (problem) goto refuse;
+
+  // A restore needs the volume to itself; a backup only needs it to be still.
+  if (fs_device_mounted(job->device, &writable) && (restore || writable)) {
+    problem = "Volume must be unmounted first";
+    goto refuse;
+  }
+
+  // Nothing may resize or move the volume while it is imaged or rewritten.
+  pthread_mutex_lock(&backup_lock);
+  if (backup_running || !lvm_claim(restore ? "restore" : "backup")) {
+    pthread_mutex_unlock(&backup_lock);
+    log_printf(LOG_NOTICE, "Backup thread already running\n");
+    free(job);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  backup_running = true;
+  backup_cancelled = false;
+  pthread_mutex_unlock(&backup_lock);
+
+  // Ref and save the message for use in backup thread
+  LSMessageRef(message);
+  job->message = message;
+
+  if (pthread_create(&thread, NULL, backup_thread, (void*)job)) {
+    LSMessageUnref(message);
+    pthread_mutex_lock(&backup_lock);
+    backup_running = false;
+    pthread_mutex_unlock(&backup_lock);
+    lvm_release();
+    problem = "Unable to start backup thread";
+    goto refuse;
+  }
+
+  pthread_detach(thread);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ refuse:
+  free(job);
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}", problem);
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+//
+// Image the used parts of a volume, compressed, to a file elsewhere.
+//
+bool backup_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return start_backup(message, false);
+}
+
+//
+// Write an image made by backupVolume back onto a volume.
+//
+bool restore_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  return start_backup(message, true);
+}
+
+bool kill_backup_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  bool running;
+
+  pthread_mutex_lock(&backup_lock);
+  running = backup_running;
+  if (running) backup_cancelled = true;
+  pthread_mutex_unlock(&backup_lock);
+
+  if (!LSMessageRespond(message, running ? "{\"returnValue\": true}" : "{\"returnValue\": false, \"stage\": \"failed\"}",
+			&lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
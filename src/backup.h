@@ -0,0 +1,62 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef BACKUP_H_
+#define BACKUP_H_
+
+#include <stdint.h>
+#include <lunaservice.h>
+
+//
+// A volume image is a header followed by one record per chunk of the
+// volume that holds filesystem data, in ascending order, and an end
+// record.  Each record is its chunk compressed with zlib.  Chunks that
+// the filesystem does not use are not stored, and are left untouched on
+// restore.  Fields are in host byte order: images are made and restored
+// on the same device.
+//
+#define BACKUP_MAGIC "TAILORIMG1"
+#define BACKUP_CHUNK_SIZE (1024*1024)
+#define BACKUP_END_INDEX 0xFFFFFFFF
+
+// Default zlib level; the pipeline is meant to keep up with the flash.
+#define BACKUP_DEFAULT_LEVEL 1
+
+typedef struct {
+  char magic[16];
+  uint64_t device_bytes;
+  uint64_t used_bytes;
+  uint32_t chunk_size;
+  uint32_t chunk_count;
+  uint32_t used_chunks;
+  uint32_t level;
+  char fstype[16];
+  char volume[32];
+} BACKUP_HEADER;
+
+typedef struct {
+  uint32_t index;
+  uint32_t length;
+  uint32_t crc;
+} BACKUP_RECORD;
+
+bool backup_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool restore_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool kill_backup_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* BACKUP_H_ */
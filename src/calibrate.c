@@ -0,0 +1,487 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "calibrate.h"
+
+// Scratch volume carved out of free extents for the write probes.
+#define SCRATCH_VOLUME "tailorcal"
+#define SCRATCH_MB 64
+
+// Volume probed read-only when there is no room for a scratch volume.
+#define FALLBACK_VOLUME "media"
+
+// How long each probe runs for.
+#define PROBE_MSECS 1500
+
+// Size of each random access probe.
+#define RANDOM_IO_SIZE 4096
+
+// A larger I/O size must beat the smaller one by this many percent to be chosen.
+#define IO_SIZE_GAIN 10
+
+static const unsigned int probe_sizes[] = { 16*1024, 64*1024, 256*1024, 1024*1024 };
+#define NUM_PROBE_SIZES (sizeof probe_sizes / sizeof probe_sizes[0])
+
+static pthread_mutex_t calibration_lock = PTHREAD_MUTEX_INITIALIZER;
+static DEVICE_CALIBRATION calibration;
+static bool calibration_loaded = false;
+static bool calibration_valid = false;
+
+static pthread_mutex_t calibrate_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool calibrate_running = false;
+
+//
+// Read the saved calibration, once.  Called with the calibration lock held.
+//
+static void calibration_load(void) {
+  char line[MAXLINLEN];
+  FILE *fp;
+
+  if (calibration_loaded) return;
+  calibration_loaded = true;
+
+  fp = fopen(CALIBRATION_FILE, "r");
+  if (!fp) return;
+
+  memset(&calibration, 0, sizeof calibration);
+
+  while (fgets(line, sizeof line, fp)) {
+    char *value = strchr(line, '=');
+    if (!value) continue;
+    *value++ = '\0';
+
+    if      (!strcmp(line, "seqReadKBps"))   calibration.seq_read_kbps = strtoul(value, NULL, 10);
+    else if (!strcmp(line, "seqWriteKBps"))  calibration.seq_write_kbps = strtoul(value, NULL, 10);
+    else if (!strcmp(line, "randReadIops"))  calibration.rand_read_iops = strtoul(value, NULL, 10);
+    else if (!strcmp(line, "randWriteIops")) calibration.rand_write_iops = strtoul(value, NULL, 10);
+    else if (!strcmp(line, "ioSize"))        calibration.io_size = strtoul(value, NULL, 10);
+    else if (!strcmp(line, "when"))          calibration.when = strtol(value, NULL, 10);
+  }
+
+  fclose(fp);
+
+  calibration_valid = (calibration.seq_read_kbps > 0) && (calibration.io_size > 0);
+}
+
+//
+// Replace the saved calibration, writing it atomically.
+//
+static bool calibration_save(DEVICE_CALIBRATION *result) {
+  char tmpfile[MAXLINLEN];
+  FILE *fp;
+
+  mkdir(STATE_DIR, 0755);
+
+  snprintf(tmpfile, sizeof tmpfile, "%s.new", CALIBRATION_FILE);
+
+  fp = fopen(tmpfile, "w");
+  if (!fp) return false;
+
+  fprintf(fp, "seqReadKBps=%lu\nseqWriteKBps=%lu\nrandReadIops=%lu\nrandWriteIops=%lu\nioSize=%u\nwhen=%ld\n",
+	  result->seq_read_kbps, result->seq_write_kbps, result->rand_read_iops,
+	  result->rand_write_iops, result->io_size, (long)result->when);
+
+  if (fflush(fp) || fsync(fileno(fp))) {
+    fclose(fp);
+    unlink(tmpfile);
+    return false;
+  }
+  fclose(fp);
+
+  if (rename(tmpfile, CALIBRATION_FILE)) return false;
+
+  pthread_mutex_lock(&calibration_lock);
+  calibration = *result;
+  calibration_loaded = true;
+  calibration_valid = true;
+  pthread_mutex_unlock(&calibration_lock);
+
+  return true;
+}
+
+//
+// Fetch the current calibration.  Returns false if the device has never
+// been calibrated.
+//
+bool calibration_get(DEVICE_CALIBRATION *result) {
+  bool valid;
+
+  pthread_mutex_lock(&calibration_lock);
+  calibration_load();
+  valid = calibration_valid;
+  if (valid) *result = calibration;
+  pthread_mutex_unlock(&calibration_lock);
+
+  return valid;
+}
+
+//
+// The I/O size which native engines should use for bulk transfers.
+//
+unsigned int calibration_io_size(void) {
+  DEVICE_CALIBRATION result;
+
+  if (calibration_get(&result)) return result.io_size;
+
+  return DEFAULT_IO_SIZE;
+}
+
+//
+// Estimate, in seconds, how long a job moving the given amount of data will
+// take.  Returns -1 if the device has not been calibrated.
+//
+long calibration_eta(unsigned long long read_bytes, unsigned long long write_bytes,
+		     unsigned long random_ops) {
+  DEVICE_CALIBRATION result;
+  double secs = 0;
+
+  if (!calibration_get(&result)) return -1;
+
+  // Without a scratch volume only reads were probed; assume writes are slower.
+  if (!result.seq_write_kbps) result.seq_write_kbps = result.seq_read_kbps / 2;
+  if (!result.rand_read_iops) result.rand_read_iops = 100;
+
+  secs += (double)read_bytes / 1024 / result.seq_read_kbps;
+  if (result.seq_write_kbps) secs += (double)write_bytes / 1024 / result.seq_write_kbps;
+  secs += (double)random_ops / result.rand_read_iops;
+
+  return (long)(secs + 0.5);
+}
+
+static long msecs_since(struct timeval *start) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+//
+// Stream through the device in io_size chunks for PROBE_MSECS.
+// Returns the throughput in KiB/s, or zero on error.
+//
+static unsigned long probe_sequential(int fd, bool write, unsigned int io_size,
+				      unsigned long long span, char *buf) {
+  unsigned long long offset = 0, bytes = 0;
+  struct timeval start;
+  long elapsed;
+
+  gettimeofday(&start, NULL);
+
+  while ((elapsed = msecs_since(&start)) < PROBE_MSECS) {
+    ssize_t n;
+
+    if (offset + io_size > span) offset = 0;
+
+    n = write ? pwrite(fd, buf, io_size, offset) : pread(fd, buf, io_size, offset);
+    if (n != (ssize_t)io_size) return 0;
+
+    offset += io_size;
+    bytes += io_size;
+  }
+
+  if (write && fdatasync(fd)) return 0;
+
+  elapsed = msecs_since(&start);
+  if (elapsed < 1) elapsed = 1;
+
+  return (unsigned long)(bytes / 1024 * 1000 / elapsed);
+}
+
+//
+// Scatter small aligned I/Os across the device for PROBE_MSECS.
+// Returns the operations per second, or zero on error.
+//
+static unsigned long probe_random(int fd, bool write, unsigned long long span, char *buf) {
+  unsigned long long blocks = span / RANDOM_IO_SIZE;
+  unsigned int seed = (unsigned int)time(NULL);
+  unsigned long ops = 0;
+  struct timeval start;
+  long elapsed;
+
+  if (!blocks) return 0;
+
+  gettimeofday(&start, NULL);
+
+  while (msecs_since(&start) < PROBE_MSECS) {
+    unsigned long long block = (((unsigned long long)rand_r(&seed) << 16) ^ rand_r(&seed)) % blocks;
+    off_t offset = (off_t)(block * RANDOM_IO_SIZE);
+    ssize_t n;
+
+    n = write ? pwrite(fd, buf, RANDOM_IO_SIZE, offset) : pread(fd, buf, RANDOM_IO_SIZE, offset);
+    if (n != RANDOM_IO_SIZE) return 0;
+
+    ops++;
+  }
+
+  if (write && fdatasync(fd)) return 0;
+
+  elapsed = msecs_since(&start);
+  if (elapsed < 1) elapsed = 1;
+
+  return (unsigned long)(ops * 1000 / elapsed);
+}
+
+static bool respond_probe(LSMessage *message, const char *probe, unsigned int io_size,
+			  const char *units, unsigned long value) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"status\", \"probe\": \"%s\", \"ioSize\": %u, \"%s\": %lu}",
+	   probe, io_size, units, value);
+
+  if (!LSMessageRespond(message, buffer, &lserror)) {
+    LSErrorPrint(&lserror, stderr);
+    LSErrorFree(&lserror);
+    return false;
+  }
+
+  return true;
+}
+
+static void remove_scratch_volume(void) {
+  char command[MAXLINLEN];
+
+  snprintf(command, sizeof command, "/usr/sbin/lvremove -f %s/%s", LVM_GROUP_NAME, SCRATCH_VOLUME);
+  if (!lvm_run(command, NULL, 0)) {
+    log_printf(LOG_ERR, "Unable to remove scratch volume %s\n", SCRATCH_VOLUME);
+  }
+}
+
+void *calibrate_device_thread(void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  LSMessage *message = (LSMessage *)ctx;
+  DEVICE_CALIBRATION result;
+  char buffer[MAXBUFLEN];
+  char command[MAXLINLEN];
+  char device[MAXLINLEN];
+  unsigned long best = 0, kbps[NUM_PROBE_SIZES];
+  unsigned long long span;
+  LVM_GROUP group;
+  bool scratch = false;
+  char *buf = NULL;
+  int fd = -1;
+  unsigned int i;
+
+  memset(&result, 0, sizeof result);
+
+  // Clear out a scratch volume left behind by an interrupted run.
+  if (lvm_volume_bytes(LVM_GROUP_NAME, SCRATCH_VOLUME)) remove_scratch_volume();
+
+  // Use a scratch volume if the group has room for one, so writes can be probed.
+  if (lvm_group_info(LVM_GROUP_NAME, &group) &&
+      ((unsigned long long)group.free_extents * group.extent_kb >= SCRATCH_MB * 1024)) {
+    snprintf(command, sizeof command, "/usr/sbin/lvcreate -L %dM -n %s %s",
+	     SCRATCH_MB, SCRATCH_VOLUME, LVM_GROUP_NAME);
+    scratch = lvm_run(command, NULL, 0);
+  }
+
+  snprintf(device, sizeof device, "/dev/%s/%s", LVM_GROUP_NAME,
+	   scratch ? SCRATCH_VOLUME : FALLBACK_VOLUME);
+
+  span = lvm_volume_bytes(LVM_GROUP_NAME, scratch ? SCRATCH_VOLUME : FALLBACK_VOLUME);
+
+  // Bypass the page cache, so that we measure the flash and not memory.
+  fd = open(device, (scratch ? O_RDWR : O_RDONLY) | O_DIRECT);
+  if ((fd < 0) || !span) goto failed;
+
+  if (posix_memalign((void **)&buf, 4096, probe_sizes[NUM_PROBE_SIZES-1])) {
+    buf = NULL;
+    goto failed;
+  }
+  memset(buf, 0xa5, probe_sizes[NUM_PROBE_SIZES-1]);
+
+  // Writes first on the scratch volume, so that the reads hit written blocks.
+  if (scratch) {
+    result.seq_write_kbps = probe_sequential(fd, true, DEFAULT_IO_SIZE, span, buf);
+    if (!result.seq_write_kbps) goto failed;
+    respond_probe(message, "sequentialWrite", DEFAULT_IO_SIZE, "kbps", result.seq_write_kbps);
+
+    result.rand_write_iops = probe_random(fd, true, span, buf);
+    if (!result.rand_write_iops) goto failed;
+    respond_probe(message, "randomWrite", RANDOM_IO_SIZE, "iops", result.rand_write_iops);
+  }
+
+  for (i = 0; i < NUM_PROBE_SIZES; i++) {
+    kbps[i] = probe_sequential(fd, false, probe_sizes[i], span, buf);
+    if (!kbps[i]) goto failed;
+    respond_probe(message, "sequentialRead", probe_sizes[i], "kbps", kbps[i]);
+    if (kbps[i] > best) best = kbps[i];
+  }
+
+  // Choose the smallest I/O size which gets within reach of the best rate.
+  result.io_size = probe_sizes[NUM_PROBE_SIZES-1];
+  result.seq_read_kbps = best;
+  for (i = 0; i < NUM_PROBE_SIZES; i++) {
+    if (kbps[i] * (100 + IO_SIZE_GAIN) >= best * 100) {
+      result.io_size = probe_sizes[i];
+      break;
+    }
+  }
+
+  result.rand_read_iops = probe_random(fd, false, span, buf);
+  if (!result.rand_read_iops) goto failed;
+  respond_probe(message, "randomRead", RANDOM_IO_SIZE, "iops", result.rand_read_iops);
+
+  close(fd);
+  fd = -1;
+  free(buf);
+  buf = NULL;
+
+  if (scratch) remove_scratch_volume();
+
+  // Keep the earlier write figures if this run could only probe reads.
+  if (!scratch) {
+    DEVICE_CALIBRATION previous;
+    if (calibration_get(&previous)) {
+      result.seq_write_kbps = previous.seq_write_kbps;
+      result.rand_write_iops = previous.rand_write_iops;
+    }
+  }
+
+  result.when = time(NULL);
+
+  if (!calibration_save(&result)) {
+    log_printf(LOG_ERR, "Unable to save calibration to %s\n", CALIBRATION_FILE);
+  }
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"completed\", \"scratch\": %s, "
+	   "\"seqReadKBps\": %lu, \"seqWriteKBps\": %lu, \"randReadIops\": %lu, \"randWriteIops\": %lu, \"ioSize\": %u}",
+	   scratch ? "true" : "false", result.seq_read_kbps, result.seq_write_kbps,
+	   result.rand_read_iops, result.rand_write_iops, result.io_size);
+
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+
+  goto end;
+
+ failed:
+  log_printf(LOG_ERR, "Calibration of %s failed (%s)\n", device, strerror(errno));
+  if (fd >= 0) close(fd);
+  free(buf);
+  if (scratch) remove_scratch_volume();
+  if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to probe device\", \"stage\": \"failed\"}",
+			&lserror)) goto error;
+  goto end;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  LSMessageUnref(message);
+
+  pthread_mutex_lock(&calibrate_lock);
+  calibrate_running = false;
+  pthread_mutex_unlock(&calibrate_lock);
+  lvm_release();
+
+  return NULL;
+}
+
+//
+// Measure the throughput of the store device, for use in ETAs and I/O sizing.
+//
+bool calibrate_device_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  pthread_t thread;
+
+  // The scratch volume is allocated from the group, so hold it for the whole probe.
+  pthread_mutex_lock(&calibrate_lock);
+  if (calibrate_running || !lvm_claim("calibrate")) {
+    pthread_mutex_unlock(&calibrate_lock);
+    log_printf(LOG_NOTICE, "Calibration thread already running\n");
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  calibrate_running = true;
+  pthread_mutex_unlock(&calibrate_lock);
+
+  // Ref and save the message for use in calibration thread
+  LSMessageRef(message);
+
+  if (pthread_create(&thread, NULL, calibrate_device_thread, (void*)message)) {
+    log_printf(LOG_ERR, "Creating calibration thread failed\n");
+    pthread_mutex_lock(&calibrate_lock);
+    calibrate_running = false;
+    pthread_mutex_unlock(&calibrate_lock);
+    lvm_release();
+    LSMessageUnref(message);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to start calibration thread\"}", &lserror)) goto error;
+  }
+  else {
+    pthread_detach(thread);
+    if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+  }
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Return the saved calibration figures.
+//
+bool get_calibration_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  DEVICE_CALIBRATION result;
+  char buffer[MAXLINLEN];
+
+  if (!calibration_get(&result)) {
+    if (!LSMessageRespond(message, "{\"returnValue\": true, \"calibrated\": false}", &lserror)) goto error;
+    return true;
+  }
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"calibrated\": true, \"when\": %ld, "
+	   "\"seqReadKBps\": %lu, \"seqWriteKBps\": %lu, \"randReadIops\": %lu, \"randWriteIops\": %lu, \"ioSize\": %u}",
+	   (long)result.when, result.seq_read_kbps, result.seq_write_kbps,
+	   result.rand_read_iops, result.rand_write_iops, result.io_size);
+
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
@@ -0,0 +1,50 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef CALIBRATE_H_
+#define CALIBRATE_H_
+
+#include <time.h>
+#include <lunaservice.h>
+
+#include "luna_methods.h"
+
+// Where the most recent calibration is kept between runs.
+#define CALIBRATION_FILE STATE_DIR "/calibration"
+
+// I/O size used by native engines until the device has been calibrated.
+#define DEFAULT_IO_SIZE (256*1024)
+
+typedef struct {
+  unsigned long seq_read_kbps;
+  unsigned long seq_write_kbps;
+  unsigned long rand_read_iops;
+  unsigned long rand_write_iops;
+  unsigned int io_size;
+  time_t when;
+} DEVICE_CALIBRATION;
+
+bool calibrate_device_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool get_calibration_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+bool calibration_get(DEVICE_CALIBRATION *calibration);
+unsigned int calibration_io_size(void);
+long calibration_eta(unsigned long long read_bytes, unsigned long long write_bytes,
+		     unsigned long random_ops);
+
+#endif /* CALIBRATE_H_ */
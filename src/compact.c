@@ -0,0 +1,769 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "journal.h"
+#include "fs_probe.h"
+#include "fat_check.h"
+#include "io_policy.h"
+#include "calibrate.h"
+#include "compact.h"
+
+//
+// Files are moved a batch at a time:
+//
+//   1. the batch is written to the journal,
+//   2. each file's data is copied into a free run of clusters,
+//   3. the new runs are linked into the FAT,
+//   4. the directory entries are pointed at the new runs,
+//   5. the old chains are freed.
+//
+// Until step 4 a file's entry still leads to its old chain, and after it
+// to the new one, so a crash at any point loses nothing.  On the next run
+// the journal says which runs and chains to look at, and whichever one
+// the directory tree no longer reaches is freed.
+//
+// Directories are left where they are, since moving one means rewriting
+// the ".." entries of every subdirectory as well.
+//
+
+#define BIT_TEST(map, n)  ((map)[(n) >> 3] & (1 << ((n) & 7)))
+#define BIT_SET(map, n)   ((map)[(n) >> 3] |= (1 << ((n) & 7)))
+#define BIT_CLEAR(map, n) ((map)[(n) >> 3] &= ~(1 << ((n) & 7)))
+
+typedef struct {
+  unsigned long long entry;
+  uint32_t start;
+  uint32_t clusters;
+  uint32_t last;
+  bool fragmented;
+} COMPACT_FILE;
+
+typedef struct {
+  unsigned long long entry;
+  uint32_t start;
+  uint32_t target;
+  uint32_t clusters;
+} COMPACT_MOVE;
+
+typedef struct compact_job {
+  LSMessage *message;
+  char device[MAXLINLEN];
+  time_t started;
+  time_t reported;
+  int fd;
+  FS_INFO info;
+  IO_POLICY policy;
+  IO_THROTTLE throttle;
+
+  // The first copy of the FAT, edited in place and written to every copy.
+  unsigned char *fat;
+  size_t fat_bytes;
+  unsigned char *dirty;
+
+  unsigned char *used;
+  unsigned char *reachable;
+  uint32_t free_hint;
+  unsigned char *buffer;
+  size_t buffer_bytes;
+
+  COMPACT_FILE *files;
+  uint32_t file_count;
+  uint32_t file_alloc;
+  unsigned long long total_clusters;
+  unsigned long long done_clusters;
+
+  JOURNAL journal;
+  int move_count;
+  unsigned long long move_bytes;
+  COMPACT_MOVE moves[COMPACT_BATCH_FILES];
+
+  unsigned long files_moved;
+  unsigned long long bytes_moved;
+  unsigned long skipped;
+  bool resumed;
+} COMPACT_JOB;
+
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool compact_running = false;
+static bool compact_cancelled = false;
+
+static bool valid_cluster(const COMPACT_JOB *job, uint32_t cluster) {
+  return (cluster >= 2) && (cluster < job->info.fat.cluster_count + 2);
+}
+
+static uint32_t next_cluster(const COMPACT_JOB *job, uint32_t cluster) {
+  return fat_entry(&job->info.fat, job->fat, cluster);
+}
+
+//
+// Change a FAT entry, noting which sectors now need writing.
+//
+static void set_cluster(COMPACT_JOB *job, uint32_t cluster, uint32_t value) {
+  const FAT_INFO *fat = &job->info.fat;
+  size_t offset = (fat->fat_bits == 12) ? cluster + cluster / 2 : (size_t)cluster * fat->fat_bits / 8;
+  size_t last = offset + ((fat->fat_bits == 32) ? 3 : 1);
+
+  fat_set_entry(fat, job->fat, cluster, value);
+
+  BIT_SET(job->dirty, offset / fat->bytes_per_sector);
+  if (last < job->fat_bytes) BIT_SET(job->dirty, last / fat->bytes_per_sector);
+}
+
+static void release_cluster(COMPACT_JOB *job, uint32_t cluster) {
+  set_cluster(job, cluster, FAT_FREE);
+  BIT_CLEAR(job->used, cluster);
+  if (cluster < job->free_hint) job->free_hint = cluster;
+}
+
+//
+// Write the changed FAT sectors to every copy, a run at a time, and sync.
+//
+static bool flush_fat(COMPACT_JOB *job) {
+  const FAT_INFO *fat = &job->info.fat;
+  unsigned int copy;
+  uint32_t sector, end;
+
+  for (copy = 0; copy < fat->num_fats; copy++) {
+    for (sector = 0; sector < fat->fat_sectors; sector = end) {
+      if (!BIT_TEST(job->dirty, sector)) { end = sector + 1; continue; }
+      for (end = sector + 1; (end < fat->fat_sectors) && BIT_TEST(job->dirty, end); end++);
+
+      if (!pwrite_fully(job->fd, job->fat + (size_t)sector * fat->bytes_per_sector,
+			(size_t)(end - sector) * fat->bytes_per_sector,
+			fat->fat_offset + job->fat_bytes * copy + (unsigned long long)sector * fat->bytes_per_sector)) {
+	return false;
+      }
+    }
+  }
+
+  memset(job->dirty, 0, fat->fat_sectors / 8 + 1);
+
+  return !fsync(job->fd);
+}
+
+//
+// Note a file as a candidate for moving.  Files whose chains are damaged
+// or do not match their size are left for checkMedia.
+//
+static bool add_file(COMPACT_JOB *job, unsigned long long entry, uint32_t start, uint32_t size) {
+  const FAT_INFO *fat = &job->info.fat;
+  COMPACT_FILE file;
+  uint32_t cluster = start;
+
+  memset(&file, 0, sizeof file);
+  file.entry = entry;
+  file.start = start;
+
+  while (true) {
+    uint32_t next;
+
+    if (!valid_cluster(job, cluster) || BIT_TEST(job->reachable, cluster) || (file.clusters > fat->cluster_count)) {
+      job->skipped++;
+      return true;
+    }
+
+    BIT_SET(job->reachable, cluster);
+    file.clusters++;
+    if (cluster > file.last) file.last = cluster;
+
+    next = next_cluster(job, cluster);
+    if (next >= FAT_EOC(fat)) break;
+    if (next != cluster + 1) file.fragmented = true;
+    cluster = next;
+  }
+
+  if (file.clusters != (uint32_t)(((unsigned long long)size + fat->cluster_bytes - 1) / fat->cluster_bytes)) {
+    job->skipped++;
+    return true;
+  }
+
+  if (job->file_count == job->file_alloc) {
+    uint32_t alloc = job->file_alloc ? job->file_alloc * 2 : 1024;
+    COMPACT_FILE *files = realloc(job->files, alloc * sizeof(COMPACT_FILE));
+    if (!files) return false;
+    job->files = files;
+    job->file_alloc = alloc;
+  }
+
+  job->files[job->file_count++] = file;
+  job->total_clusters += file.clusters;
+
+  return true;
+}
+
+//
+// Go through a block of directory entries, collecting files and pushing
+// subdirectories.  Returns false at the end marker.
+//
+static bool scan_entries(COMPACT_JOB *job, const unsigned char *buf, uint32_t count, unsigned long long offset,
+			 uint32_t **stack, uint32_t *depth, uint32_t *alloc, bool *ok) {
+  const FAT_INFO *fat = &job->info.fat;
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    const unsigned char *entry = buf + (size_t)i * FAT_DIRENT_SIZE;
+    unsigned char attr = entry[FAT_DIRENT_ATTR];
+    uint32_t start;
+
+    if (entry[0] == FAT_DIRENT_END) return false;
+    if (entry[0] == FAT_DIRENT_DELETED) continue;
+    if ((attr & FAT_ATTR_LFN) == FAT_ATTR_LFN) continue;
+    if (attr & FAT_ATTR_VOLUME) continue;
+    if (entry[0] == '.') continue;
+
+    start = le16(entry + FAT_DIRENT_CLUSTER_LO);
+    if (fat->fat_bits == 32) start |= (uint32_t)le16(entry + FAT_DIRENT_CLUSTER_HI) << 16;
+
+    if (attr & FAT_ATTR_DIR) {
+      if (!valid_cluster(job, start)) continue;
+      if (*depth == *alloc) {
+	uint32_t *grown = realloc(*stack, (*alloc * 2) * sizeof(uint32_t));
+	if (!grown) { *ok = false; return false; }
+	*stack = grown;
+	*alloc *= 2;
+      }
+      (*stack)[(*depth)++] = start;
+    }
+    else if (start) {
+      if (!add_file(job, offset + (unsigned long long)i * FAT_DIRENT_SIZE, start,
+		    le32(entry + FAT_DIRENT_SIZE_FIELD))) {
+	*ok = false;
+	return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+//
+// Walk the directory tree, marking every cluster it reaches and
+// collecting the files.
+//
+static bool scan_tree(COMPACT_JOB *job) {
+  const FAT_INFO *fat = &job->info.fat;
+  uint32_t alloc = 64, depth = 0;
+  uint32_t *stack = malloc(alloc * sizeof(uint32_t));
+  unsigned char *buf = malloc((size_t)fat->root_entries * FAT_DIRENT_SIZE + fat->cluster_bytes);
+  uint32_t limit = FAT_MAX_DIR_ENTRIES * FAT_DIRENT_SIZE / fat->cluster_bytes + 1;
+  bool ok = true;
+
+  if (!stack || !buf) {
+    free(stack);
+    free(buf);
+    return false;
+  }
+
+  // FAT12/16 keep the root in a fixed area before the data.
+  if (fat->fat_bits == 32) {
+    stack[depth++] = fat->root_cluster;
+  }
+  else if (pread_fully(job->fd, buf, (size_t)fat->root_entries * FAT_DIRENT_SIZE, fat->root_offset)) {
+    scan_entries(job, buf, fat->root_entries, fat->root_offset, &stack, &depth, &alloc, &ok);
+  }
+  else {
+    ok = false;
+  }
+
+  while (ok && depth) {
+    uint32_t cluster = stack[--depth];
+    uint32_t n = 0;
+
+    while (valid_cluster(job, cluster) && !BIT_TEST(job->reachable, cluster) && (n++ < limit)) {
+      uint32_t next = next_cluster(job, cluster);
+
+      BIT_SET(job->reachable, cluster);
+
+      if (!pread_fully(job->fd, buf, fat->cluster_bytes, fat_cluster_offset(fat, cluster))) {
+	ok = false;
+	break;
+      }
+      if (!scan_entries(job, buf, fat->cluster_bytes / FAT_DIRENT_SIZE, fat_cluster_offset(fat, cluster),
+			&stack, &depth, &alloc, &ok)) {
+	// The rest of the chain still belongs to the directory.
+	for (cluster = next; valid_cluster(job, cluster) && !BIT_TEST(job->reachable, cluster) && (n++ < limit);
+	     cluster = next_cluster(job, cluster)) {
+	  BIT_SET(job->reachable, cluster);
+	}
+	break;
+      }
+
+      if (next >= FAT_EOC(fat)) break;
+      cluster = next;
+    }
+  }
+
+  free(stack);
+  free(buf);
+  return ok;
+}
+
+//
+// Finish off a batch the last run was part way through.
+//
+static void recover(COMPACT_JOB *job) {
+  const FAT_INFO *fat = &job->info.fat;
+  int count = (int)journal_get_number(&job->journal, "moves");
+  char key[MAXNAMLEN];
+  unsigned char entry[FAT_DIRENT_SIZE];
+  int i;
+
+  for (i = 0; i < count; i++) {
+    const char *value;
+    COMPACT_MOVE move;
+    uint32_t current, cluster, n;
+
+    snprintf(key, sizeof key, "move%d", i);
+    value = journal_get(&job->journal, key);
+    if (!value || (sscanf(value, "%llu %u %u %u", &move.entry, &move.start, &move.target, &move.clusters) != 4)) continue;
+    if (!pread_fully(job->fd, entry, sizeof entry, move.entry)) continue;
+
+    current = le16(entry + FAT_DIRENT_CLUSTER_LO);
+    if (fat->fat_bits == 32) current |= (uint32_t)le16(entry + FAT_DIRENT_CLUSTER_HI) << 16;
+
+    if (current == move.target) {
+      // Moved: free whatever is left of the old chain.
+      for (cluster = move.start, n = 0; valid_cluster(job, cluster) && !BIT_TEST(job->reachable, cluster) &&
+	     (next_cluster(job, cluster) != FAT_FREE) && (n < move.clusters); n++) {
+	uint32_t next = next_cluster(job, cluster);
+	release_cluster(job, cluster);
+	cluster = next;
+      }
+    }
+    else {
+      // Not moved: drop the copy.
+      for (cluster = move.target; (cluster < move.target + move.clusters) && valid_cluster(job, cluster); cluster++) {
+	if (!BIT_TEST(job->reachable, cluster) && (next_cluster(job, cluster) != FAT_FREE)) release_cluster(job, cluster);
+      }
+    }
+  }
+}
+
+//
+// Copy a file's data to its new run, gathering the old chain's runs into
+// one buffer so each write is a single sequential one.
+//
+static bool copy_file(COMPACT_JOB *job, const COMPACT_MOVE *move) {
+  const FAT_INFO *fat = &job->info.fat;
+  uint32_t per = job->buffer_bytes / fat->cluster_bytes;
+  uint32_t cluster = move->start;
+  uint32_t done = 0;
+
+  while (done < move->clusters) {
+    uint32_t fill = 0;
+
+    while ((fill < per) && (done + fill < move->clusters)) {
+      uint32_t run = 1;
+
+      while ((fill + run < per) && (done + fill + run < move->clusters) &&
+	     (next_cluster(job, cluster + run - 1) == cluster + run)) run++;
+
+      io_throttle_take(&job->throttle, (size_t)run * fat->cluster_bytes);
+      if (!pread_fully(job->fd, job->buffer + (size_t)fill * fat->cluster_bytes, (size_t)run * fat->cluster_bytes,
+		       fat_cluster_offset(fat, cluster))) return false;
+
+      fill += run;
+      cluster = next_cluster(job, cluster + run - 1);
+    }
+
+    io_throttle_take(&job->throttle, (size_t)fill * fat->cluster_bytes);
+    if (!pwrite_fully(job->fd, job->buffer, (size_t)fill * fat->cluster_bytes, fat_cluster_offset(fat, move->target + done))) {
+      return false;
+    }
+    done += fill;
+  }
+
+  return true;
+}
+
+static bool switch_entry(COMPACT_JOB *job, const COMPACT_MOVE *move) {
+  unsigned char entry[FAT_DIRENT_SIZE];
+  uint32_t current;
+
+  if (!pread_fully(job->fd, entry, sizeof entry, move->entry)) return false;
+
+  current = le16(entry + FAT_DIRENT_CLUSTER_LO);
+  if (job->info.fat.fat_bits == 32) current |= (uint32_t)le16(entry + FAT_DIRENT_CLUSTER_HI) << 16;
+  if (current != move->start) return false;
+
+  entry[FAT_DIRENT_CLUSTER_LO] = move->target;
+  entry[FAT_DIRENT_CLUSTER_LO + 1] = move->target >> 8;
+  if (job->info.fat.fat_bits == 32) {
+    entry[FAT_DIRENT_CLUSTER_HI] = move->target >> 16;
+    entry[FAT_DIRENT_CLUSTER_HI + 1] = move->target >> 24;
+  }
+
+  return pwrite_fully(job->fd, entry, sizeof entry, move->entry);
+}
+
+static const char *commit_batch(COMPACT_JOB *job) {
+  const FAT_INFO *fat = &job->info.fat;
+  char key[MAXNAMLEN];
+  char value[MAXLINLEN];
+  uint32_t k;
+  int i;
+
+  journal_set(&job->journal, "state", "running");
+  journal_set_number(&job->journal, "moves", job->move_count);
+  for (i = 0; i < job->move_count; i++) {
+    COMPACT_MOVE *move = &job->moves[i];
+    snprintf(key, sizeof key, "move%d", i);
+    snprintf(value, sizeof value, "%llu %u %u %u", move->entry, move->start, move->target, move->clusters);
+    journal_set(&job->journal, key, value);
+  }
+  if (!journal_save(COMPACT_JOURNAL, &job->journal)) return "Unable to save journal";
+
+  for (i = 0; i < job->move_count; i++) {
+    if (!copy_file(job, &job->moves[i])) return "Unable to copy file data";
+  }
+  if (fsync(job->fd)) return "Unable to write volume";
+
+  // The end of chain mark every fsck writes.
+  for (i = 0; i < job->move_count; i++) {
+    COMPACT_MOVE *move = &job->moves[i];
+    for (k = 0; k < move->clusters; k++) {
+      set_cluster(job, move->target + k, (k + 1 < move->clusters) ? move->target + k + 1 : (FAT_EOC(fat) | 7));
+    }
+  }
+  if (!flush_fat(job)) return "Unable to write FAT";
+
+  for (i = 0; i < job->move_count; i++) {
+    if (!switch_entry(job, &job->moves[i])) return "Unable to update directory entry";
+  }
+  if (fsync(job->fd)) return "Unable to write volume";
+
+  for (i = 0; i < job->move_count; i++) {
+    COMPACT_MOVE *move = &job->moves[i];
+    uint32_t cluster = move->start;
+    for (k = 0; k < move->clusters; k++) {
+      uint32_t next = next_cluster(job, cluster);
+      release_cluster(job, cluster);
+      cluster = next;
+    }
+    job->files_moved++;
+    job->bytes_moved += (unsigned long long)move->clusters * fat->cluster_bytes;
+  }
+  if (!flush_fat(job)) return "Unable to write FAT";
+
+  journal_set_number(&job->journal, "moves", 0);
+  journal_set_number(&job->journal, "moved", job->files_moved);
+  if (!journal_save(COMPACT_JOURNAL, &job->journal)) return "Unable to save journal";
+
+  job->move_count = 0;
+  job->move_bytes = 0;
+
+  return NULL;
+}
+
+//
+// First fit: the lowest free run of the given length lying wholly below
+// the bound.
+//
+static uint32_t find_run(COMPACT_JOB *job, uint32_t clusters, uint32_t bound) {
+  uint32_t cluster, run = 0;
+
+  while (valid_cluster(job, job->free_hint) && BIT_TEST(job->used, job->free_hint)) job->free_hint++;
+
+  for (cluster = job->free_hint; cluster < bound; cluster++) {
+    if (BIT_TEST(job->used, cluster)) { run = 0; continue; }
+    if (++run == clusters) return cluster - clusters + 1;
+  }
+
+  return 0;
+}
+
+static int compare_files(const void *a, const void *b) {
+  const COMPACT_FILE *x = a, *y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+static void report_progress(COMPACT_JOB *job) {
+  char buffer[MAXLINLEN];
+
+  if (job->reported == time(NULL)) return;
+  job->reported = time(NULL);
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"status\", \"percent\": %d, \"filesMoved\": %lu, \"bytesMoved\": %llu}",
+	   job->total_clusters ? (int)(job->done_clusters * 100 / job->total_clusters) : 100,
+	   job->files_moved, job->bytes_moved);
+  respond_quietly(job->message, buffer);
+}
+
+static const char *compact(COMPACT_JOB *job) {
+  const FAT_INFO *fat = &job->info.fat;
+  const char *failure;
+  uint32_t i, cluster;
+
+  // Exclusive, so that the volume cannot be mounted under us.
+  job->fd = open(job->device, O_RDWR | O_EXCL);
+  if (job->fd < 0) return (errno == EBUSY) ? "Volume is in use" : "Unable to open volume";
+
+  if (!fs_probe(job->fd, &job->info) || (job->info.type != FS_FAT)) return "Volume does not hold a FAT filesystem";
+
+  // Moving files on a damaged FAT would free clusters other files still
+  // use.  An interrupted run was checked before it started, and its
+  // journal puts the FAT right again.
+  if (access(COMPACT_JOURNAL, F_OK)) {
+    respond_quietly(job->message, "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"check\"}");
+    if ((failure = fat_check_device(job->fd, &job->policy))) return failure;
+  }
+
+  job->fat_bytes = (size_t)fat->fat_sectors * fat->bytes_per_sector;
+  if ((unsigned long long)(fat->cluster_count + 2) * fat->fat_bits > (unsigned long long)job->fat_bytes * 8) {
+    return "FAT is too small for its volume";
+  }
+
+  job->fat = malloc(job->fat_bytes + 1);
+  job->dirty = calloc(fat->fat_sectors / 8 + 1, 1);
+  job->used = calloc((fat->cluster_count + 2) / 8 + 1, 1);
+  job->reachable = calloc((fat->cluster_count + 2) / 8 + 1, 1);
+  // Each sequential write to the new location is the device's best I/O size.
+  job->buffer_bytes = calibration_io_size();
+  if (job->buffer_bytes < fat->cluster_bytes) job->buffer_bytes = fat->cluster_bytes;
+  job->buffer = malloc(job->buffer_bytes);
+  if (!job->fat || !job->dirty || !job->used || !job->reachable || !job->buffer) return "Out of memory";
+
+  if (!pread_fully(job->fd, job->fat, job->fat_bytes, fat->fat_offset)) return "Unable to read FAT";
+  job->fat[job->fat_bytes] = 0;
+
+  for (cluster = 2; valid_cluster(job, cluster); cluster++) {
+    if (next_cluster(job, cluster) != FAT_FREE) BIT_SET(job->used, cluster);
+  }
+  job->free_hint = 2;
+
+  if (!scan_tree(job)) return "Unable to read directories";
+
+  if (journal_load(COMPACT_JOURNAL, &job->journal)) {
+    job->resumed = true;
+    job->files_moved = journal_get_number(&job->journal, "moved");
+    recover(job);
+    if (!flush_fat(job)) return "Unable to write FAT";
+  }
+  else {
+    journal_init(&job->journal);
+    journal_set_number(&job->journal, "started", time(NULL));
+  }
+
+  qsort(job->files, job->file_count, sizeof(COMPACT_FILE), compare_files);
+
+  for (i = 0; i < job->file_count; i++) {
+    COMPACT_FILE *file = &job->files[i];
+    uint32_t bound = file->fragmented ? file->last : file->start;
+    uint32_t target;
+
+    if (compact_cancelled) return "Cancelled";
+
+    target = find_run(job, file->clusters, bound);
+    if (target) {
+      COMPACT_MOVE *move = &job->moves[job->move_count++];
+
+      move->entry = file->entry;
+      move->start = file->start;
+      move->target = target;
+      move->clusters = file->clusters;
+      for (cluster = target; cluster < target + file->clusters; cluster++) BIT_SET(job->used, cluster);
+      job->move_bytes += (unsigned long long)file->clusters * fat->cluster_bytes;
+    }
+    job->done_clusters += file->clusters;
+
+    if ((job->move_count == COMPACT_BATCH_FILES) || (job->move_bytes >= COMPACT_BATCH_BYTES)) {
+      if ((failure = commit_batch(job))) return failure;
+    }
+
+    report_progress(job);
+  }
+
+  if (job->move_count && (failure = commit_batch(job))) return failure;
+
+  journal_remove(COMPACT_JOURNAL);
+
+  return NULL;
+}
+
+void *compact_thread(void *ctx) {
+  COMPACT_JOB *job = (COMPACT_JOB *)ctx;
+  char buffer[MAXLINLEN];
+  unsigned long long data_end = 0;
+  const char *failure;
+  uint32_t cluster;
+  bool cancelled;
+
+  job->fd = -1;
+  job->started = time(NULL);
+  io_policy_apply(0, &job->policy);
+  io_throttle_init(&job->throttle, job->policy.limit);
+
+  failure = compact(job);
+
+  if (!failure) {
+    for (cluster = job->info.fat.cluster_count + 1; cluster >= 2; cluster--) {
+      if (BIT_TEST(job->used, cluster)) {
+	data_end = fat_cluster_offset(&job->info.fat, cluster + 1);
+	break;
+      }
+    }
+  }
+
+  if (job->fd >= 0) close(job->fd);
+
+  pthread_mutex_lock(&compact_lock);
+  cancelled = compact_cancelled;
+  compact_running = false;
+  compact_cancelled = false;
+  pthread_mutex_unlock(&compact_lock);
+
+  lvm_release();
+  io_throttle_destroy(&job->throttle);
+
+  if (failure) {
+    log_printf(LOG_ERR, "Compacting %s failed: %s\n", job->device, failure);
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"%s\", \"filesMoved\": %lu}",
+	     failure, cancelled ? "cancelled" : "failed", job->files_moved);
+  }
+  else {
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"completed\", \"files\": %u, \"filesMoved\": %lu, \"bytesMoved\": %llu, "
+	     "\"skipped\": %lu, \"resumed\": %s, \"dataEnd\": %llu, \"seconds\": %ld}",
+	     job->file_count, job->files_moved, job->bytes_moved, job->skipped, job->resumed ? "true" : "false",
+	     data_end, (long)(time(NULL) - job->started));
+  }
+  respond_quietly(job->message, buffer);
+
+  free(job->fat);
+  free(job->dirty);
+  free(job->used);
+  free(job->reachable);
+  free(job->buffer);
+  free(job->files);
+  LSMessageUnref(job->message);
+  free(job);
+
+  return NULL;
+}
+
+//
+// Move the files on the media volume towards its start, each into one
+// contiguous run, so that a later shrink has little or nothing to move.
+// An interrupted run is finished off by the next one.
+//
+bool compact_media_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem = NULL;
+  pthread_t thread;
+  COMPACT_JOB *job;
+  bool writable;
+
+  job = calloc(1, sizeof(COMPACT_JOB));
+  if (!job) {
+    problem = "Out of memory";
+    goto refuse;
+  }
+
+  strcpy(job->device, FAT_DEFAULT_DEVICE);
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  problem = io_policy_parse(object, &job->policy);
+  json_free_value(&object);
+  if (problem) goto refuse;
+
+  if (fs_device_mounted(job->device, &writable)) {
+    problem = "Volume must be unmounted first";
+    goto refuse;
+  }
+
+  pthread_mutex_lock(&compact_lock);
+  if (compact_running || !lvm_claim("compact")) {
+    pthread_mutex_unlock(&compact_lock);
+    log_printf(LOG_NOTICE, "Compact thread already running\n");
+    free(job);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  compact_running = true;
+  compact_cancelled = false;
+  pthread_mutex_unlock(&compact_lock);
+
+  // Ref and save the message for use in compact thread
+  LSMessageRef(message);
+  job->message = message;
+
+  if (pthread_create(&thread, NULL, compact_thread, (void*)job)) {
+    LSMessageUnref(message);
+    pthread_mutex_lock(&compact_lock);
+    compact_running = false;
+    pthread_mutex_unlock(&compact_lock);
+    lvm_release();
+    problem = "Unable to start compact thread";
+    goto refuse;
+  }
+
+  pthread_detach(thread);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ refuse:
+  free(job);
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}", problem);
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+bool kill_compact_media_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  bool running;
+
+  pthread_mutex_lock(&compact_lock);
+  running = compact_running;
+  if (running) compact_cancelled = true;
+  pthread_mutex_unlock(&compact_lock);
+
+  if (!LSMessageRespond(message, running ? "{\"returnValue\": true}" : "{\"returnValue\": false, \"stage\": \"failed\"}",
+			&lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
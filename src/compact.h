@@ -0,0 +1,35 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef COMPACT_H_
+#define COMPACT_H_
+
+#include <lunaservice.h>
+
+#include "luna_methods.h"
+
+#define COMPACT_JOURNAL STATE_DIR "/compact.journal"
+
+// Files moved between journal saves, and the data they may hold.
+#define COMPACT_BATCH_FILES 16
+#define COMPACT_BATCH_BYTES (8*1024*1024)
+
+bool compact_media_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool kill_compact_media_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* COMPACT_H_ */
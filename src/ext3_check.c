@@ -0,0 +1,712 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "thread_pool.h"
+#include "spawn.h"
+#include "io_policy.h"
+#include "fs_probe.h"
+#include "ext3_check.h"
+
+// Characters allowed in a device path, on top of ALLOWED_CHARS.
+#define DEVICE_CHARS ALLOWED_CHARS "/_"
+
+// How often progress is streamed while the workers run.
+#define REPORT_MSECS 1000
+
+// Incompatible features the native check understands.  Anything else
+// (meta_bg or 64bit group descriptors, for instance) is left to e2fsck.
+#define EXT3_FEATURE_INCOMPAT_FILETYPE 0x0002
+#define EXT3_FEATURE_INCOMPAT_FLEX_BG  0x0200
+#define EXT3_SUPPORTED_INCOMPAT (EXT3_FEATURE_INCOMPAT_FILETYPE | EXT3_FEATURE_INCOMPAT_RECOVER | \
+				 EXT3_FEATURE_INCOMPAT_EXTENTS | EXT3_FEATURE_INCOMPAT_FLEX_BG)
+
+// Inode fields
+#define INODE_MODE        0
+#define INODE_DTIME      20
+#define INODE_LINKS      26
+#define INODE_BLOCKS     28
+#define INODE_FLAGS      32
+#define INODE_BLOCK      40
+#define INODE_N_BLOCKS   15
+#define INODE_N_DIRECT   12
+#define INODE_EXTENTS_FL 0x00080000
+#define EXTENT_MAGIC     0xF30A
+
+#define S_TYPE(mode) ((mode) & 0xF000)
+#define S_TYPE_FIFO 0x1000
+#define S_TYPE_CHR  0x2000
+#define S_TYPE_DIR  0x4000
+#define S_TYPE_BLK  0x6000
+#define S_TYPE_REG  0x8000
+#define S_TYPE_LNK  0xA000
+#define S_TYPE_SOCK 0xC000
+
+typedef struct {
+  long group;
+  bool error;
+  char text[MAXNAMLEN];
+} EXT3_PROBLEM;
+
+typedef struct ext3_check {
+  LSMessage *message;
+  char device[MAXLINLEN];
+  bool fallback;
+  bool force;
+  IO_POLICY policy;
+  IO_THROTTLE throttle;
+
+  int fd;
+  bool mounted;
+  bool writable;
+  bool unsupported;
+  FS_INFO info;
+  EXT3_GROUP *groups;
+  unsigned char *block_map;
+
+  pthread_mutex_t lock;
+  unsigned long steps_done;
+  unsigned long long inodes_checked;
+  unsigned long long free_blocks;
+  unsigned long long free_inodes;
+  int problem_count;
+  int error_count;
+  EXT3_PROBLEM problems[EXT3_MAX_PROBLEMS];
+} EXT3_CHECK;
+
+typedef struct {
+  EXT3_CHECK *check;
+  uint32_t group;
+} GROUP_TASK;
+
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool check_running = false;
+
+//
+// Note a problem.  Errors send the volume to e2fsck; warnings do not.
+// Counts that can drift on a mounted filesystem are only ever warnings
+// while it is mounted read-write.
+//
+static void add_problem(EXT3_CHECK *check, long group, bool error, const char *format, ...) {
+  va_list args;
+
+  pthread_mutex_lock(&check->lock);
+
+  if (error) check->error_count++;
+
+  if (check->problem_count < EXT3_MAX_PROBLEMS) {
+    EXT3_PROBLEM *problem = &check->problems[check->problem_count];
+    problem->group = group;
+    problem->error = error;
+    va_start(args, format);
+    vsnprintf(problem->text, sizeof problem->text, format, args);
+    va_end(args);
+  }
+  check->problem_count++;
+
+  pthread_mutex_unlock(&check->lock);
+}
+
+//
+// Read from the device, paced by the job's ioLimit.
+//
+static bool check_read(EXT3_CHECK *check, void *buf, size_t len, unsigned long long offset) {
+  io_throttle_take(&check->throttle, len);
+  return pread_fully(check->fd, buf, len, offset);
+}
+
+static uint32_t group_first_block(const EXT3_INFO *ext3, uint32_t group) {
+  return ext3->first_data_block + group * ext3->blocks_per_group;
+}
+
+static uint32_t group_block_count(const EXT3_INFO *ext3, uint32_t group) {
+  uint32_t first = group_first_block(ext3, group);
+
+  if (first + ext3->blocks_per_group > ext3->blocks_count) return ext3->blocks_count - first;
+  return ext3->blocks_per_group;
+}
+
+static uint32_t inode_table_blocks(const EXT3_INFO *ext3) {
+  return ((unsigned long long)ext3->inodes_per_group * ext3->inode_size + ext3->block_size - 1) / ext3->block_size;
+}
+
+static bool block_in_use(const EXT3_CHECK *check, uint32_t block) {
+  uint32_t bit = block - check->info.ext3.first_data_block;
+  return (check->block_map[bit >> 3] >> (bit & 7)) & 1;
+}
+
+static bool valid_block(const EXT3_INFO *ext3, uint32_t block) {
+  return (block >= ext3->first_data_block) && (block < ext3->blocks_count);
+}
+
+//
+// Things that can be decided from the superblock alone.
+//
+static void check_superblock(EXT3_CHECK *check) {
+  const EXT3_INFO *ext3 = &check->info.ext3;
+
+  if (ext3->feature_incompat & ~EXT3_SUPPORTED_INCOMPAT) {
+    add_problem(check, -1, false, "Features 0x%x need the full check", ext3->feature_incompat & ~EXT3_SUPPORTED_INCOMPAT);
+    check->unsupported = true;
+  }
+
+  if (ext3->blocks_per_group % 8) {
+    add_problem(check, -1, true, "Blocks per group (%u) is not a multiple of 8", ext3->blocks_per_group);
+  }
+
+  if (ext3->first_data_block != ((ext3->block_size == 1024) ? 1 : 0)) {
+    add_problem(check, -1, true, "First data block %u is wrong for %u byte blocks",
+		ext3->first_data_block, ext3->block_size);
+  }
+
+  if ((unsigned long long)ext3->blocks_count * ext3->block_size > check->info.device_bytes) {
+    add_problem(check, -1, true, "Filesystem is larger than its device");
+  }
+
+  if (ext3->inodes_count != ext3->group_count * ext3->inodes_per_group) {
+    add_problem(check, -1, true, "Inode count %u does not match %u groups of %u",
+		ext3->inodes_count, ext3->group_count, ext3->inodes_per_group);
+  }
+
+  if ((ext3->free_blocks > ext3->blocks_count) || (ext3->free_inodes > ext3->inodes_count)) {
+    add_problem(check, -1, true, "Free counts exceed totals");
+  }
+
+  if (ext3->state & EXT3_ERROR_FS) {
+    add_problem(check, -1, true, "Filesystem has errors recorded by the kernel");
+  }
+
+  if (!check->mounted) {
+    if (!(ext3->state & EXT3_VALID_FS)) add_problem(check, -1, true, "Filesystem was not cleanly unmounted");
+    if (ext3->feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER) add_problem(check, -1, true, "Journal needs recovery");
+  }
+
+  if ((ext3->max_mount_count > 0) && (ext3->mount_count >= ext3->max_mount_count)) {
+    add_problem(check, -1, false, "Maximal mount count reached");
+  }
+}
+
+//
+// The group descriptors must put each group's metadata inside the
+// filesystem, and (without flex_bg) inside the group itself.
+//
+static void check_descriptors(EXT3_CHECK *check) {
+  const EXT3_INFO *ext3 = &check->info.ext3;
+  bool flex = (ext3->feature_incompat & EXT3_FEATURE_INCOMPAT_FLEX_BG);
+  uint32_t table = inode_table_blocks(ext3);
+  uint32_t g;
+
+  for (g = 0; g < ext3->group_count; g++) {
+    const EXT3_GROUP *group = &check->groups[g];
+    uint32_t first = flex ? ext3->first_data_block : group_first_block(ext3, g);
+    uint32_t end = flex ? ext3->blocks_count : first + group_block_count(ext3, g);
+
+    if ((group->block_bitmap < first) || (group->block_bitmap >= end) ||
+	(group->inode_bitmap < first) || (group->inode_bitmap >= end) ||
+	(group->inode_table < first) || (group->inode_table + table > end)) {
+      add_problem(check, g, true, "Group metadata lies outside its group");
+    }
+
+    if (group->free_blocks > group_block_count(ext3, g)) add_problem(check, g, true, "Free block count too large");
+    if (group->free_inodes > ext3->inodes_per_group) add_problem(check, g, true, "Free inode count too large");
+  }
+}
+
+static unsigned int count_zero_bits(const unsigned char *bitmap, uint32_t bits) {
+  unsigned int zeros = 0;
+  uint32_t i;
+
+  for (i = 0; i < bits; i++) {
+    if (!((bitmap[i >> 3] >> (i & 7)) & 1)) zeros++;
+  }
+
+  return zeros;
+}
+
+//
+// Pool task: read one group's block bitmap into the shared map and check
+// its free count.
+//
+static void read_block_bitmap(void *arg, int worker) {
+  GROUP_TASK *task = (GROUP_TASK *)arg;
+  EXT3_CHECK *check = task->check;
+  const EXT3_INFO *ext3 = &check->info.ext3;
+  const EXT3_GROUP *group = &check->groups[task->group];
+  uint32_t count = group_block_count(ext3, task->group);
+  unsigned char *bits = check->block_map + (size_t)task->group * (ext3->blocks_per_group / 8);
+  bool uninit = (ext3->feature_ro_compat & EXT3_FEATURE_RO_COMPAT_GDT_CSUM) && (group->flags & EXT3_BG_BLOCK_UNINIT);
+  unsigned char *bitmap;
+  unsigned int zeros;
+
+  // An uninitialised bitmap is taken as all in use, so nothing is
+  // reported as using a free block in it.
+  if (uninit) {
+    memset(bits, 0xFF, (count + 7) / 8);
+    pthread_mutex_lock(&check->lock);
+    check->free_blocks += group->free_blocks;
+    check->steps_done++;
+    pthread_mutex_unlock(&check->lock);
+    return;
+  }
+
+  bitmap = malloc(ext3->block_size);
+  if (!bitmap || !check_read(check, bitmap, ext3->block_size, (unsigned long long)group->block_bitmap * ext3->block_size)) {
+    add_problem(check, task->group, true, "Unable to read block bitmap");
+    free(bitmap);
+    memset(bits, 0xFF, (count + 7) / 8);
+    pthread_mutex_lock(&check->lock);
+    check->steps_done++;
+    pthread_mutex_unlock(&check->lock);
+    return;
+  }
+
+  memcpy(bits, bitmap, (count + 7) / 8);
+  zeros = count_zero_bits(bitmap, count);
+  free(bitmap);
+
+  if (zeros != group->free_blocks) {
+    add_problem(check, task->group, !check->writable, "Block bitmap has %u free, descriptor says %u",
+		zeros, group->free_blocks);
+  }
+
+  pthread_mutex_lock(&check->lock);
+  check->free_blocks += zeros;
+  check->steps_done++;
+  pthread_mutex_unlock(&check->lock);
+}
+
+static bool valid_mode(uint16_t mode) {
+  switch (S_TYPE(mode)) {
+  case S_TYPE_FIFO: case S_TYPE_CHR: case S_TYPE_DIR: case S_TYPE_BLK:
+  case S_TYPE_REG: case S_TYPE_LNK: case S_TYPE_SOCK:
+    return true;
+  default:
+    return false;
+  }
+}
+
+//
+// Check the block pointers of an inode in use: every one must be inside
+// the filesystem, and direct blocks must be marked in use.
+//
+static void check_inode_blocks(EXT3_CHECK *check, uint32_t group, uint32_t ino, const unsigned char *inode) {
+  const EXT3_INFO *ext3 = &check->info.ext3;
+  uint16_t mode = le16(inode + INODE_MODE);
+  int k;
+
+  // Device and pipe inodes have no blocks; fast symlinks keep their
+  // target in the block pointers.
+  if ((S_TYPE(mode) != S_TYPE_REG) && (S_TYPE(mode) != S_TYPE_DIR) && (S_TYPE(mode) != S_TYPE_LNK)) return;
+  if ((S_TYPE(mode) == S_TYPE_LNK) && !le32(inode + INODE_BLOCKS)) return;
+
+  if (le32(inode + INODE_FLAGS) & INODE_EXTENTS_FL) {
+    if (le16(inode + INODE_BLOCK) != EXTENT_MAGIC) add_problem(check, group, true, "Inode %u has a bad extent header", ino);
+    return;
+  }
+
+  for (k = 0; k < INODE_N_BLOCKS; k++) {
+    uint32_t block = le32(inode + INODE_BLOCK + k * 4);
+
+    if (!block) continue;
+
+    if (!valid_block(ext3, block)) {
+      add_problem(check, group, true, "Inode %u block %u is outside the filesystem", ino, block);
+      return;
+    }
+
+    if ((k < INODE_N_DIRECT) && !block_in_use(check, block)) {
+      add_problem(check, group, !check->writable, "Inode %u uses free block %u", ino, block);
+      return;
+    }
+  }
+}
+
+//
+// Pool task: check one group's inode bitmap and inode table.
+//
+static void check_inode_table(void *arg, int worker) {
+  GROUP_TASK *task = (GROUP_TASK *)arg;
+  EXT3_CHECK *check = task->check;
+  const EXT3_INFO *ext3 = &check->info.ext3;
+  const EXT3_GROUP *group = &check->groups[task->group];
+  bool csum = (ext3->feature_ro_compat & EXT3_FEATURE_RO_COMPAT_GDT_CSUM);
+  uint32_t count = ext3->inodes_per_group;
+  unsigned char *bitmap = NULL, *table = NULL;
+  unsigned int zeros, dirs = 0;
+  uint32_t i;
+
+  if (csum && (group->flags & EXT3_BG_INODE_UNINIT)) {
+    zeros = count;
+    count = 0;
+    goto done;
+  }
+
+  // Start the next group's table on its way while this one is checked.
+  if (task->group + 1 < ext3->group_count) {
+    posix_fadvise(check->fd, (off_t)check->groups[task->group + 1].inode_table * ext3->block_size,
+		  (off_t)inode_table_blocks(ext3) * ext3->block_size, POSIX_FADV_WILLNEED);
+  }
+
+  // Inodes past the high water mark have never been used.
+  if (csum && (group->itable_unused <= count)) count -= group->itable_unused;
+
+  bitmap = malloc(ext3->block_size);
+  table = malloc((size_t)count * ext3->inode_size + 1);
+  if (!bitmap || !table ||
+      !check_read(check, bitmap, ext3->block_size, (unsigned long long)group->inode_bitmap * ext3->block_size) ||
+      !check_read(check, table, (size_t)count * ext3->inode_size,
+		  (unsigned long long)group->inode_table * ext3->block_size)) {
+    add_problem(check, task->group, true, "Unable to read inode table");
+    zeros = group->free_inodes;
+    goto done;
+  }
+
+  zeros = count_zero_bits(bitmap, ext3->inodes_per_group);
+  if (zeros != group->free_inodes) {
+    add_problem(check, task->group, !check->writable, "Inode bitmap has %u free, descriptor says %u",
+		zeros, group->free_inodes);
+  }
+
+  for (i = 0; i < count; i++) {
+    const unsigned char *inode = table + (size_t)i * ext3->inode_size;
+    uint32_t ino = task->group * ext3->inodes_per_group + i + 1;
+    bool used = (bitmap[i >> 3] >> (i & 7)) & 1;
+    uint16_t mode = le16(inode + INODE_MODE);
+    uint16_t links = le16(inode + INODE_LINKS);
+    uint32_t dtime = le32(inode + INODE_DTIME);
+
+    if (!used) {
+      if ((ino >= ext3->first_ino) && mode && links && !dtime) {
+	add_problem(check, task->group, !check->writable, "Inode %u is live but marked free", ino);
+      }
+      continue;
+    }
+
+    if (S_TYPE(mode) == S_TYPE_DIR) dirs++;
+
+    // Reserved inodes other than the root have their own rules.
+    if (ino < ext3->first_ino) {
+      if ((ino == 2) && (S_TYPE(mode) != S_TYPE_DIR)) add_problem(check, task->group, true, "Root inode is not a directory");
+      continue;
+    }
+
+    if (!valid_mode(mode)) {
+      add_problem(check, task->group, true, "Inode %u has bad mode 0%o", ino, mode);
+      continue;
+    }
+
+    if (!links || dtime) {
+      add_problem(check, task->group, !check->writable, "Inode %u is in use but deleted", ino);
+      continue;
+    }
+
+    check_inode_blocks(check, task->group, ino, inode);
+  }
+
+  if (dirs != group->used_dirs) {
+    add_problem(check, task->group, !check->writable, "Group has %u directories, descriptor says %u",
+		dirs, group->used_dirs);
+  }
+
+ done:
+  free(bitmap);
+  free(table);
+
+  pthread_mutex_lock(&check->lock);
+  check->free_inodes += zeros;
+  check->inodes_checked += count;
+  check->steps_done++;
+  pthread_mutex_unlock(&check->lock);
+}
+
+static void report_progress(EXT3_CHECK *check, const char *phase) {
+  char buffer[MAXLINLEN];
+  unsigned long total = check->info.ext3.group_count * 2;
+  unsigned long done;
+
+  pthread_mutex_lock(&check->lock);
+  done = check->steps_done;
+  pthread_mutex_unlock(&check->lock);
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"%s\", \"groups\": %u, \"percent\": %lu}",
+	   phase, check->info.ext3.group_count, total ? done * 100 / total : 100);
+  respond_quietly(check->message, buffer);
+}
+
+//
+// Run one task per group on the pool, streaming progress until done.
+//
+static bool run_groups(EXT3_CHECK *check, thread_pool_t *pool, GROUP_TASK *tasks,
+		       pool_task_fn fn, const char *phase) {
+  uint32_t g;
+
+  for (g = 0; g < check->info.ext3.group_count; g++) {
+    if (!pool_submit(pool, POOL_EXTERNAL, fn, &tasks[g])) return false;
+  }
+
+  while (!pool_wait_timeout(pool, REPORT_MSECS)) report_progress(check, phase);
+
+  return true;
+}
+
+//
+// The native check proper.  Returns false if it could not be done at all.
+//
+static bool check_native(EXT3_CHECK *check) {
+  EXT3_INFO *ext3 = &check->info.ext3;
+  thread_pool_t *pool;
+  GROUP_TASK *tasks;
+  uint32_t g;
+  bool ok = false;
+
+  if (!fs_probe(check->fd, &check->info) || (check->info.type != FS_EXT3)) {
+    add_problem(check, -1, true, "No ext3 superblock found");
+    return true;
+  }
+
+  check_superblock(check);
+  if (check->error_count || check->unsupported) return true;
+
+  io_throttle_take(&check->throttle, (size_t)ext3->group_count * ext3->desc_size);
+  check->groups = ext3_read_groups(check->fd, ext3);
+  if (!check->groups) {
+    add_problem(check, -1, true, "Unable to read group descriptors");
+    return true;
+  }
+
+  check_descriptors(check);
+  if (check->error_count) return true;
+
+  check->block_map = calloc((size_t)ext3->group_count, ext3->blocks_per_group / 8);
+  tasks = calloc(ext3->group_count, sizeof(GROUP_TASK));
+  pool = pool_create(pool_default_threads());
+  if (!check->block_map || !tasks || !pool) goto end;
+
+  for (g = 0; g < ext3->group_count; g++) {
+    tasks[g].check = check;
+    tasks[g].group = g;
+  }
+
+  // Every block bitmap has to be in before inodes can be checked against it.
+  if (!run_groups(check, pool, tasks, read_block_bitmap, "blockBitmaps")) goto end;
+  if (!run_groups(check, pool, tasks, check_inode_table, "inodeTables")) goto end;
+
+  // The kernel only updates the superblock totals now and then.
+  if (!check->mounted && ((check->free_blocks != ext3->free_blocks) || (check->free_inodes != ext3->free_inodes))) {
+    add_problem(check, -1, false, "Superblock free counts differ from the groups");
+  }
+
+  ok = true;
+
+ end:
+  pool_destroy(pool);
+  free(tasks);
+  return ok;
+}
+
+//
+// Run e2fsck read-only, passing its output back as status messages.
+//
+static int check_full(EXT3_CHECK *check) {
+  char command[MAXLINLEN];
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char line[MAXLINLEN];
+  SPAWN_CHILD child;
+
+  snprintf(command, sizeof command, "/sbin/e2fsck -n -f %s", check->device);
+  if (!spawn_command_policy(&child, command, &check->policy)) return -1;
+
+  while (fgets(line, sizeof line, child.fp)) {
+    // Chomp the newline
+    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
+
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"e2fsck\", \"status\": \"%s\"}",
+	     json_escape_buf(line, esc));
+    respond_quietly(check->message, buffer);
+  }
+
+  return spawn_wait(&child);
+}
+
+void *ext3_check_thread(void *ctx) {
+  EXT3_CHECK *check = (EXT3_CHECK *)ctx;
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  struct timespec start, end;
+  long native_msecs;
+  bool suspicious, full;
+  int i, code = 0;
+  size_t len;
+
+  // The pool's workers and the fallback tool inherit this.
+  io_policy_apply(0, &check->policy);
+  io_throttle_init(&check->throttle, check->policy.limit);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  check->fd = open(check->device, O_RDONLY);
+  if ((check->fd < 0) || !check_native(check)) {
+    add_problem(check, -1, true, "Unable to read the volume");
+  }
+  if (check->fd >= 0) close(check->fd);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  native_msecs = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+  suspicious = (check->error_count > 0) || check->unsupported;
+  full = check->fallback && (suspicious || check->force);
+
+  len = snprintf(buffer, sizeof buffer,
+		 "{\"returnValue\": true, \"stage\": \"native\", \"clean\": %s, \"mounted\": %s, \"groups\": %u, "
+		 "\"inodesChecked\": %llu, \"errors\": %d, \"msecs\": %ld, \"fullCheck\": %s, \"problems\": [",
+		 suspicious ? "false" : "true", check->mounted ? "true" : "false", check->info.ext3.group_count,
+		 check->inodes_checked, check->error_count, native_msecs, full ? "true" : "false");
+
+  for (i = 0; (i < check->problem_count) && (i < EXT3_MAX_PROBLEMS) && (len < sizeof buffer - MAXLINLEN); i++) {
+    len += snprintf(buffer + len, sizeof buffer - len, "%s{\"group\": %ld, \"severity\": \"%s\", \"text\": \"%s\"}",
+		    i ? ", " : "", check->problems[i].group, check->problems[i].error ? "error" : "warning",
+		    json_escape_buf(check->problems[i].text, esc));
+  }
+
+  snprintf(buffer + len, sizeof buffer - len, "], \"moreProblems\": %d}",
+	   (check->problem_count > EXT3_MAX_PROBLEMS) ? check->problem_count - EXT3_MAX_PROBLEMS : 0);
+  respond_quietly(check->message, buffer);
+
+  if (full) code = check_full(check);
+
+  if (full && (code != 0)) {
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": false, \"errorCode\": %d, \"stage\": \"failed\", \"fullCheck\": true}", code);
+  }
+  else {
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"completed\", \"clean\": %s, \"fullCheck\": %s}",
+	     (full || !suspicious) ? "true" : "false", full ? "true" : "false");
+  }
+  respond_quietly(check->message, buffer);
+
+  pthread_mutex_lock(&check_lock);
+  check_running = false;
+  pthread_mutex_unlock(&check_lock);
+
+  free(check->groups);
+  free(check->block_map);
+  io_throttle_destroy(&check->throttle);
+  pthread_mutex_destroy(&check->lock);
+  LSMessageUnref(check->message);
+  free(check);
+
+  return NULL;
+}
+
+//
+// Quick read-only check of an ext3 volume, falling back to e2fsck -n -f
+// only if something looks wrong (or if asked to with force).
+//
+bool check_ext3fs_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem;
+  pthread_t thread;
+  EXT3_CHECK *check;
+
+  check = calloc(1, sizeof(EXT3_CHECK));
+  if (!check) goto failed;
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *filesystem = json_find_first_label(object, "filesystem");
+  json_t *fallback = json_find_first_label(object, "fallback");
+  json_t *force = json_find_first_label(object, "force");
+
+  strcpy(check->device, EXT3_DEFAULT_DEVICE);
+  if (filesystem && (filesystem->child->type == JSON_STRING) && (filesystem->child->text[0] == '/') &&
+      (strlen(filesystem->child->text) < sizeof check->device) && !strstr(filesystem->child->text, "..") &&
+      (strspn(filesystem->child->text, DEVICE_CHARS) == strlen(filesystem->child->text))) {
+    strcpy(check->device, filesystem->child->text);
+  }
+  check->fallback = !fallback || (fallback->child->type != JSON_FALSE);
+  check->force = force && (force->child->type == JSON_TRUE);
+  problem = io_policy_parse(object, &check->policy);
+
+  json_free_value(&object);
+
+  if (problem) {
+    free(check);
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\"}", problem);
+    if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+    return true;
+  }
+
+  check->mounted = fs_device_mounted(check->device, &check->writable);
+  pthread_mutex_init(&check->lock, NULL);
+
+  pthread_mutex_lock(&check_lock);
+  if (check_running) {
+    pthread_mutex_unlock(&check_lock);
+    log_printf(LOG_NOTICE, "Ext3 check already running\n");
+    pthread_mutex_destroy(&check->lock);
+    free(check);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  check_running = true;
+  pthread_mutex_unlock(&check_lock);
+
+  // Ref and save the message for use in check thread
+  LSMessageRef(message);
+  check->message = message;
+
+  if (pthread_create(&thread, NULL, ext3_check_thread, (void*)check)) {
+    LSMessageUnref(message);
+    pthread_mutex_destroy(&check->lock);
+    free(check);
+    pthread_mutex_lock(&check_lock);
+    check_running = false;
+    pthread_mutex_unlock(&check_lock);
+    goto failed;
+  }
+
+  pthread_detach(thread);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ failed:
+  log_printf(LOG_ERR, "Creating ext3 check thread failed\n");
+  if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to start check thread\"}", &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
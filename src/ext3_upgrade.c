@@ -0,0 +1,298 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "spawn.h"
+#include "io_policy.h"
+#include "fs_probe.h"
+#include "fstab.h"
+#include "ext3_check.h"
+#include "ext3_upgrade.h"
+
+typedef struct {
+  LSMessage *message;
+  char device[MAXLINLEN];
+  char mountpoint[MAXLINLEN];
+  IO_POLICY policy;
+  bool was_mounted;
+} UPGRADE_JOB;
+
+static pthread_mutex_t upgrade_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool upgrade_running = false;
+
+static bool kernel_has_ext4(void) {
+  char line[MAXLINLEN];
+  char name[MAXNAMLEN];
+  bool found = false;
+  FILE *fp = fopen("/proc/filesystems", "r");
+
+  if (!fp) return false;
+
+  while (!found && fgets(line, sizeof line, fp)) {
+    // Lines are the name, optionally preceded by "nodev".
+    if ((sscanf(line, "%*s %127s", name) == 1) || (sscanf(line, "%127s", name) == 1)) {
+      if (!strcmp(name, "ext4")) found = true;
+    }
+  }
+
+  fclose(fp);
+  return found;
+}
+
+//
+// Run a tool under the job's policy, passing its output back as status
+// messages for the given phase.  Returns its exit code (or -1), and how
+// long it took.
+//
+static int run_tool(UPGRADE_JOB *job, const char *phase, const char *command, long *msecs) {
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char line[MAXLINLEN];
+  struct timespec start, end;
+  SPAWN_CHILD child;
+  int code;
+
+  log_printf(LOG_INFO, "Running command %s\n", command);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!spawn_command_policy(&child, command, &job->policy)) return -1;
+
+  while (fgets(line, sizeof line, child.fp)) {
+    // Chomp the newline
+    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
+
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"%s\", \"status\": \"%s\"}",
+	     phase, json_escape_buf(line, esc));
+    respond_quietly(job->message, buffer);
+  }
+
+  code = spawn_wait(&child);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (msecs) *msecs = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+  return code;
+}
+
+static bool has_features(const UPGRADE_JOB *job, bool *all) {
+  FS_INFO info;
+  bool ok;
+  int fd;
+
+  fd = open(job->device, O_RDONLY);
+  if (fd < 0) return false;
+  ok = fs_probe(fd, &info) && (info.type == FS_EXT3);
+  close(fd);
+
+  *all = ok && (info.ext3.feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS) &&
+    (info.ext3.feature_ro_compat & EXT3_FEATURE_RO_COMPAT_GDT_CSUM) &&
+    (info.ext3.feature_compat & EXT3_FEATURE_COMPAT_DIR_INDEX);
+
+  return ok;
+}
+
+void *upgrade_thread(void *ctx) {
+  UPGRADE_JOB *job = (UPGRADE_JOB *)ctx;
+  char command[MAXLINLEN];
+  char buffer[MAXBUFLEN];
+  const char *failure = NULL;
+  long before_msecs = -1, after_msecs = -1;
+  bool upgraded = false, already;
+  int changed = 0;
+
+  // The tools inherit this.
+  io_policy_apply(0, &job->policy);
+
+  if (job->was_mounted) {
+    snprintf(command, sizeof command, "/bin/umount %s", job->mountpoint);
+    if (run_tool(job, "unmount", command, NULL) != 0) {
+      failure = "Unable to unmount the volume";
+      goto end;
+    }
+  }
+
+  // Time a full read-only check on the data as it stands, for comparison.
+  snprintf(command, sizeof command, "/sbin/e2fsck -f -n %s", job->device);
+  if (run_tool(job, "checkBefore", command, &before_msecs) != 0) {
+    failure = "Volume has errors, repair it first";
+    goto remount;
+  }
+
+  snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"checkBefore\", \"msecs\": %ld}",
+	   before_msecs);
+  respond_quietly(job->message, buffer);
+
+  if (!has_features(job, &already)) {
+    failure = "No ext3 superblock found";
+    goto remount;
+  }
+
+  if (!already) {
+    snprintf(command, sizeof command, "/sbin/tune2fs -O %s %s", EXT4_UPGRADE_FEATURES, job->device);
+    if (run_tool(job, "tune2fs", command, NULL) != 0) {
+      failure = "Unable to set the new features";
+      goto remount;
+    }
+    upgraded = true;
+
+    // uninit_bg requires this before the volume is mounted again; the
+    // rebuilt directories get their indexes along the way.
+    snprintf(command, sizeof command, "/sbin/e2fsck -f -y -D %s", job->device);
+    if (run_tool(job, "optimize", command, NULL) > 1) {
+      failure = "Check after setting features failed, the volume needs repair";
+      goto end;
+    }
+  }
+
+  // A volume with extents can no longer be mounted as ext3.
+  failure = fstab_update(job->device, job->mountpoint, "ext3", "ext4", NULL, &changed);
+  if (failure) {
+    if (upgraded) goto end;
+    goto remount;
+  }
+
+  snprintf(command, sizeof command, "/sbin/e2fsck -f -n %s", job->device);
+  if (run_tool(job, "checkAfter", command, &after_msecs) != 0) {
+    failure = "Volume has errors after the upgrade";
+    goto end;
+  }
+
+ remount:
+  if (job->was_mounted) {
+    snprintf(command, sizeof command, "/bin/mount %s", job->mountpoint);
+    if ((run_tool(job, "mount", command, NULL) != 0) && !failure) failure = "Unable to remount the volume";
+  }
+
+ end:
+  if (failure) {
+    log_printf(LOG_ERR, "Ext3 upgrade failed: %s\n", failure);
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\", "
+	     "\"upgraded\": %s, \"checkBeforeMsecs\": %ld}",
+	     failure, upgraded ? "true" : "false", before_msecs);
+  }
+  else {
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"completed\", \"upgraded\": %s, \"features\": \"%s\", "
+	     "\"fstabEntries\": %d, \"checkBeforeMsecs\": %ld, \"checkAfterMsecs\": %ld}",
+	     upgraded ? "true" : "false", EXT4_UPGRADE_FEATURES, changed, before_msecs, after_msecs);
+  }
+  respond_quietly(job->message, buffer);
+
+  pthread_mutex_lock(&upgrade_lock);
+  upgrade_running = false;
+  pthread_mutex_unlock(&upgrade_lock);
+  lvm_release();
+
+  LSMessageUnref(job->message);
+  free(job);
+
+  return NULL;
+}
+
+//
+// Turn on the ext4 features of the ext3fs volume (extent-mapped files,
+// uninitialised block groups and hashed directories) and mount it as
+// ext4 from then on, timing a full check before and after.  Files
+// already on the volume keep their block maps; new ones get extents.
+// There is no way back to ext3.
+//
+bool upgrade_ext3fs_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem = NULL;
+  pthread_t thread;
+  UPGRADE_JOB *job;
+  bool writable;
+
+  job = calloc(1, sizeof(UPGRADE_JOB));
+  if (!job) {
+    problem = "Out of memory";
+    goto refuse;
+  }
+
+  strcpy(job->device, EXT3_DEFAULT_DEVICE);
+  strcpy(job->mountpoint, EXT3_DEFAULT_MOUNTPOINT);
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  problem = io_policy_parse(object, &job->policy);
+  json_free_value(&object);
+  if (problem) goto refuse;
+
+  if (!kernel_has_ext4()) {
+    problem = "Kernel has no ext4 support";
+    goto refuse;
+  }
+
+  job->was_mounted = fs_device_mounted(job->device, &writable);
+
+  pthread_mutex_lock(&upgrade_lock);
+  if (upgrade_running || !lvm_claim("upgrade")) {
+    pthread_mutex_unlock(&upgrade_lock);
+    log_printf(LOG_NOTICE, "Upgrade thread already running\n");
+    free(job);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  upgrade_running = true;
+  pthread_mutex_unlock(&upgrade_lock);
+
+  // Ref and save the message for use in upgrade thread
+  LSMessageRef(message);
+  job->message = message;
+
+  if (pthread_create(&thread, NULL, upgrade_thread, (void*)job)) {
+    LSMessageUnref(message);
+    pthread_mutex_lock(&upgrade_lock);
+    upgrade_running = false;
+    pthread_mutex_unlock(&upgrade_lock);
+    lvm_release();
+    problem = "Unable to start upgrade thread";
+    goto refuse;
+  }
+
+  pthread_detach(thread);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ refuse:
+  free(job);
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}", problem);
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
@@ -0,0 +1,30 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef EXT3_UPGRADE_H_
+#define EXT3_UPGRADE_H_
+
+#include <lunaservice.h>
+
+// Features turned on, as tune2fs names them.  The kernels these devices
+// run predate metadata_csum, so uninit_bg is the group checksum used.
+#define EXT4_UPGRADE_FEATURES "extents,uninit_bg,dir_index"
+
+bool upgrade_ext3fs_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* EXT3_UPGRADE_H_ */
@@ -0,0 +1,751 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "thread_pool.h"
+#include "spawn.h"
+#include "io_policy.h"
+#include "fs_probe.h"
+#include "fat_check.h"
+
+// Characters allowed in a device path, on top of ALLOWED_CHARS.
+#define DEVICE_CHARS ALLOWED_CHARS "/_"
+
+// How often progress is streamed while the workers run.
+#define REPORT_MSECS 1000
+
+// Claims on clusters are made under one of these locks.
+#define CLAIM_STRIPES 64
+#define CLAIM_STRIPE(cluster) (((cluster) >> 10) % CLAIM_STRIPES)
+
+// FAT32 FSInfo sector
+#define FSINFO_SIGNATURE 0x41615252
+#define FSINFO_FREE      488
+
+// Cleared in the second FAT entry while the volume is in use.
+#define FAT_CLEAN_BIT(fat) ((fat)->fat_bits == 32 ? 0x08000000 : 0x8000)
+
+typedef struct {
+  bool error;
+  char path[MAXLINLEN];
+  char text[MAXNAMLEN];
+} FAT_PROBLEM;
+
+typedef struct fat_check {
+  LSMessage *message;
+  char device[MAXLINLEN];
+  bool fallback;
+  bool force;
+  IO_POLICY policy;
+  IO_THROTTLE throttle;
+
+  int fd;
+  bool mounted;
+  bool writable;
+  FS_INFO info;
+
+  // The FATs, mapped straight from the device.
+  unsigned char *map;
+  size_t map_len;
+  const unsigned char *fat;
+
+  thread_pool_t *pool;
+  unsigned char *claimed;
+  pthread_mutex_t stripes[CLAIM_STRIPES];
+
+  pthread_mutex_t lock;
+  unsigned long files;
+  unsigned long dirs;
+  unsigned long claimed_count;
+  unsigned long used_count;
+  unsigned long lost_clusters;
+  unsigned long lost_chains;
+  unsigned long cross_links;
+  int problem_count;
+  int error_count;
+  FAT_PROBLEM problems[FAT_MAX_PROBLEMS];
+} FAT_CHECK;
+
+typedef struct {
+  FAT_CHECK *check;
+  uint32_t cluster;
+  char path[MAXLINLEN];
+} DIR_TASK;
+
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool check_running = false;
+
+//
+// Note a problem.  While the volume is mounted read-write the FAT and the
+// directories can be caught between updates, so nothing is an error then.
+//
+static void add_problem(FAT_CHECK *check, const char *path, bool error, const char *format, ...) {
+  va_list args;
+
+  if (check->writable) error = false;
+
+  pthread_mutex_lock(&check->lock);
+
+  if (error) check->error_count++;
+
+  if (check->problem_count < FAT_MAX_PROBLEMS) {
+    FAT_PROBLEM *problem = &check->problems[check->problem_count];
+    problem->error = error;
+    strncpy(problem->path, path, sizeof problem->path - 1);
+    va_start(args, format);
+    vsnprintf(problem->text, sizeof problem->text, format, args);
+    va_end(args);
+  }
+  check->problem_count++;
+
+  pthread_mutex_unlock(&check->lock);
+}
+
+//
+// Read from the device, paced by the job's ioLimit.
+//
+static bool check_read(FAT_CHECK *check, void *buf, size_t len, unsigned long long offset) {
+  io_throttle_take(&check->throttle, len);
+  return pread_fully(check->fd, buf, len, offset);
+}
+
+static bool valid_cluster(const FAT_CHECK *check, uint32_t cluster) {
+  return (cluster >= 2) && (cluster < check->info.fat.cluster_count + 2);
+}
+
+static uint32_t next_cluster(const FAT_CHECK *check, uint32_t cluster) {
+  return fat_entry(&check->info.fat, check->fat, cluster);
+}
+
+//
+// Mark a cluster as belonging to a chain.  Returns false if some other
+// chain (or this one, in a loop) already has it.
+//
+static bool claim(FAT_CHECK *check, uint32_t cluster) {
+  pthread_mutex_t *stripe = &check->stripes[CLAIM_STRIPE(cluster)];
+  unsigned char bit = 1 << (cluster & 7);
+  bool taken;
+
+  pthread_mutex_lock(stripe);
+  taken = check->claimed[cluster >> 3] & bit;
+  check->claimed[cluster >> 3] |= bit;
+  pthread_mutex_unlock(stripe);
+
+  return !taken;
+}
+
+//
+// Follow a cluster chain, claiming each cluster.  Fills in the list (if
+// one is given) and the length.  Returns false if the chain is broken.
+//
+static bool walk_chain(FAT_CHECK *check, const char *path, uint32_t start,
+		       uint32_t *list, uint32_t max, uint32_t *length) {
+  const FAT_INFO *fat = &check->info.fat;
+  uint32_t cluster = start;
+  uint32_t n = 0;
+  bool ok = true;
+
+  while (true) {
+    uint32_t next;
+
+    if (!valid_cluster(check, cluster)) {
+      add_problem(check, path, true, "Chain points to invalid cluster %u", cluster);
+      ok = false;
+      break;
+    }
+
+    if (!claim(check, cluster)) {
+      add_problem(check, path, true, "Cluster %u is cross-linked", cluster);
+      pthread_mutex_lock(&check->lock);
+      check->cross_links++;
+      pthread_mutex_unlock(&check->lock);
+      ok = false;
+      break;
+    }
+
+    if (list && (n < max)) list[n] = cluster;
+    n++;
+
+    next = next_cluster(check, cluster);
+    if (next >= FAT_EOC(fat)) break;
+
+    if (next == FAT_FREE) {
+      add_problem(check, path, true, "Chain runs into free cluster after %u", cluster);
+      ok = false;
+      break;
+    }
+    if (next == FAT_BAD(fat)) {
+      add_problem(check, path, true, "Chain runs into bad cluster after %u", cluster);
+      ok = false;
+      break;
+    }
+
+    cluster = next;
+  }
+
+  pthread_mutex_lock(&check->lock);
+  check->claimed_count += n;
+  pthread_mutex_unlock(&check->lock);
+
+  *length = n;
+  return ok;
+}
+
+//
+// Turn a raw 8.3 name into NAME.EXT.
+//
+static void short_name(const unsigned char *entry, char *name) {
+  int i, len = 0;
+
+  for (i = 0; i < 8 && entry[i] != ' '; i++) name[len++] = (i == 0 && entry[0] == 0x05) ? (char)0xE5 : entry[i];
+
+  if (entry[8] != ' ') {
+    name[len++] = '.';
+    for (i = 8; i < 11 && entry[i] != ' '; i++) name[len++] = entry[i];
+  }
+
+  name[len] = '\0';
+}
+
+static bool valid_name(const unsigned char *entry) {
+  int i;
+
+  for (i = 0; i < 11; i++) {
+    unsigned char c = entry[i];
+    if ((i == 0) && (c == 0x05)) continue;
+    if ((c < 0x20) || strchr("\"*+,/:;<=>?[\\]|", c)) return false;
+  }
+
+  return entry[0] != ' ';
+}
+
+static void scan_dir(void *arg, int worker);
+
+//
+// Check a block of directory entries.  Returns false at the end marker.
+//
+static bool scan_entries(FAT_CHECK *check, DIR_TASK *task, const unsigned char *buf, uint32_t count, int worker) {
+  const FAT_INFO *fat = &check->info.fat;
+  char name[16];
+  uint32_t i;
+
+  for (i = 0; i < count; i++) {
+    const unsigned char *entry = buf + (size_t)i * FAT_DIRENT_SIZE;
+    unsigned char attr = entry[FAT_DIRENT_ATTR];
+    uint32_t start, size, length;
+    char path[MAXLINLEN];
+
+    if (entry[0] == FAT_DIRENT_END) return false;
+    if (entry[0] == FAT_DIRENT_DELETED) continue;
+    if ((attr & FAT_ATTR_LFN) == FAT_ATTR_LFN) continue;
+    if (attr & FAT_ATTR_VOLUME) continue;
+
+    start = le16(entry + FAT_DIRENT_CLUSTER_LO);
+    if (fat->fat_bits == 32) start |= (uint32_t)le16(entry + FAT_DIRENT_CLUSTER_HI) << 16;
+    size = le32(entry + FAT_DIRENT_SIZE_FIELD);
+
+    if (!memcmp(entry, ".          ", 11)) {
+      if (task->cluster && (start != task->cluster)) add_problem(check, task->path, true, "\".\" does not point to itself");
+      continue;
+    }
+    if (!memcmp(entry, "..         ", 11)) continue;
+
+    short_name(entry, name);
+    snprintf(path, sizeof path, "%s/%s", task->path, name);
+
+    if (!valid_name(entry)) add_problem(check, path, false, "Name has invalid characters");
+
+    if (attr & FAT_ATTR_DIR) {
+      DIR_TASK *sub;
+
+      pthread_mutex_lock(&check->lock);
+      check->dirs++;
+      pthread_mutex_unlock(&check->lock);
+
+      if (!valid_cluster(check, start)) {
+	add_problem(check, path, true, "Directory has invalid start cluster %u", start);
+	continue;
+      }
+
+      sub = malloc(sizeof(DIR_TASK));
+      if (!sub) continue;
+      sub->check = check;
+      sub->cluster = start;
+      strcpy(sub->path, path);
+      if (!pool_submit(check->pool, worker, scan_dir, sub)) free(sub);
+      continue;
+    }
+
+    pthread_mutex_lock(&check->lock);
+    check->files++;
+    pthread_mutex_unlock(&check->lock);
+
+    if (!start) {
+      if (size) add_problem(check, path, true, "File has size %u but no clusters", size);
+      continue;
+    }
+
+    if (walk_chain(check, path, start, NULL, 0, &length) &&
+	(length != (uint32_t)(((unsigned long long)size + fat->cluster_bytes - 1) / fat->cluster_bytes))) {
+      add_problem(check, path, true, "File size is %u bytes, cluster chain length is %u", size, length);
+    }
+  }
+
+  return true;
+}
+
+//
+// Pool task: check one directory, queueing its subdirectories.
+//
+static void scan_dir(void *arg, int worker) {
+  DIR_TASK *task = (DIR_TASK *)arg;
+  FAT_CHECK *check = task->check;
+  const FAT_INFO *fat = &check->info.fat;
+  uint32_t max = FAT_MAX_DIR_ENTRIES * FAT_DIRENT_SIZE / fat->cluster_bytes + 1;
+  uint32_t *clusters = NULL;
+  unsigned char *buf = NULL;
+  uint32_t length, i;
+
+  // FAT12/16 keep the root in a fixed area before the data.
+  if (!task->cluster) {
+    buf = malloc((size_t)fat->root_entries * FAT_DIRENT_SIZE);
+    if (buf && check_read(check, buf, (size_t)fat->root_entries * FAT_DIRENT_SIZE, fat->root_offset)) {
+      scan_entries(check, task, buf, fat->root_entries, worker);
+    }
+    else {
+      add_problem(check, "/", true, "Unable to read root directory");
+    }
+    goto end;
+  }
+
+  clusters = malloc(max * sizeof(uint32_t));
+  buf = malloc(fat->cluster_bytes);
+  if (!clusters || !buf) goto end;
+
+  walk_chain(check, task->path, task->cluster, clusters, max, &length);
+  if (length > max) {
+    add_problem(check, task->path, true, "Directory is too large (%u clusters)", length);
+    length = max;
+  }
+
+  for (i = 0; i < length; i++) {
+    if (!check_read(check, buf, fat->cluster_bytes, fat_cluster_offset(fat, clusters[i]))) {
+      add_problem(check, task->path, true, "Unable to read directory cluster %u", clusters[i]);
+      break;
+    }
+    if (!scan_entries(check, task, buf, fat->cluster_bytes / FAT_DIRENT_SIZE, worker)) break;
+  }
+
+ end:
+  free(clusters);
+  free(buf);
+  free(task);
+}
+
+//
+// Map the FATs, and check that the copies agree.
+//
+static bool map_fats(FAT_CHECK *check) {
+  const FAT_INFO *fat = &check->info.fat;
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned long long start = fat->fat_offset / page * page;
+  size_t bytes = (size_t)fat->fat_sectors * fat->bytes_per_sector;
+  unsigned int copy;
+
+  if ((unsigned long long)(fat->cluster_count + 2) * fat->fat_bits > (unsigned long long)bytes * 8) {
+    add_problem(check, "/", true, "FAT is too small for %u clusters", fat->cluster_count);
+    return false;
+  }
+
+  check->map_len = fat->fat_offset - start + bytes * fat->num_fats;
+  check->map = mmap(NULL, check->map_len, PROT_READ, MAP_SHARED, check->fd, start);
+  if (check->map == MAP_FAILED) {
+    check->map = NULL;
+    add_problem(check, "/", true, "Unable to map the FAT");
+    return false;
+  }
+
+  // The read-ahead pulls in the whole map, so pay for it up front.
+  io_throttle_take(&check->throttle, check->map_len);
+  madvise(check->map, check->map_len, MADV_WILLNEED);
+  check->fat = check->map + (fat->fat_offset - start);
+
+  for (copy = 1; copy < fat->num_fats; copy++) {
+    if (memcmp(check->fat, check->fat + bytes * copy, bytes)) {
+      add_problem(check, "/", true, "FAT copy %u differs from the first", copy + 1);
+    }
+  }
+
+  return true;
+}
+
+//
+// Anything the FAT says is in use but no chain reached is lost.
+//
+static void find_lost(FAT_CHECK *check) {
+  const FAT_INFO *fat = &check->info.fat;
+  uint32_t end = fat->cluster_count + 2;
+  unsigned char *successor = calloc(end / 8 + 1, 1);
+  uint32_t cluster, free_count = 0;
+  unsigned char sector[512];
+
+  for (cluster = 2; cluster < end; cluster++) {
+    uint32_t next = next_cluster(check, cluster);
+
+    if (next == FAT_FREE) {
+      free_count++;
+      continue;
+    }
+    if (next == FAT_BAD(fat)) continue;
+
+    check->used_count++;
+
+    if (check->claimed[cluster >> 3] & (1 << (cluster & 7))) continue;
+
+    check->lost_clusters++;
+    if (successor && valid_cluster(check, next)) successor[next >> 3] |= 1 << (next & 7);
+  }
+
+  // A lost chain starts at a lost cluster that no other lost cluster points to.
+  for (cluster = 2; successor && (cluster < end); cluster++) {
+    uint32_t next = next_cluster(check, cluster);
+    if ((next == FAT_FREE) || (next == FAT_BAD(fat))) continue;
+    if (check->claimed[cluster >> 3] & (1 << (cluster & 7))) continue;
+    if (!(successor[cluster >> 3] & (1 << (cluster & 7)))) check->lost_chains++;
+  }
+  free(successor);
+
+  if (check->lost_clusters) {
+    add_problem(check, "/", true, "%lu lost clusters in %lu chains (%llu bytes)", check->lost_clusters,
+		check->lost_chains, (unsigned long long)check->lost_clusters * fat->cluster_bytes);
+  }
+
+  // FAT32 keeps a hint of the free count, which may lag behind.
+  if ((fat->fat_bits == 32) && check_read(check, sector, sizeof sector, 0)) {
+    uint16_t fsinfo = le16(sector + 48);
+    if (fsinfo && check_read(check, sector, sizeof sector, (unsigned long long)fsinfo * fat->bytes_per_sector) &&
+	(le32(sector) == FSINFO_SIGNATURE) && (le32(sector + FSINFO_FREE) != 0xFFFFFFFF) &&
+	(le32(sector + FSINFO_FREE) != free_count)) {
+      add_problem(check, "/", false, "Free cluster summary says %u, FAT has %u", le32(sector + FSINFO_FREE), free_count);
+    }
+  }
+}
+
+static void report_progress(FAT_CHECK *check) {
+  char buffer[MAXLINLEN];
+  unsigned long files, dirs, claimed;
+
+  if (!check->message) return;
+
+  pthread_mutex_lock(&check->lock);
+  files = check->files;
+  dirs = check->dirs;
+  claimed = check->claimed_count;
+  pthread_mutex_unlock(&check->lock);
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"status\", \"files\": %lu, \"dirs\": %lu, \"clusters\": %lu, \"totalClusters\": %u}",
+	   files, dirs, claimed, check->info.fat.cluster_count);
+  respond_quietly(check->message, buffer);
+}
+
+//
+// The native check proper.  Returns false if it could not be done at all.
+//
+static bool check_native(FAT_CHECK *check) {
+  const FAT_INFO *fat = &check->info.fat;
+  DIR_TASK *root;
+  int i;
+
+  if (!fs_probe(check->fd, &check->info) || (check->info.type != FS_FAT)) {
+    add_problem(check, "/", true, "No FAT boot sector found");
+    return true;
+  }
+
+  if (fat_cluster_offset(fat, fat->cluster_count + 2) > check->info.device_bytes) {
+    add_problem(check, "/", true, "Filesystem is larger than its device");
+    return true;
+  }
+
+  if (!map_fats(check)) return true;
+
+  // FAT12 has no room for the flag.
+  if ((fat->fat_bits != 12) && !(fat_entry(fat, check->fat, 1) & FAT_CLEAN_BIT(fat))) {
+    add_problem(check, "/", true, "Volume was not cleanly unmounted");
+  }
+
+  check->claimed = calloc((fat->cluster_count + 2) / 8 + 1, 1);
+  root = malloc(sizeof(DIR_TASK));
+  check->pool = pool_create(pool_default_threads());
+  if (!check->claimed || !root || !check->pool) {
+    free(root);
+    return false;
+  }
+
+  for (i = 0; i < CLAIM_STRIPES; i++) pthread_mutex_init(&check->stripes[i], NULL);
+
+  root->check = check;
+  root->cluster = (fat->fat_bits == 32) ? fat->root_cluster : 0;
+  root->path[0] = '\0';
+
+  if (!pool_submit(check->pool, POOL_EXTERNAL, scan_dir, root)) {
+    free(root);
+    return false;
+  }
+
+  while (!pool_wait_timeout(check->pool, REPORT_MSECS)) report_progress(check);
+
+  find_lost(check);
+
+  for (i = 0; i < CLAIM_STRIPES; i++) pthread_mutex_destroy(&check->stripes[i]);
+
+  return true;
+}
+
+//
+// Run fsck.vfat read-only (without its slow verify pass), passing its
+// output back as status messages.
+//
+static int check_full(FAT_CHECK *check) {
+  char command[MAXLINLEN];
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char line[MAXLINLEN];
+  SPAWN_CHILD child;
+
+  snprintf(command, sizeof command, "/usr/sbin/fsck.vfat -n -v %s", check->device);
+  if (!spawn_command_policy(&child, command, &check->policy)) return -1;
+
+  while (fgets(line, sizeof line, child.fp)) {
+    // Chomp the newline
+    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
+
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"fsck\", \"status\": \"%s\"}",
+	     json_escape_buf(line, esc));
+    respond_quietly(check->message, buffer);
+  }
+
+  return spawn_wait(&child);
+}
+
+void *fat_check_thread(void *ctx) {
+  FAT_CHECK *check = (FAT_CHECK *)ctx;
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char esc_path[MAXBUFLEN];
+  struct timespec start, end;
+  long msecs;
+  bool full;
+  int i, code = 0;
+  size_t len;
+
+  // The pool's workers and the fallback tool inherit this.
+  io_policy_apply(0, &check->policy);
+  io_throttle_init(&check->throttle, check->policy.limit);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  check->fd = open(check->device, O_RDONLY);
+  if ((check->fd < 0) || !check_native(check)) {
+    add_problem(check, "/", true, "Unable to read the volume");
+  }
+
+  pool_destroy(check->pool);
+  if (check->map) munmap(check->map, check->map_len);
+  if (check->fd >= 0) close(check->fd);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  msecs = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+  full = check->fallback && ((check->error_count > 0) || check->force);
+
+  len = snprintf(buffer, sizeof buffer,
+		 "{\"returnValue\": true, \"stage\": \"native\", \"clean\": %s, \"mounted\": %s, \"files\": %lu, "
+		 "\"dirs\": %lu, \"usedClusters\": %lu, \"lostClusters\": %lu, \"lostChains\": %lu, "
+		 "\"crossLinks\": %lu, \"errors\": %d, \"msecs\": %ld, \"fullCheck\": %s, \"problems\": [",
+		 check->error_count ? "false" : "true", check->mounted ? "true" : "false",
+		 check->files, check->dirs, check->used_count, check->lost_clusters, check->lost_chains,
+		 check->cross_links, check->error_count, msecs, full ? "true" : "false");
+
+  for (i = 0; (i < check->problem_count) && (i < FAT_MAX_PROBLEMS) && (len < sizeof buffer - 3 * MAXLINLEN); i++) {
+    len += snprintf(buffer + len, sizeof buffer - len, "%s{\"path\": \"%s\", \"severity\": \"%s\", \"text\": \"%s\"}",
+		    i ? ", " : "", json_escape_buf(check->problems[i].path[0] ? check->problems[i].path : "/", esc_path),
+		    check->problems[i].error ? "error" : "warning", json_escape_buf(check->problems[i].text, esc));
+  }
+
+  snprintf(buffer + len, sizeof buffer - len, "], \"moreProblems\": %d}",
+	   (check->problem_count > i) ? check->problem_count - i : 0);
+  respond_quietly(check->message, buffer);
+
+  if (full) code = check_full(check);
+
+  if (full && (code != 0)) {
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": false, \"errorCode\": %d, \"stage\": \"failed\", \"fullCheck\": true}", code);
+  }
+  else {
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"completed\", \"clean\": %s, \"fullCheck\": %s}",
+	     (full || !check->error_count) ? "true" : "false", full ? "true" : "false");
+  }
+  respond_quietly(check->message, buffer);
+
+  pthread_mutex_lock(&check_lock);
+  check_running = false;
+  pthread_mutex_unlock(&check_lock);
+
+  free(check->claimed);
+  io_throttle_destroy(&check->throttle);
+  pthread_mutex_destroy(&check->lock);
+  LSMessageUnref(check->message);
+  free(check);
+
+  return NULL;
+}
+
+//
+// Run the native check on an open volume, quietly, before a job writes to
+// it.  Returns NULL if the filesystem is clean, or why it is not.
+//
+const char *fat_check_device(int fd, const IO_POLICY *policy) {
+  const char *failure = NULL;
+  FAT_CHECK *check;
+  int i;
+
+  check = calloc(1, sizeof(FAT_CHECK));
+  if (!check) return "Out of memory";
+
+  check->fd = fd;
+  check->policy = *policy;
+  io_throttle_init(&check->throttle, policy->limit);
+  pthread_mutex_init(&check->lock, NULL);
+
+  if (!check_native(check)) failure = "Unable to check the filesystem";
+  else if (check->error_count) failure = "Filesystem has errors, it must be repaired first";
+
+  for (i = 0; (i < check->problem_count) && (i < FAT_MAX_PROBLEMS); i++) {
+    log_printf(LOG_WARNING, "%s: %s\n", check->problems[i].path[0] ? check->problems[i].path : "/",
+	       check->problems[i].text);
+  }
+
+  pool_destroy(check->pool);
+  if (check->map) munmap(check->map, check->map_len);
+  free(check->claimed);
+  io_throttle_destroy(&check->throttle);
+  pthread_mutex_destroy(&check->lock);
+  free(check);
+
+  return failure;
+}
+
+//
+// Quick read-only check of the media volume, falling back to fsck.vfat
+// only if something looks wrong (or if asked to with force).
+//
+bool check_media_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem;
+  pthread_t thread;
+  FAT_CHECK *check;
+
+  check = calloc(1, sizeof(FAT_CHECK));
+  if (!check) goto failed;
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *filesystem = json_find_first_label(object, "filesystem");
+  json_t *fallback = json_find_first_label(object, "fallback");
+  json_t *force = json_find_first_label(object, "force");
+
+  strcpy(check->device, FAT_DEFAULT_DEVICE);
+  if (filesystem && (filesystem->child->type == JSON_STRING) && (filesystem->child->text[0] == '/') &&
+      (strlen(filesystem->child->text) < sizeof check->device) && !strstr(filesystem->child->text, "..") &&
+      (strspn(filesystem->child->text, DEVICE_CHARS) == strlen(filesystem->child->text))) {
+    strcpy(check->device, filesystem->child->text);
+  }
+  check->fallback = !fallback || (fallback->child->type != JSON_FALSE);
+  check->force = force && (force->child->type == JSON_TRUE);
+  problem = io_policy_parse(object, &check->policy);
+
+  json_free_value(&object);
+
+  if (problem) {
+    free(check);
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\"}", problem);
+    if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+    return true;
+  }
+
+  check->fd = -1;
+  check->mounted = fs_device_mounted(check->device, &check->writable);
+  pthread_mutex_init(&check->lock, NULL);
+
+  pthread_mutex_lock(&check_lock);
+  if (check_running) {
+    pthread_mutex_unlock(&check_lock);
+    log_printf(LOG_NOTICE, "Media check already running\n");
+    pthread_mutex_destroy(&check->lock);
+    free(check);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  check_running = true;
+  pthread_mutex_unlock(&check_lock);
+
+  // Ref and save the message for use in check thread
+  LSMessageRef(message);
+  check->message = message;
+
+  if (pthread_create(&thread, NULL, fat_check_thread, (void*)check)) {
+    LSMessageUnref(message);
+    pthread_mutex_destroy(&check->lock);
+    free(check);
+    pthread_mutex_lock(&check_lock);
+    check_running = false;
+    pthread_mutex_unlock(&check_lock);
+    goto failed;
+  }
+
+  pthread_detach(thread);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ failed:
+  log_printf(LOG_ERR, "Creating media check thread failed\n");
+  if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to start check thread\"}", &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
@@ -0,0 +1,38 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef FAT_CHECK_H_
+#define FAT_CHECK_H_
+
+#include <lunaservice.h>
+
+#include "io_policy.h"
+
+#define FAT_DEFAULT_DEVICE "/dev/store/media"
+
+// Most problems listed in a report; the rest are only counted.
+#define FAT_MAX_PROBLEMS 32
+
+// A directory may not hold more entries than this (the FAT limit).
+#define FAT_MAX_DIR_ENTRIES 65536
+
+bool check_media_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+const char *fat_check_device(int fd, const IO_POLICY *policy);
+
+#endif /* FAT_CHECK_H_ */
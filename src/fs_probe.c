@@ -0,0 +1,432 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "luna_methods.h"
+#include "fs_probe.h"
+
+//
+// On-disk structures are little endian and not necessarily aligned,
+// so fields are always picked out a byte at a time.
+//
+uint16_t le16(const unsigned char *p) {
+  return p[0] | (p[1] << 8);
+}
+
+uint32_t le32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Volumes and images pass 4 GiB, so offsets must not be cut to 32 bits.
+typedef char off_t_must_be_64_bits[(sizeof(off_t) == 8) ? 1 : -1];
+
+//
+// Read or write the whole of a buffer at an offset, or fail.
+//
+bool pread_fully(int fd, void *buf, size_t len, unsigned long long offset) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pread(fd, (char *)buf + done, len - done, offset + done);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+
+  return true;
+}
+
+bool pwrite_fully(int fd, const void *buf, size_t len, unsigned long long offset) {
+  size_t done = 0;
+
+  while (done < len) {
+    ssize_t n = pwrite(fd, (const char *)buf + done, len - done, offset + done);
+    if ((n < 0) && (errno == EINTR)) continue;
+    if (n <= 0) return false;
+    done += n;
+  }
+
+  return true;
+}
+
+static bool probe_fat(const unsigned char *b, FAT_INFO *fat) {
+  uint32_t total, root_sectors, data_sectors, reserved;
+
+  if ((b[510] != 0x55) || (b[511] != 0xAA)) return false;
+
+  fat->bytes_per_sector = le16(b + 11);
+  fat->sectors_per_cluster = b[13];
+  reserved = le16(b + 14);
+  fat->num_fats = b[16];
+  fat->root_entries = le16(b + 17);
+  fat->fat_sectors = le16(b + 22) ? le16(b + 22) : le32(b + 36);
+  total = le16(b + 19) ? le16(b + 19) : le32(b + 32);
+
+  if ((fat->bytes_per_sector < 512) || (fat->bytes_per_sector > 4096) ||
+      (fat->bytes_per_sector & (fat->bytes_per_sector - 1))) return false;
+  if (!fat->sectors_per_cluster || (fat->sectors_per_cluster & (fat->sectors_per_cluster - 1))) return false;
+  if (!reserved || !fat->num_fats || (fat->num_fats > 2) || !fat->fat_sectors) return false;
+
+  root_sectors = (fat->root_entries * 32 + fat->bytes_per_sector - 1) / fat->bytes_per_sector;
+  if (total <= reserved + fat->num_fats * fat->fat_sectors + root_sectors) return false;
+
+  data_sectors = total - reserved - fat->num_fats * fat->fat_sectors - root_sectors;
+
+  fat->cluster_bytes = fat->bytes_per_sector * fat->sectors_per_cluster;
+  fat->cluster_count = data_sectors / fat->sectors_per_cluster;
+  fat->fat_bits = (fat->cluster_count < 4085) ? 12 : (fat->cluster_count < 65525) ? 16 : 32;
+  fat->root_cluster = (fat->fat_bits == 32) ? le32(b + 44) : 0;
+
+  fat->fat_offset = (unsigned long long)reserved * fat->bytes_per_sector;
+  fat->root_offset = fat->fat_offset + (unsigned long long)fat->num_fats * fat->fat_sectors * fat->bytes_per_sector;
+  fat->data_offset = fat->root_offset + (unsigned long long)root_sectors * fat->bytes_per_sector;
+
+  return true;
+}
+
+static bool probe_ext3(const unsigned char *s, EXT3_INFO *ext3) {
+  uint32_t log_block_size;
+
+  if (le16(s + 56) != EXT3_MAGIC) return false;
+
+  log_block_size = le32(s + 24);
+  if (log_block_size > 6) return false;
+
+  ext3->block_size = 1024 << log_block_size;
+  ext3->inodes_count = le32(s + 0);
+  ext3->blocks_count = le32(s + 4);
+  ext3->free_blocks = le32(s + 12);
+  ext3->free_inodes = le32(s + 16);
+  ext3->first_data_block = le32(s + 20);
+  ext3->blocks_per_group = le32(s + 32);
+  ext3->inodes_per_group = le32(s + 40);
+  ext3->mount_count = le16(s + 52);
+  ext3->max_mount_count = (int16_t)le16(s + 54);
+  ext3->state = le16(s + 58);
+  ext3->last_check = le32(s + 64);
+  ext3->inode_size = le32(s + 76) ? le16(s + 88) : 128;
+  ext3->first_ino = le32(s + 76) ? le32(s + 84) : 11;
+  ext3->feature_compat = le32(s + 92);
+  ext3->feature_incompat = le32(s + 96);
+  ext3->feature_ro_compat = le32(s + 100);
+  ext3->desc_size = (ext3->feature_incompat & EXT3_FEATURE_INCOMPAT_64BIT) ? le16(s + 254) : 32;
+
+  if (!ext3->blocks_per_group || !ext3->inodes_per_group || (ext3->desc_size < 32)) return false;
+  if (ext3->blocks_count <= ext3->first_data_block) return false;
+
+  ext3->group_count = (ext3->blocks_count - ext3->first_data_block + ext3->blocks_per_group - 1) /
+    ext3->blocks_per_group;
+
+  return true;
+}
+
+//
+// Identify the filesystem on a device from its boot sector or superblock,
+// or a swap area from its signature.  Returns false (with the type set to
+// FS_UNKNOWN) if it is none of these.
+//
+bool fs_probe(int fd, FS_INFO *info) {
+  unsigned char buf[SWAP_PROBE_PAGE];
+
+  memset(info, 0, sizeof(FS_INFO));
+  info->type = FS_UNKNOWN;
+
+  if (ioctl(fd, BLKGETSIZE64, &info->device_bytes)) {
+    off_t end = lseek(fd, 0, SEEK_END);
+    info->device_bytes = (end > 0) ? end : 0;
+  }
+
+  if (!pread_fully(fd, buf, sizeof buf, 0)) return false;
+
+  if (probe_ext3(buf + EXT3_SUPER_OFFSET, &info->ext3)) info->type = FS_EXT3;
+  else if (probe_fat(buf, &info->fat)) info->type = FS_FAT;
+  else if (!memcmp(buf + SWAP_PROBE_PAGE - strlen(SWAP_PROBE_SIGNATURE), SWAP_PROBE_SIGNATURE,
+		   strlen(SWAP_PROBE_SIGNATURE))) info->type = FS_SWAP;
+
+  return (info->type != FS_UNKNOWN);
+}
+
+const char *fs_type_name(FS_TYPE type) {
+  switch (type) {
+  case FS_FAT:  return "vfat";
+  case FS_EXT3: return "ext3";
+  case FS_SWAP: return "swap";
+  default:      return "unknown";
+  }
+}
+
+//
+// Pick entry n out of a raw copy of the FAT.  FAT12 reads one byte past
+// the entry, so a FAT12 table needs a byte of padding at the end.
+//
+uint32_t fat_entry(const FAT_INFO *fat, const unsigned char *raw, uint32_t n) {
+  uint32_t value;
+
+  switch (fat->fat_bits) {
+  case 32:
+    return le32(raw + (size_t)n * 4) & 0x0FFFFFFF;
+  case 16:
+    return le16(raw + (size_t)n * 2);
+  default:
+    value = le16(raw + n + n / 2);
+    return (n & 1) ? (value >> 4) : (value & 0xFFF);
+  }
+}
+
+//
+// Store an entry in a raw FAT, leaving the bits it shares alone.
+//
+void fat_set_entry(const FAT_INFO *fat, unsigned char *raw, uint32_t n, uint32_t value) {
+  unsigned char *p;
+
+  switch (fat->fat_bits) {
+  case 32:
+    p = raw + (size_t)n * 4;
+    value = (value & 0x0FFFFFFF) | (le32(p) & 0xF0000000);
+    p[0] = value; p[1] = value >> 8; p[2] = value >> 16; p[3] = value >> 24;
+    break;
+  case 16:
+    p = raw + (size_t)n * 2;
+    p[0] = value; p[1] = value >> 8;
+    break;
+  default:
+    p = raw + n + n / 2;
+    if (n & 1) {
+      p[0] = (p[0] & 0x0F) | ((value << 4) & 0xF0);
+      p[1] = value >> 4;
+    }
+    else {
+      p[0] = value;
+      p[1] = (p[1] & 0xF0) | ((value >> 8) & 0x0F);
+    }
+    break;
+  }
+}
+
+//
+// Read the first copy of the FAT, widening every entry to 32 bits.
+// The result has an entry for every cluster number up to cluster_count+1.
+//
+uint32_t *fat_read_table(int fd, const FAT_INFO *fat) {
+  size_t bytes = (size_t)fat->fat_sectors * fat->bytes_per_sector;
+  uint32_t entries = fat->cluster_count + 2;
+  unsigned char *raw;
+  uint32_t *table;
+  uint32_t n;
+
+  // The FAT must be big enough to describe every cluster.
+  if ((unsigned long long)entries * fat->fat_bits > (unsigned long long)bytes * 8) return NULL;
+
+  raw = malloc(bytes + 1);
+  table = malloc(entries * sizeof(uint32_t));
+  if (!raw || !table || !pread_fully(fd, raw, bytes, fat->fat_offset)) {
+    free(raw);
+    free(table);
+    return NULL;
+  }
+  raw[bytes] = 0;
+
+  for (n = 0; n < entries; n++) table[n] = fat_entry(fat, raw, n);
+
+  free(raw);
+  return table;
+}
+
+unsigned long long fat_cluster_offset(const FAT_INFO *fat, uint32_t cluster) {
+  return fat->data_offset + (unsigned long long)(cluster - 2) * fat->cluster_bytes;
+}
+
+//
+// Read the ext3 group descriptor table, which follows the superblock.
+//
+EXT3_GROUP *ext3_read_groups(int fd, const EXT3_INFO *ext3) {
+  size_t bytes = (size_t)ext3->group_count * ext3->desc_size;
+  unsigned long long offset = (unsigned long long)(ext3->first_data_block + 1) * ext3->block_size;
+  unsigned char *raw = malloc(bytes);
+  EXT3_GROUP *groups = calloc(ext3->group_count, sizeof(EXT3_GROUP));
+  uint32_t g;
+
+  if (!raw || !groups || !pread_fully(fd, raw, bytes, offset)) {
+    free(raw);
+    free(groups);
+    return NULL;
+  }
+
+  for (g = 0; g < ext3->group_count; g++) {
+    const unsigned char *d = raw + (size_t)g * ext3->desc_size;
+    groups[g].block_bitmap = le32(d + 0);
+    groups[g].inode_bitmap = le32(d + 4);
+    groups[g].inode_table = le32(d + 8);
+    groups[g].free_blocks = le16(d + 12);
+    groups[g].free_inodes = le16(d + 14);
+    groups[g].used_dirs = le16(d + 16);
+    groups[g].flags = le16(d + 18);
+    groups[g].itable_unused = le16(d + 28);
+  }
+
+  free(raw);
+  return groups;
+}
+
+static void mark_used(unsigned char *map, unsigned int unit, unsigned long long units,
+		      unsigned long long offset, unsigned long long length) {
+  unsigned long long first = offset / unit;
+  unsigned long long last = (offset + length - 1) / unit;
+
+  if (!length) return;
+  if (last >= units) last = units - 1;
+
+  for (; first <= last; first++) map[first] = 1;
+}
+
+static bool fat_used(int fd, const FAT_INFO *fat, unsigned int unit, unsigned long long units,
+		     unsigned char *map) {
+  uint32_t *table = fat_read_table(fd, fat);
+  uint32_t cluster;
+
+  if (!table) return false;
+
+  // Boot sector, FATs and any fixed root directory
+  mark_used(map, unit, units, 0, fat->data_offset);
+
+  for (cluster = 2; cluster < fat->cluster_count + 2; cluster++) {
+    if (table[cluster] != FAT_FREE) {
+      mark_used(map, unit, units, fat_cluster_offset(fat, cluster), fat->cluster_bytes);
+    }
+  }
+
+  free(table);
+  return true;
+}
+
+static bool ext3_used(int fd, const EXT3_INFO *ext3, unsigned int unit, unsigned long long units,
+		      unsigned char *map) {
+  EXT3_GROUP *groups = ext3_read_groups(fd, ext3);
+  unsigned char *bitmap = malloc(ext3->block_size);
+  bool uninit = (ext3->feature_ro_compat & EXT3_FEATURE_RO_COMPAT_GDT_CSUM);
+  bool ok = (groups && bitmap);
+  uint32_t g, bit;
+
+  // Boot block and superblock
+  mark_used(map, unit, units, 0, (unsigned long long)(ext3->first_data_block + 1) * ext3->block_size);
+
+  for (g = 0; ok && (g < ext3->group_count); g++) {
+    uint32_t first = ext3->first_data_block + g * ext3->blocks_per_group;
+    uint32_t count = ext3->blocks_per_group;
+
+    if (first + count > ext3->blocks_count) count = ext3->blocks_count - first;
+
+    // An uninitialised bitmap means only the group's own metadata is in
+    // use; that is not worth locating precisely, so keep the whole group.
+    if (uninit && (groups[g].flags & EXT3_BG_BLOCK_UNINIT)) {
+      mark_used(map, unit, units, (unsigned long long)first * ext3->block_size,
+		(unsigned long long)count * ext3->block_size);
+      continue;
+    }
+
+    if (!pread_fully(fd, bitmap, ext3->block_size,
+		    (unsigned long long)groups[g].block_bitmap * ext3->block_size)) {
+      ok = false;
+      break;
+    }
+
+    for (bit = 0; bit < count; bit++) {
+      if (bitmap[bit >> 3] & (1 << (bit & 7))) {
+	mark_used(map, unit, units, (unsigned long long)(first + bit) * ext3->block_size, ext3->block_size);
+      }
+    }
+  }
+
+  free(groups);
+  free(bitmap);
+  return ok;
+}
+
+//
+// Mark in map (one byte per unit bytes of the device) every unit that
+// holds filesystem data or metadata.  Returns false if the allocation
+// could not be determined, in which case the whole device should be
+// treated as in use.
+//
+bool fs_used_extents(int fd, const FS_INFO *info, unsigned int unit, unsigned char *map) {
+  unsigned long long units = (info->device_bytes + unit - 1) / unit;
+
+  memset(map, 0, units);
+
+  switch (info->type) {
+  case FS_FAT:  return fat_used(fd, &info->fat, unit, units, map);
+  case FS_EXT3: return ext3_used(fd, &info->ext3, unit, units, map);
+  default:      return false;
+  }
+}
+
+//
+// Look for a volume in /proc/mounts by device number, whatever name it
+// was mounted under.
+//
+bool fs_device_mounted(const char *device, bool *writable) {
+  char line[MAXLINLEN];
+  char name[MAXLINLEN];
+  char options[MAXLINLEN];
+  struct stat want, have;
+  bool found = false;
+  FILE *fp;
+
+  *writable = false;
+  if (stat(device, &want)) return false;
+
+  fp = fopen("/proc/mounts", "r");
+  if (!fp) return false;
+
+  while (fgets(line, sizeof line, fp)) {
+    if (sscanf(line, "%1023s %*s %*s %1023s", name, options) != 2) continue;
+    if (stat(name, &have) || !S_ISBLK(have.st_mode) || (have.st_rdev != want.st_rdev)) continue;
+    found = true;
+    if (!strncmp(options, "rw", 2) && ((options[2] == ',') || !options[2])) *writable = true;
+  }
+
+  fclose(fp);
+  return found;
+}
+
+//
+// Whether anything is mounted on a directory.
+//
+bool fs_mountpoint_mounted(const char *mountpoint) {
+  char line[MAXLINLEN];
+  char dir[MAXLINLEN];
+  bool found = false;
+  FILE *fp = fopen("/proc/mounts", "r");
+
+  if (!fp) return false;
+
+  while (!found && fgets(line, sizeof line, fp)) {
+    if ((sscanf(line, "%*s %1023s", dir) == 1) && !strcmp(dir, mountpoint)) found = true;
+  }
+
+  fclose(fp);
+  return found;
+}
@@ -0,0 +1,149 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef FS_PROBE_H_
+#define FS_PROBE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+//
+// Just enough of the on-disk FAT and ext3 formats for the native engines
+// to find out which parts of a volume are in use.  Everything is read
+// straight from the block device; nothing here writes to it, though the
+// engines which do share its byte and I/O helpers.
+//
+
+typedef enum {
+  FS_UNKNOWN,
+  FS_FAT,
+  FS_EXT3,
+  FS_SWAP
+} FS_TYPE;
+
+typedef struct {
+  unsigned int fat_bits;		// 12, 16 or 32
+  unsigned int bytes_per_sector;
+  unsigned int sectors_per_cluster;
+  unsigned int cluster_bytes;
+  unsigned int num_fats;
+  uint32_t fat_sectors;
+  uint32_t root_entries;		// FAT12/16 fixed root directory
+  uint32_t root_cluster;		// FAT32 root directory chain
+  uint32_t cluster_count;		// data clusters, numbered from 2
+  unsigned long long fat_offset;	// bytes to the first FAT
+  unsigned long long root_offset;	// bytes to the FAT12/16 root directory
+  unsigned long long data_offset;	// bytes to cluster 2
+} FAT_INFO;
+
+typedef struct {
+  unsigned int block_size;
+  uint32_t blocks_count;
+  uint32_t free_blocks;
+  uint32_t inodes_count;
+  uint32_t free_inodes;
+  uint32_t first_data_block;
+  uint32_t blocks_per_group;
+  uint32_t inodes_per_group;
+  uint32_t group_count;
+  unsigned int inode_size;
+  uint32_t first_ino;
+  unsigned int desc_size;
+  uint32_t feature_compat;
+  uint32_t feature_incompat;
+  uint32_t feature_ro_compat;
+  uint16_t state;
+  uint16_t mount_count;
+  int16_t max_mount_count;
+  uint32_t last_check;
+} EXT3_INFO;
+
+typedef struct {
+  FS_TYPE type;
+  unsigned long long device_bytes;
+  FAT_INFO fat;
+  EXT3_INFO ext3;
+} FS_INFO;
+
+// Fields of an ext3 group descriptor that the engines use.
+typedef struct {
+  uint32_t block_bitmap;
+  uint32_t inode_bitmap;
+  uint32_t inode_table;
+  uint16_t free_blocks;
+  uint16_t free_inodes;
+  uint16_t used_dirs;
+  uint16_t flags;
+  uint16_t itable_unused;
+} EXT3_GROUP;
+
+// ext3 superblock and feature bits
+#define EXT3_SUPER_OFFSET 1024
+#define EXT3_MAGIC 0xEF53
+#define EXT3_VALID_FS 0x0001
+#define EXT3_ERROR_FS 0x0002
+#define EXT3_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT3_FEATURE_INCOMPAT_RECOVER 0x0004
+#define EXT3_FEATURE_INCOMPAT_EXTENTS 0x0040
+#define EXT3_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT3_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT3_BG_INODE_UNINIT 0x0001
+#define EXT3_BG_BLOCK_UNINIT 0x0002
+
+// A swap area carries its signature at the end of the first 4K page.
+#define SWAP_PROBE_PAGE 4096
+#define SWAP_PROBE_SIGNATURE "SWAPSPACE2"
+
+// FAT entry values (after masking to 28 bits on FAT32)
+#define FAT_FREE 0
+#define FAT_BAD(fat) ((fat)->fat_bits == 32 ? 0x0FFFFFF7 : (fat)->fat_bits == 16 ? 0xFFF7 : 0xFF7)
+#define FAT_EOC(fat) ((fat)->fat_bits == 32 ? 0x0FFFFFF8 : (fat)->fat_bits == 16 ? 0xFFF8 : 0xFF8)
+
+// FAT directory entry fields and attributes
+#define FAT_DIRENT_SIZE       32
+#define FAT_DIRENT_ATTR       11
+#define FAT_DIRENT_CLUSTER_HI 20
+#define FAT_DIRENT_CLUSTER_LO 26
+#define FAT_DIRENT_SIZE_FIELD 28
+#define FAT_ATTR_VOLUME 0x08
+#define FAT_ATTR_DIR    0x10
+#define FAT_ATTR_LFN    0x0F
+#define FAT_DIRENT_END     0x00
+#define FAT_DIRENT_DELETED 0xE5
+
+uint16_t le16(const unsigned char *p);
+uint32_t le32(const unsigned char *p);
+bool pread_fully(int fd, void *buf, size_t len, unsigned long long offset);
+bool pwrite_fully(int fd, const void *buf, size_t len, unsigned long long offset);
+
+bool fs_probe(int fd, FS_INFO *info);
+const char *fs_type_name(FS_TYPE type);
+
+uint32_t fat_entry(const FAT_INFO *fat, const unsigned char *raw, uint32_t n);
+void fat_set_entry(const FAT_INFO *fat, unsigned char *raw, uint32_t n, uint32_t value);
+uint32_t *fat_read_table(int fd, const FAT_INFO *fat);
+unsigned long long fat_cluster_offset(const FAT_INFO *fat, uint32_t cluster);
+
+EXT3_GROUP *ext3_read_groups(int fd, const EXT3_INFO *ext3);
+
+bool fs_used_extents(int fd, const FS_INFO *info, unsigned int unit, unsigned char *map);
+bool fs_device_mounted(const char *device, bool *writable);
+bool fs_mountpoint_mounted(const char *mountpoint);
+
+#endif /* FS_PROBE_H_ */
@@ -0,0 +1,150 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "luna_methods.h"
+#include "spawn.h"
+#include "fstab.h"
+
+static bool run_quietly(const char *command) {
+  char line[MAXLINLEN];
+  SPAWN_CHILD child;
+
+  if (!spawn_command(&child, command)) return false;
+  while (fgets(line, sizeof line, child.fp));
+  return spawn_wait(&child) == 0;
+}
+
+static bool append(char **text, size_t *len, size_t *size, const char *line) {
+  size_t n = strlen(line);
+
+  if (*len + n + 1 > *size) {
+    char *grown = realloc(*text, *size + n + MAXBUFLEN);
+    if (!grown) return false;
+    *text = grown;
+    *size += n + MAXBUFLEN;
+  }
+  memcpy(*text + *len, line, n);
+  *len += n;
+
+  return true;
+}
+
+const char *fstab_update(const char *device, const char *mountpoint, const char *from_type,
+			 const char *to_type, const char *options, int *changed) {
+  char line[MAXLINLEN];
+  char spec[MAXLINLEN];
+  char file[MAXLINLEN];
+  char type[MAXNAMLEN];
+  char opts[MAXLINLEN];
+  char dump[MAXNAMLEN];
+  char pass[MAXNAMLEN];
+  struct stat want, have;
+  const char *failure = NULL;
+  bool remounted = false;
+  char *text = NULL;
+  size_t len = 0, size = 0;
+  FILE *fp;
+  int fields, fd;
+  bool known;
+
+  *changed = 0;
+  known = !stat(device, &want);
+  if (!known && to_type) return "Volume not found";
+
+  // A missing fstab only matters if there is an entry to add.
+  fp = fopen(FSTAB_PATH, "r");
+  if (!fp && !options) return NULL;
+
+  while (fp && fgets(line, sizeof line, fp)) {
+    strcpy(dump, "0");
+    strcpy(pass, "0");
+    fields = (line[0] == '#') ? 0 :
+      sscanf(line, "%1023s %1023s %127s %1023s %127s %127s", spec, file, type, opts, dump, pass);
+
+    if ((fields >= 3) && (!from_type || !strcmp(type, from_type)) &&
+	(!strcmp(file, mountpoint) ||
+	 (known && !stat(spec, &have) && S_ISBLK(have.st_mode) && (have.st_rdev == want.st_rdev)))) {
+      (*changed)++;
+      if (!to_type) continue;
+      snprintf(line, sizeof line, "%s %s %s %s %s %s\n", spec, file, to_type,
+	       options ? options : (fields >= 4) ? opts : "defaults", dump, pass);
+    }
+
+    if (!append(&text, &len, &size, line)) {
+      failure = "Out of memory";
+      break;
+    }
+  }
+
+  if (fp) fclose(fp);
+  if (failure) goto end;
+
+  if (!*changed) {
+    if (!options) goto end;
+    snprintf(line, sizeof line, "%s%s %s %s %s 0 0\n", (len && (text[len - 1] != '\n')) ? "\n" : "",
+	     device, mountpoint, to_type, options);
+    if (!append(&text, &len, &size, line)) {
+      failure = "Out of memory";
+      goto end;
+    }
+    *changed = 1;
+  }
+
+  fp = fopen(FSTAB_PATH ".tailor", "w");
+  if (!fp && (errno == EROFS)) {
+    remounted = run_quietly("/bin/mount -o remount,rw /");
+    if (remounted) fp = fopen(FSTAB_PATH ".tailor", "w");
+  }
+  if (!fp) {
+    failure = "Unable to write " FSTAB_PATH;
+    goto end;
+  }
+
+  if ((fwrite(text, 1, len, fp) != len) | fflush(fp) | fsync(fileno(fp)) | fclose(fp)) {
+    failure = "Unable to write " FSTAB_PATH;
+    unlink(FSTAB_PATH ".tailor");
+    goto end;
+  }
+
+  chmod(FSTAB_PATH ".tailor", 0644);
+  if (rename(FSTAB_PATH ".tailor", FSTAB_PATH)) {
+    failure = "Unable to replace " FSTAB_PATH;
+    unlink(FSTAB_PATH ".tailor");
+    goto end;
+  }
+
+  // Make the rename itself durable.
+  fd = open("/etc", O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+
+ end:
+  if (remounted) run_quietly("/bin/mount -o remount,ro /");
+  free(text);
+  return failure;
+}
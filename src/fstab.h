@@ -0,0 +1,37 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef FSTAB_H_
+#define FSTAB_H_
+
+#include <stdbool.h>
+
+#define FSTAB_PATH "/etc/fstab"
+
+//
+// Rewrite the fstab entries for a volume, matched by mount point or by
+// device, giving them a new type and (if not NULL) new options.  With
+// from_type, only entries of that type are touched.  Given options and
+// no entry to change, one is added.  With no to_type the entries are
+// removed, and the volume need no longer exist.  The root filesystem is
+// normally read-only, so it is remounted read-write for the duration.
+//
+const char *fstab_update(const char *device, const char *mountpoint, const char *from_type,
+			 const char *to_type, const char *options, int *changed);
+
+#endif /* FSTAB_H_ */
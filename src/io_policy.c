@@ -0,0 +1,156 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "luna_methods.h"
+#include "lvm.h"
+#include "io_policy.h"
+
+// From linux/ioprio.h, which the toolchain does not carry.
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+
+//
+// Read the ioClass, ioLevel and ioLimit arguments.
+// Returns NULL, or the reason they are unacceptable.
+//
+const char *io_policy_parse(json_t *object, IO_POLICY *policy) {
+  json_t *io_class = json_find_first_label(object, "ioClass");
+  json_t *level = json_find_first_label(object, "ioLevel");
+  json_t *limit = json_find_first_label(object, "ioLimit");
+
+  policy->io_class = IO_CLASS_DEFAULT;
+  policy->level = IO_DEFAULT_LEVEL;
+  policy->limit = 0;
+
+  if (limit) {
+    const char *text = limit->child->text;
+    size_t len = strlen(text);
+
+    if (((limit->child->type != JSON_STRING) && (limit->child->type != JSON_NUMBER)) ||
+	(strspn(text, ALLOWED_CHARS) != len)) {
+      return "Invalid ioLimit";
+    }
+    // A number is bytes per second.  lvm_parse_size would take a bare "10"
+    // as megabytes, so a string must say which it means.
+    if ((limit->child->type == JSON_STRING) && (!len || !strchr("bBkKmMgG", text[len - 1]))) {
+      return "ioLimit needs a unit such as 4M";
+    }
+    policy->limit = (limit->child->type == JSON_NUMBER) ? strtoull(text, NULL, 10) : lvm_parse_size(text);
+    if (policy->limit < IO_MIN_LIMIT) return "ioLimit is too small";
+
+    // Anything capped should also give way to the foreground.
+    policy->io_class = IO_CLASS_BEST_EFFORT;
+    policy->level = IO_LIMITED_LEVEL;
+  }
+
+  if (io_class) {
+    if (io_class->child->type != JSON_STRING) return "Invalid ioClass";
+    if (!strcmp(io_class->child->text, "best-effort")) policy->io_class = IO_CLASS_BEST_EFFORT;
+    else if (!strcmp(io_class->child->text, "idle")) policy->io_class = IO_CLASS_IDLE;
+    else if (!strcmp(io_class->child->text, "default")) policy->io_class = IO_CLASS_DEFAULT;
+    else return "Invalid ioClass";
+  }
+
+  if (level) {
+    if (level->child->type != JSON_NUMBER) return "Invalid ioLevel";
+    policy->level = atoi(level->child->text);
+    if ((policy->level < 0) || (policy->level > 7)) return "Invalid ioLevel";
+  }
+
+  return NULL;
+}
+
+const char *io_class_name(IO_CLASS io_class) {
+  switch (io_class) {
+  case IO_CLASS_BEST_EFFORT: return "best-effort";
+  case IO_CLASS_IDLE:        return "idle";
+  default:                   return "default";
+  }
+}
+
+//
+// Set the I/O class of a process (or thread), 0 meaning the caller.
+// Threads and children created afterwards inherit it.
+//
+bool io_policy_apply(pid_t pid, const IO_POLICY *policy) {
+  int value;
+
+  if (!policy || (policy->io_class == IO_CLASS_DEFAULT)) return true;
+
+  if (policy->io_class == IO_CLASS_IDLE) value = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+  else value = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | policy->level;
+
+#ifdef SYS_ioprio_set
+  return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, value) == 0;
+#else
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
+//
+// A token bucket holding at most a second's worth of bytes.  Any number
+// of threads may take from it; each sleeps until its bytes are covered.
+//
+void io_throttle_init(IO_THROTTLE *throttle, unsigned long long rate) {
+  pthread_mutex_init(&throttle->lock, NULL);
+  throttle->rate = rate;
+  throttle->tokens = 0;
+  clock_gettime(CLOCK_MONOTONIC, &throttle->last);
+}
+
+void io_throttle_take(IO_THROTTLE *throttle, size_t bytes) {
+  struct timespec now;
+  double wait = 0;
+
+  if (!throttle || !throttle->rate) return;
+
+  pthread_mutex_lock(&throttle->lock);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  throttle->tokens += ((now.tv_sec - throttle->last.tv_sec) +
+		       (now.tv_nsec - throttle->last.tv_nsec) / 1e9) * throttle->rate;
+  if (throttle->tokens > throttle->rate) throttle->tokens = throttle->rate;
+  throttle->last = now;
+
+  // Go into debt now, so that waiting threads queue up behind each other.
+  throttle->tokens -= bytes;
+  if (throttle->tokens < 0) wait = -throttle->tokens / throttle->rate;
+
+  pthread_mutex_unlock(&throttle->lock);
+
+  if (wait > 0) {
+    struct timespec pause;
+    pause.tv_sec = (time_t)wait;
+    pause.tv_nsec = (long)((wait - pause.tv_sec) * 1e9);
+    while (nanosleep(&pause, &pause) && (errno == EINTR));
+  }
+}
+
+void io_throttle_destroy(IO_THROTTLE *throttle) {
+  pthread_mutex_destroy(&throttle->lock);
+}
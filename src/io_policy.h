@@ -0,0 +1,72 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef IO_POLICY_H_
+#define IO_POLICY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <lunaservice.h>
+
+//
+// How hard a job may lean on the flash.  Jobs take the optional
+// arguments ioClass ("best-effort", "idle" or "default"), ioLevel (0 to
+// 7, for best-effort) and ioLimit (a number of bytes per second, or a
+// string with a B, K, M or G unit such as "4M").  The class is given to the job's threads and to every tool it
+// runs; the limit is kept by the native engines, which have no tool to
+// hand it to.
+//
+
+typedef enum {
+  IO_CLASS_DEFAULT,
+  IO_CLASS_BEST_EFFORT,
+  IO_CLASS_IDLE
+} IO_CLASS;
+
+// The kernel's default best-effort level, and the one used for a limit alone.
+#define IO_DEFAULT_LEVEL 4
+#define IO_LIMITED_LEVEL 7
+
+// Smallest limit accepted, so that a job always gets somewhere.
+#define IO_MIN_LIMIT (64*1024)
+
+typedef struct {
+  IO_CLASS io_class;
+  int level;
+  unsigned long long limit;
+} IO_POLICY;
+
+typedef struct {
+  pthread_mutex_t lock;
+  unsigned long long rate;
+  double tokens;
+  struct timespec last;
+} IO_THROTTLE;
+
+const char *io_policy_parse(json_t *object, IO_POLICY *policy);
+const char *io_class_name(IO_CLASS io_class);
+bool io_policy_apply(pid_t pid, const IO_POLICY *policy);
+
+void io_throttle_init(IO_THROTTLE *throttle, unsigned long long rate);
+void io_throttle_take(IO_THROTTLE *throttle, size_t bytes);
+void io_throttle_destroy(IO_THROTTLE *throttle);
+
+#endif /* IO_POLICY_H_ */
@@ -0,0 +1,333 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "iostats.h"
+
+//
+// Everything here runs on the main loop: a sample is one read of
+// /proc/diskstats (the same counters as /sys/block/dm-*/stat, for every
+// device at once), keeping the dm nodes which belong to the group.
+// Subscribers asking for the same interval share one timer, which stops
+// once the last of them has gone.
+//
+
+typedef struct {
+  char name[MAXNAMLEN];
+  unsigned long long reads;
+  unsigned long long read_sectors;
+  unsigned long long writes;
+  unsigned long long write_sectors;
+  unsigned long long in_flight;
+  unsigned long long io_msecs;
+  unsigned long long queue_msecs;
+} IOSTATS_VOLUME;
+
+typedef struct {
+  int count;
+  struct timespec when;
+  IOSTATS_VOLUME volumes[IOSTATS_MAX_VOLUMES];
+} IOSTATS_SAMPLE;
+
+typedef struct {
+  unsigned int msecs;
+  char key[MAXNAMLEN];
+  IOSTATS_SAMPLE last;
+} IOSTATS_TIMER;
+
+typedef struct {
+  LSMessage *message;
+  IOSTATS_SAMPLE first;
+} IOSTATS_REQUEST;
+
+static IOSTATS_TIMER *timers[IOSTATS_MAX_TIMERS];
+
+//
+// The logical volume a dm node belongs to, from its "<group>-<volume>"
+// name with any '-' in either part doubled.
+//
+static bool volume_name(const char *node, char *name, size_t size) {
+  char path[MAXLINLEN];
+  char line[MAXLINLEN];
+  const char *p;
+  size_t len = 0;
+  FILE *fp;
+
+  snprintf(path, sizeof path, "/sys/block/%s/dm/name", node);
+  fp = fopen(path, "r");
+  if (!fp) return false;
+  if (!fgets(line, sizeof line, fp)) line[0] = '\0';
+  fclose(fp);
+
+  if (strncmp(line, LVM_GROUP_NAME "-", strlen(LVM_GROUP_NAME "-"))) return false;
+
+  for (p = line + strlen(LVM_GROUP_NAME "-"); *p && (*p != '\n') && (len < size - 1); p++) {
+    if ((p[0] == '-') && (p[1] == '-')) p++;
+    name[len++] = *p;
+  }
+  name[len] = '\0';
+
+  return len > 0;
+}
+
+static bool take_sample(IOSTATS_SAMPLE *sample) {
+  char line[MAXLINLEN];
+  char node[MAXNAMLEN];
+  FILE *fp;
+
+  sample->count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &sample->when);
+
+  fp = fopen("/proc/diskstats", "r");
+  if (!fp) return false;
+
+  while (fgets(line, sizeof line, fp) && (sample->count < IOSTATS_MAX_VOLUMES)) {
+    IOSTATS_VOLUME *volume = &sample->volumes[sample->count];
+    unsigned long long merged;
+
+    if ((sscanf(line, " %*u %*u %127s %llu %llu %llu %*u %llu %llu %llu %*u %llu %llu %llu",
+		node, &volume->reads, &merged, &volume->read_sectors,
+		&volume->writes, &merged, &volume->write_sectors,
+		&volume->in_flight, &volume->io_msecs, &volume->queue_msecs) != 10) ||
+	strncmp(node, "dm-", 3) || !volume_name(node, volume->name, sizeof volume->name)) continue;
+
+    sample->count++;
+  }
+
+  fclose(fp);
+  return true;
+}
+
+static unsigned long long per_second(unsigned long long now, unsigned long long then, long msecs) {
+  return (now > then) ? (now - then) * 1000 / msecs : 0;
+}
+
+//
+// Describe what happened between two samples.
+//
+static void format_stats(const IOSTATS_SAMPLE *then, const IOSTATS_SAMPLE *now, char *buffer, size_t size) {
+  const char *job = lvm_claimed_by();
+  long msecs = (now->when.tv_sec - then->when.tv_sec) * 1000 + (now->when.tv_nsec - then->when.tv_nsec) / 1000000;
+  size_t len;
+  int i, j;
+
+  if (msecs <= 0) msecs = 1;
+
+  len = snprintf(buffer, size, "{\"returnValue\": true, \"msecs\": %ld, \"job\": %s%s%s, \"volumes\": [",
+		 msecs, job ? "\"" : "", job ? job : "null", job ? "\"" : "");
+
+  for (i = 0; (i < now->count) && (len < size); i++) {
+    const IOSTATS_VOLUME *volume = &now->volumes[i];
+    IOSTATS_VOLUME zero;
+    const IOSTATS_VOLUME *before = &zero;
+    unsigned long long busy;
+
+    // A volume created since the last sample counts from zero.
+    memset(&zero, 0, sizeof zero);
+    for (j = 0; j < then->count; j++) {
+      if (!strcmp(then->volumes[j].name, volume->name)) before = &then->volumes[j];
+    }
+
+    busy = (volume->io_msecs > before->io_msecs) ? volume->io_msecs - before->io_msecs : 0;
+    if (busy > (unsigned long long)msecs) busy = msecs;
+
+    len += snprintf(buffer + len, size - len,
+		    "%s{\"name\": \"%s\", \"readBytes\": %llu, \"writeBytes\": %llu, \"readIops\": %llu, "
+		    "\"writeIops\": %llu, \"inFlight\": %llu, \"queueDepth\": %.2f, \"utilization\": %llu}",
+		    i ? ", " : "", volume->name,
+		    per_second(volume->read_sectors, before->read_sectors, msecs) * 512,
+		    per_second(volume->write_sectors, before->write_sectors, msecs) * 512,
+		    per_second(volume->reads, before->reads, msecs),
+		    per_second(volume->writes, before->writes, msecs),
+		    volume->in_flight,
+		    (volume->queue_msecs > before->queue_msecs) ?
+		    (double)(volume->queue_msecs - before->queue_msecs) / msecs : 0.0,
+		    busy * 100 / msecs);
+  }
+
+  if (len < size) snprintf(buffer + len, size - len, "]}");
+}
+
+static unsigned int count_subscribers(const char *key) {
+  LSHandle *handles[2] = { pub_serviceHandle, priv_serviceHandle };
+  LSSubscriptionIter *iter;
+  unsigned int count = 0;
+  LSError lserror;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    LSErrorInit(&lserror);
+    iter = NULL;
+    if (!LSSubscriptionAcquire(handles[i], key, &iter, &lserror)) {
+      LSErrorFree(&lserror);
+      continue;
+    }
+    while (LSSubscriptionHasNext(iter)) {
+      LSSubscriptionNext(iter);
+      count++;
+    }
+    LSSubscriptionRelease(iter);
+  }
+
+  return count;
+}
+
+static gboolean timer_tick(gpointer data) {
+  IOSTATS_TIMER *timer = (IOSTATS_TIMER *)data;
+  char buffer[MAXBUFLEN];
+  IOSTATS_SAMPLE now;
+  LSError lserror;
+  int i;
+
+  if (!count_subscribers(timer->key)) {
+    for (i = 0; i < IOSTATS_MAX_TIMERS; i++) {
+      if (timers[i] == timer) timers[i] = NULL;
+    }
+    free(timer);
+    return FALSE;
+  }
+
+  if (!take_sample(&now)) return TRUE;
+
+  format_stats(&timer->last, &now, buffer, sizeof buffer);
+  timer->last = now;
+
+  LSErrorInit(&lserror);
+  if (!LSSubscriptionRespond(serviceHandle, timer->key, buffer, &lserror)) {
+    LSErrorPrint(&lserror, stderr);
+    LSErrorFree(&lserror);
+  }
+
+  return TRUE;
+}
+
+//
+// The timer for an interval, started if need be.
+//
+static IOSTATS_TIMER *find_timer(unsigned int msecs) {
+  int i, slot = -1;
+
+  for (i = 0; i < IOSTATS_MAX_TIMERS; i++) {
+    if (timers[i] && (timers[i]->msecs == msecs)) return timers[i];
+    if (!timers[i] && (slot < 0)) slot = i;
+  }
+  if (slot < 0) return NULL;
+
+  timers[slot] = calloc(1, sizeof(IOSTATS_TIMER));
+  if (!timers[slot]) return NULL;
+
+  timers[slot]->msecs = msecs;
+  snprintf(timers[slot]->key, sizeof timers[slot]->key, "ioStats/%u", msecs);
+  take_sample(&timers[slot]->last);
+  g_timeout_add(msecs, timer_tick, timers[slot]);
+
+  return timers[slot];
+}
+
+static gboolean request_tick(gpointer data) {
+  IOSTATS_REQUEST *request = (IOSTATS_REQUEST *)data;
+  char buffer[MAXBUFLEN];
+  IOSTATS_SAMPLE now;
+  LSError lserror;
+
+  LSErrorInit(&lserror);
+
+  if (take_sample(&now)) {
+    format_stats(&request->first, &now, buffer, sizeof buffer);
+  }
+  else {
+    strcpy(buffer, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to read disk statistics\"}");
+  }
+
+  if (!LSMessageRespond(request->message, buffer, &lserror)) {
+    LSErrorPrint(&lserror, stderr);
+    LSErrorFree(&lserror);
+  }
+
+  LSMessageUnref(request->message);
+  free(request);
+
+  return FALSE;
+}
+
+//
+// Report throughput, IOPS, queue depth and utilization for each volume.
+// A plain call answers once, after one interval; a subscription gets a
+// report every interval until it is cancelled.
+//
+bool io_stats_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  unsigned int msecs = IOSTATS_DEFAULT_MSECS;
+  IOSTATS_REQUEST *request;
+  IOSTATS_TIMER *timer;
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *interval = json_find_first_label(object, "interval");
+
+  if (interval && (interval->child->type == JSON_NUMBER)) {
+    int value = atoi(interval->child->text);
+    msecs = (value < IOSTATS_MIN_MSECS) ? IOSTATS_MIN_MSECS : (value > IOSTATS_MAX_MSECS) ? IOSTATS_MAX_MSECS : value;
+  }
+
+  json_free_value(&object);
+
+  if (LSMessageIsSubscription(message)) {
+    timer = find_timer(msecs);
+    if (!timer) {
+      log_printf(LOG_NOTICE, "Too many ioStats intervals in use\n");
+      if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Too many intervals in use\"}",
+			    &lserror)) goto error;
+      return true;
+    }
+
+    if (!LSSubscriptionAdd(lshandle, timer->key, message, &lserror)) goto error;
+
+    if (!LSMessageRespond(message, "{\"returnValue\": true, \"subscribed\": true}", &lserror)) goto error;
+    return true;
+  }
+
+  request = calloc(1, sizeof(IOSTATS_REQUEST));
+  if (!request || !take_sample(&request->first)) {
+    free(request);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to read disk statistics\"}",
+			  &lserror)) goto error;
+    return true;
+  }
+
+  // Ref and save the message for the answer after one interval
+  LSMessageRef(message);
+  request->message = message;
+  g_timeout_add(msecs, request_tick, request);
+
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
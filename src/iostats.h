@@ -0,0 +1,35 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef IOSTATS_H_
+#define IOSTATS_H_
+
+#include <lunaservice.h>
+
+// Sampling interval limits, in milliseconds.
+#define IOSTATS_DEFAULT_MSECS 1000
+#define IOSTATS_MIN_MSECS 250
+#define IOSTATS_MAX_MSECS 60000
+
+// Volumes reported, and distinct intervals sampled at once.
+#define IOSTATS_MAX_VOLUMES 16
+#define IOSTATS_MAX_TIMERS 4
+
+bool io_stats_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* IOSTATS_H_ */
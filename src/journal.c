@@ -0,0 +1,148 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+void journal_init(JOURNAL *journal) {
+  journal->count = 0;
+}
+
+//
+// Read a journal.  Returns false if there is none.
+//
+bool journal_load(const char *file, JOURNAL *journal) {
+  char line[MAXNAMLEN + MAXLINLEN];
+  FILE *fp;
+
+  journal_init(journal);
+
+  fp = fopen(file, "r");
+  if (!fp) return false;
+
+  while (fgets(line, sizeof line, fp)) {
+    char *nl = strchr(line, '\n'); if (nl) *nl = 0;
+    char *value = strchr(line, '=');
+    if (!value) continue;
+    *value++ = '\0';
+    journal_set(journal, line, value);
+  }
+
+  fclose(fp);
+  return true;
+}
+
+//
+// Write a journal so that it survives a crash or power loss at any point.
+//
+bool journal_save(const char *file, JOURNAL *journal) {
+  char tmpfile[MAXLINLEN];
+  char dir[MAXLINLEN];
+  char *slash;
+  FILE *fp;
+  int i, fd;
+
+  strncpy(dir, file, sizeof dir - 1);
+  dir[sizeof dir - 1] = '\0';
+  slash = strrchr(dir, '/');
+  if (slash) *slash = '\0';
+  mkdir(dir, 0755);
+
+  snprintf(tmpfile, sizeof tmpfile, "%s.new", file);
+
+  fp = fopen(tmpfile, "w");
+  if (!fp) return false;
+
+  for (i = 0; i < journal->count; i++) {
+    fprintf(fp, "%s=%s\n", journal->keys[i], journal->values[i]);
+  }
+
+  if (fflush(fp) || fsync(fileno(fp))) {
+    fclose(fp);
+    unlink(tmpfile);
+    return false;
+  }
+  fclose(fp);
+
+  if (rename(tmpfile, file)) return false;
+
+  // Make the rename itself durable.
+  fd = open(dir, O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+
+  return true;
+}
+
+bool journal_remove(const char *file) {
+  return (unlink(file) == 0);
+}
+
+const char *journal_get(JOURNAL *journal, const char *key) {
+  int i;
+
+  for (i = 0; i < journal->count; i++) {
+    if (!strcmp(journal->keys[i], key)) return journal->values[i];
+  }
+
+  return NULL;
+}
+
+unsigned long long journal_get_number(JOURNAL *journal, const char *key) {
+  const char *value = journal_get(journal, key);
+
+  return value ? strtoull(value, NULL, 10) : 0;
+}
+
+void journal_set(JOURNAL *journal, const char *key, const char *value) {
+  char *p;
+  int i;
+
+  for (i = 0; i < journal->count; i++) {
+    if (!strcmp(journal->keys[i], key)) break;
+  }
+
+  if (i == journal->count) {
+    if (journal->count == JOURNAL_MAXKEYS) return;
+    strncpy(journal->keys[i], key, MAXNAMLEN - 1);
+    journal->keys[i][MAXNAMLEN - 1] = '\0';
+    journal->count++;
+  }
+
+  // Values are stored one per line.
+  strncpy(journal->values[i], value, MAXLINLEN - 1);
+  journal->values[i][MAXLINLEN - 1] = '\0';
+  for (p = journal->values[i]; (p = strchr(p, '\n')); ) {
+    *p = ' ';
+  }
+}
+
+void journal_set_number(JOURNAL *journal, const char *key, unsigned long long value) {
+  char text[MAXNUMLEN];
+
+  snprintf(text, sizeof text, "%llu", value);
+  journal_set(journal, key, text);
+}
@@ -0,0 +1,50 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+
+#include "luna_methods.h"
+
+//
+// A small crash-safe key/value record of a long running job's progress.
+// Every save writes a new copy, syncs it and renames it over the old one,
+// so after a crash the file holds either the previous or the new state.
+//
+
+#define JOURNAL_MAXKEYS 24
+
+typedef struct {
+  int count;
+  char keys[JOURNAL_MAXKEYS][MAXNAMLEN];
+  char values[JOURNAL_MAXKEYS][MAXLINLEN];
+} JOURNAL;
+
+void journal_init(JOURNAL *journal);
+bool journal_load(const char *file, JOURNAL *journal);
+bool journal_save(const char *file, JOURNAL *journal);
+bool journal_remove(const char *file);
+
+const char *journal_get(JOURNAL *journal, const char *key);
+unsigned long long journal_get_number(JOURNAL *journal, const char *key);
+void journal_set(JOURNAL *journal, const char *key, const char *value);
+void journal_set_number(JOURNAL *journal, const char *key, unsigned long long value);
+
+#endif /* JOURNAL_H_ */
@@ -0,0 +1,1042 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "calibrate.h"
+#include "journal.h"
+#include "spawn.h"
+#include "io_policy.h"
+#include "fs_probe.h"
+#include "swap.h"
+#include "fstab.h"
+#include "resize.h"
+#include "layout.h"
+
+// The outcome of this step does not matter (signalling cryptofs).
+#define STEP_IGNORE_FAILURE 0x01
+// A filesystem check, where exit code 1 means errors were corrected.
+#define STEP_FSCK           0x02
+// Skipped if the volume is not in use.
+#define STEP_UNMOUNT        0x04
+// Skipped if the volume is already in use.
+#define STEP_MOUNT          0x08
+// Skipped if the volume is already the size this step makes it.
+#define STEP_VOLUME         0x10
+// Moves data around; a resume checks the filesystem before repeating it.
+#define STEP_RELOCATE       0x20
+// From here on the volume is out of use until it is restored.
+#define STEP_TAKE_DOWN      0x40
+// Puts a volume back into use; still run after the plan stops.
+#define STEP_RESTORE        0x80
+
+//
+// The volumes applyLayout may change.  Anything else in the group
+// belongs to the system and is left alone.
+//
+typedef struct {
+  const char *name;
+  FS_TYPE type;
+  const char *mountpoint;
+  bool cryptofs;
+  bool removable;
+} LAYOUT_VOLUME;
+
+static const LAYOUT_VOLUME managed[] = {
+  { "media",  FS_FAT,  "/media/internal", true,  false },
+  { "ext3fs", FS_EXT3, "/media/ext3fs",   false, true },
+  { "swap",   FS_SWAP, NULL,              false, false },
+  { 0, 0, 0, 0, 0 }
+};
+
+#define MANAGED_COUNT (sizeof managed / sizeof managed[0] - 1)
+
+typedef enum {
+  CHANGE_NONE,
+  CHANGE_SHRINK,
+  CHANGE_GROW,
+  CHANGE_CREATE,
+  CHANGE_REMOVE,
+  CHANGE_FORMAT
+} LAYOUT_CHANGE;
+
+typedef struct {
+  const LAYOUT_VOLUME *volume;
+  bool specified;
+  bool format;
+  LAYOUT_CHANGE change;
+  FS_TYPE current_type;
+  unsigned long long current_kb;
+  unsigned long long target_kb;
+  unsigned long long used_kb;
+  bool mounted;
+  bool prepared;
+} LAYOUT_TARGET;
+
+typedef struct {
+  const char *name;
+  const char *volume;
+  int index;			// into managed
+  char command[MAXLINLEN];
+  bool (*native)(const char *device);	// run in place of the command
+  int flags;
+  unsigned long long volume_kb;	// size of the volume after a STEP_VOLUME step
+  unsigned long long read_bytes;
+  unsigned long long write_bytes;
+} LAYOUT_STEP;
+
+typedef struct {
+  LSMessage *message;
+  IO_POLICY policy;
+  bool resuming;
+  int start;
+  LAYOUT_TARGET targets[MANAGED_COUNT];
+  int count;
+  LAYOUT_STEP steps[LAYOUT_MAX_STEPS];
+} LAYOUT_PLAN;
+
+// Protects everything below.
+static pthread_mutex_t layout_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool layout_running = false;
+static bool layout_cancelled = false;
+static SPAWN_CHILD layout_child;
+
+static bool is_swapping(const char *volume) {
+  char line[MAXLINLEN];
+  char name[MAXLINLEN];
+  char mapper[MAXLINLEN];
+  bool found = false;
+  FILE *fp = fopen("/proc/swaps", "r");
+
+  if (!fp) return false;
+
+  snprintf(mapper, sizeof mapper, "/dev/mapper/%s-%s", LVM_GROUP_NAME, volume);
+
+  while (!found && fgets(line, sizeof line, fp)) {
+    if ((sscanf(line, "%1023s", name) == 1) && !strcmp(name, mapper)) found = true;
+  }
+
+  fclose(fp);
+  return found;
+}
+
+static bool volume_in_use(const LAYOUT_VOLUME *volume) {
+  if (volume->mountpoint) return fs_mountpoint_mounted(volume->mountpoint);
+  return is_swapping(volume->name);
+}
+
+//
+// Find out what is on a volume now, and how much of it is in use.
+//
+static void read_current(LAYOUT_TARGET *target) {
+  char device[MAXLINLEN];
+  FS_INFO info;
+  int fd;
+
+  target->current_kb = lvm_volume_bytes(LVM_GROUP_NAME, target->volume->name) >> 10;
+  target->current_type = FS_UNKNOWN;
+  target->used_kb = 0;
+
+  target->mounted = volume_in_use(target->volume);
+
+  if (!target->current_kb) return;
+
+  snprintf(device, sizeof device, "/dev/%s/%s", LVM_GROUP_NAME, target->volume->name);
+  fd = open(device, O_RDONLY);
+  if (fd < 0) return;
+
+  fs_probe(fd, &info);
+  target->current_type = info.type;
+
+  if (info.type == FS_EXT3) {
+    target->used_kb = (unsigned long long)(info.ext3.blocks_count - info.ext3.free_blocks) *
+      info.ext3.block_size >> 10;
+  }
+  else if (info.type == FS_FAT) {
+    uint32_t *table = fat_read_table(fd, &info.fat);
+    unsigned long long used = info.fat.data_offset;
+    uint32_t cluster;
+
+    if (table) {
+      for (cluster = 2; cluster < info.fat.cluster_count + 2; cluster++) {
+	if (table[cluster] != FAT_FREE) used += info.fat.cluster_bytes;
+      }
+      free(table);
+      target->used_kb = used >> 10;
+    }
+    else {
+      target->used_kb = target->current_kb;
+    }
+  }
+
+  close(fd);
+}
+
+static LAYOUT_STEP *add_step(LAYOUT_PLAN *plan, const char *name, const LAYOUT_TARGET *target, int flags,
+			     unsigned long long read_bytes, unsigned long long write_bytes) {
+  LAYOUT_STEP *step;
+
+  if (plan->count >= LAYOUT_MAX_STEPS) return NULL;
+
+  step = &plan->steps[plan->count++];
+  step->name = name;
+  step->volume = target->volume->name;
+  step->index = target->volume - managed;
+  step->native = NULL;
+  step->flags = flags;
+  step->volume_kb = 0;
+  step->read_bytes = read_bytes;
+  step->write_bytes = write_bytes;
+  step->command[0] = '\0';
+
+  return step;
+}
+
+#define STEP(plan, name, target, flags, rd, wr, ...) do {				\
+    LAYOUT_STEP *step_ = add_step(plan, name, target, flags, rd, wr);			\
+    if (step_) snprintf(step_->command, sizeof step_->command, __VA_ARGS__);		\
+  } while (0)
+
+#define VOLUME_STEP(plan, name, target, kb, ...) do {					\
+    LAYOUT_STEP *step_ = add_step(plan, name, target, STEP_VOLUME, 0, 0);		\
+    if (step_) {									\
+      step_->volume_kb = (kb);								\
+      snprintf(step_->command, sizeof step_->command, __VA_ARGS__);			\
+    }											\
+  } while (0)
+
+//
+// Bytes that checking or resizing a filesystem's metadata will touch.
+//
+static unsigned long long metadata_bytes(const LAYOUT_TARGET *target) {
+  unsigned long long kb = (target->target_kb > target->current_kb) ? target->target_kb : target->current_kb;
+
+  if (target->volume->type == FS_FAT) return kb * 1024 / MEDIA_CLUSTER_SIZE * 4;
+  return kb * 1024 / 256;
+}
+
+//
+// Take a volume out of use, once, before the first step that needs it
+// offline.
+//
+static void add_prepare(LAYOUT_PLAN *plan, LAYOUT_TARGET *target) {
+  const LAYOUT_VOLUME *volume = target->volume;
+
+  if (target->prepared || !target->mounted) return;
+  target->prepared = true;
+
+  if (volume->cryptofs) {
+    STEP(plan, "stopCryptofs", target, STEP_IGNORE_FAILURE | STEP_TAKE_DOWN, 0, 0, "/usr/bin/pkill -SIGUSR1 cryptofs");
+  }
+
+  if (volume->mountpoint) {
+    STEP(plan, "unmount", target, STEP_UNMOUNT | STEP_TAKE_DOWN, 0, 0, "/bin/umount %s", volume->mountpoint);
+  }
+  else {
+    STEP(plan, "swapoff", target, STEP_UNMOUNT | STEP_TAKE_DOWN, 0, 0, "/sbin/swapoff /dev/%s/%s",
+	 LVM_GROUP_NAME, volume->name);
+  }
+}
+
+static void add_check(LAYOUT_PLAN *plan, LAYOUT_TARGET *target) {
+  const char *name = target->volume->name;
+
+  switch (target->current_type) {
+  case FS_FAT:
+    STEP(plan, "check", target, STEP_FSCK, metadata_bytes(target), 0,
+	 "/usr/sbin/fsck.vfat -a /dev/%s/%s", LVM_GROUP_NAME, name);
+    break;
+  case FS_EXT3:
+    STEP(plan, "check", target, STEP_FSCK, metadata_bytes(target) + target->used_kb * 1024 / 64, 0,
+	 "/sbin/e2fsck -f -y /dev/%s/%s", LVM_GROUP_NAME, name);
+    break;
+  default:
+    break;
+  }
+}
+
+//
+// The fstab entry of a volume applyLayout can create and remove, as
+// createExt3fs writes it.  Run natively on the volume's device.
+//
+static const LAYOUT_VOLUME *device_volume(const char *device) {
+  const char *name = strrchr(device, '/');
+  int i;
+
+  for (i = 0; name && managed[i].name; i++) {
+    if (!strcmp(managed[i].name, name + 1)) return &managed[i];
+  }
+
+  return NULL;
+}
+
+static bool add_fstab_entry(const char *device) {
+  const LAYOUT_VOLUME *volume = device_volume(device);
+  char mapper[MAXLINLEN];
+  const char *failure;
+  int changed;
+
+  if (!volume || !volume->mountpoint) return false;
+
+  snprintf(mapper, sizeof mapper, "/dev/mapper/%s-%s", LVM_GROUP_NAME, volume->name);
+  failure = fstab_update(mapper, volume->mountpoint, NULL, fs_type_name(volume->type), "rw,noatime", &changed);
+  if (failure) log_printf(LOG_ERR, "Adding %s to fstab: %s\n", volume->mountpoint, failure);
+
+  return !failure;
+}
+
+static bool remove_fstab_entry(const char *device) {
+  const LAYOUT_VOLUME *volume = device_volume(device);
+  const char *failure;
+  int changed;
+
+  if (!volume || !volume->mountpoint) return false;
+
+  failure = fstab_update(device, volume->mountpoint, NULL, NULL, NULL, &changed);
+  if (failure) log_printf(LOG_ERR, "Removing %s from fstab: %s\n", volume->mountpoint, failure);
+
+  return !failure;
+}
+
+static void add_fstab_step(LAYOUT_PLAN *plan, LAYOUT_TARGET *target, bool add) {
+  LAYOUT_STEP *step;
+
+  if (!target->volume->removable || !target->volume->mountpoint) return;
+
+  step = add_step(plan, add ? "addFstabEntry" : "removeFstabEntry", target, 0, 0, 0);
+  if (step) {
+    step->native = add ? add_fstab_entry : remove_fstab_entry;
+    snprintf(step->command, sizeof step->command, "(built in) %s %s in " FSTAB_PATH,
+	     add ? "add" : "remove", target->volume->mountpoint);
+  }
+}
+
+static void add_format(LAYOUT_PLAN *plan, LAYOUT_TARGET *target) {
+  const char *name = target->volume->name;
+  unsigned long long bytes = target->target_kb * 1024;
+  LAYOUT_STEP *step;
+
+  switch (target->volume->type) {
+  case FS_FAT:
+    STEP(plan, "format", target, 0, 0, bytes / MEDIA_CLUSTER_SIZE * 4 * 2,
+	 "/usr/sbin/mkdosfs -f 1 -s %d /dev/%s/%s", MEDIA_CLUSTER_SIZE / 512, LVM_GROUP_NAME, name);
+    break;
+  case FS_EXT3:
+    STEP(plan, "format", target, 0, 0, bytes / 64,
+	 "/sbin/mke2fs -j -b4096 -m0 /dev/%s/%s", LVM_GROUP_NAME, name);
+    STEP(plan, "tune", target, 0, 0, 0, "/sbin/tune2fs -c 0 -i 0 /dev/%s/%s", LVM_GROUP_NAME, name);
+    break;
+  case FS_SWAP:
+    step = add_step(plan, "format", target, 0, 0, 4096);
+    if (step) {
+      step->native = swap_format;
+      snprintf(step->command, sizeof step->command, "(built in) mkswap /dev/%s/%s", LVM_GROUP_NAME, name);
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+//
+// Steps that give space back to the group: shrinks, removals, and
+// reformats to a smaller size.  The filesystem is resized straight to the
+// (extent aligned) target, so the data beyond it is moved exactly once.
+//
+static void add_release(LAYOUT_PLAN *plan, LAYOUT_TARGET *target) {
+  const char *name = target->volume->name;
+  unsigned long long moved = target->current_kb - target->target_kb;
+
+  if (moved > target->used_kb) moved = target->used_kb;
+  moved *= 1024;
+
+  add_prepare(plan, target);
+
+  switch (target->change) {
+  case CHANGE_REMOVE:
+    add_fstab_step(plan, target, false);
+    VOLUME_STEP(plan, "removeVolume", target, 0, "/usr/sbin/lvremove -f %s/%s", LVM_GROUP_NAME, name);
+    return;
+  case CHANGE_FORMAT:
+    VOLUME_STEP(plan, "reduceVolume", target, target->target_kb, "/usr/sbin/lvreduce -f -L %lluk %s/%s",
+		target->target_kb, LVM_GROUP_NAME, name);
+    add_format(plan, target);
+    return;
+  default:
+    break;
+  }
+
+  add_check(plan, target);
+
+  switch (target->volume->type) {
+  case FS_FAT:
+    STEP(plan, "shrinkFilesystem", target, STEP_RELOCATE, moved + metadata_bytes(target), moved + metadata_bytes(target),
+	 "/bin/resizefat -v /dev/%s/%s %lluM", LVM_GROUP_NAME, name, target->target_kb >> 10);
+    break;
+  case FS_EXT3:
+    STEP(plan, "shrinkFilesystem", target, STEP_RELOCATE, moved + metadata_bytes(target), moved + metadata_bytes(target),
+	 "/sbin/resize2fs -f -p /dev/%s/%s %lluK", LVM_GROUP_NAME, name, target->target_kb);
+    break;
+  default:
+    break;
+  }
+
+  VOLUME_STEP(plan, "reduceVolume", target, target->target_kb, "/usr/sbin/lvreduce -f -L %lluk %s/%s",
+	      target->target_kb, LVM_GROUP_NAME, name);
+
+  if (target->volume->type == FS_SWAP) add_format(plan, target);
+}
+
+//
+// Steps that take space from the group: creates, grows, and reformats
+// to a larger size.
+//
+static void add_claim(LAYOUT_PLAN *plan, LAYOUT_TARGET *target) {
+  const char *name = target->volume->name;
+
+  if (target->change == CHANGE_CREATE) {
+    VOLUME_STEP(plan, "createVolume", target, target->target_kb, "/usr/sbin/lvcreate -L %lluk -n %s %s",
+		target->target_kb, name, LVM_GROUP_NAME);
+    add_format(plan, target);
+    return;
+  }
+
+  add_prepare(plan, target);
+
+  if (target->change == CHANGE_FORMAT) {
+    VOLUME_STEP(plan, "extendVolume", target, target->target_kb, "/usr/sbin/lvresize -f -L %lluk %s/%s",
+		target->target_kb, LVM_GROUP_NAME, name);
+    add_format(plan, target);
+    return;
+  }
+
+  add_check(plan, target);
+
+  VOLUME_STEP(plan, "extendVolume", target, target->target_kb, "/usr/sbin/lvresize -f -L %lluk %s/%s",
+	      target->target_kb, LVM_GROUP_NAME, name);
+
+  switch (target->volume->type) {
+  case FS_FAT:
+    STEP(plan, "growFilesystem", target, 0, metadata_bytes(target), metadata_bytes(target),
+	 "/bin/resizefat -v /dev/%s/%s %lluM", LVM_GROUP_NAME, name, target->target_kb >> 10);
+    break;
+  case FS_EXT3:
+    STEP(plan, "growFilesystem", target, 0, metadata_bytes(target), metadata_bytes(target),
+	 "/sbin/resize2fs -f -p /dev/%s/%s", LVM_GROUP_NAME, name);
+    break;
+  case FS_SWAP:
+    add_format(plan, target);
+    break;
+  default:
+    break;
+  }
+}
+
+//
+// Put back into use everything that was taken out, and anything new.
+//
+static void add_restore(LAYOUT_PLAN *plan, LAYOUT_TARGET *target) {
+  const LAYOUT_VOLUME *volume = target->volume;
+  const char *name = volume->name;
+
+  if (target->change == CHANGE_REMOVE) return;
+
+  if (target->change == CHANGE_CREATE) {
+    add_fstab_step(plan, target, true);
+    if (volume->mountpoint) {
+      STEP(plan, "mount", target, STEP_MOUNT, 0, 0, "/bin/mkdir -p %s && /bin/mount -t %s /dev/%s/%s %s",
+	   volume->mountpoint, fs_type_name(volume->type), LVM_GROUP_NAME, name, volume->mountpoint);
+    }
+    else {
+      STEP(plan, "swapon", target, STEP_MOUNT, 0, 0, "/sbin/swapon /dev/%s/%s", LVM_GROUP_NAME, name);
+    }
+    return;
+  }
+
+  if (!target->prepared) return;
+
+  if (volume->mountpoint) {
+    STEP(plan, "mount", target, STEP_MOUNT | STEP_RESTORE, 0, 0, "/bin/mount %s", volume->mountpoint);
+  }
+  else {
+    STEP(plan, "swapon", target, STEP_MOUNT | STEP_RESTORE, 0, 0, "/sbin/swapon /dev/%s/%s", LVM_GROUP_NAME, name);
+  }
+
+  if (volume->cryptofs) {
+    STEP(plan, "startCryptofs", target, STEP_IGNORE_FAILURE | STEP_RESTORE, 0, 0, "/usr/bin/pkill -SIGUSR2 cryptofs");
+  }
+}
+
+//
+// Work out what has to change on each volume, and check that the whole
+// layout fits.  A resumed plan is worked out again from the state the
+// volumes were in when it was first made, which the journal holds.
+// Returns an error text, or NULL if the layout can be applied.
+//
+static const char *diff_layout(LAYOUT_TARGET *targets, bool resuming) {
+  long long needed_kb = 0, free_kb;
+  LVM_GROUP group;
+  unsigned int i;
+
+  if (!lvm_group_info(LVM_GROUP_NAME, &group)) return "Unable to read volume group";
+  free_kb = (unsigned long long)group.free_extents * group.extent_kb;
+
+  for (i = 0; i < MANAGED_COUNT; i++) {
+    LAYOUT_TARGET *target = &targets[i];
+
+    target->volume = &managed[i];
+    if (!resuming) read_current(target);
+    target->change = CHANGE_NONE;
+
+    if (!target->specified) continue;
+
+    // Volumes are allocated in whole extents.
+    target->target_kb = (target->target_kb + group.extent_kb - 1) / group.extent_kb * group.extent_kb;
+
+    if (!target->target_kb) {
+      if (!target->current_kb) continue;
+      if (!target->volume->removable) return "Volume cannot be removed";
+      target->change = CHANGE_REMOVE;
+    }
+    else if (!target->current_kb) {
+      if (!target->volume->removable) return "Volume cannot be created";
+      target->change = CHANGE_CREATE;
+    }
+    else if (target->format || (target->current_type != target->volume->type)) {
+      if (!target->format) return "Filesystem type differs; set format to recreate it";
+      target->change = CHANGE_FORMAT;
+    }
+    else if (target->target_kb < target->current_kb) {
+      if (target->target_kb < target->used_kb + target->used_kb * LAYOUT_SLACK_PERCENT / 100) {
+	return "Target is smaller than the data on the volume";
+      }
+      target->change = CHANGE_SHRINK;
+    }
+    else if (target->target_kb > target->current_kb) {
+      target->change = CHANGE_GROW;
+    }
+
+    needed_kb += (long long)target->target_kb - (long long)target->current_kb;
+  }
+
+  // Part of a resumed plan has already claimed its space.
+  if (!resuming && (needed_kb > free_kb)) return "Not enough free space in the volume group";
+
+  return NULL;
+}
+
+//
+// Order the steps so that space is released before it is claimed, and
+// each volume is unmounted and checked at most once and remounted last.
+//
+static void build_plan(LAYOUT_PLAN *plan, LAYOUT_TARGET *targets) {
+  unsigned int i;
+
+  plan->count = 0;
+
+  for (i = 0; i < MANAGED_COUNT; i++) {
+    LAYOUT_TARGET *t = &targets[i];
+    if ((t->change == CHANGE_SHRINK) || (t->change == CHANGE_REMOVE) ||
+	((t->change == CHANGE_FORMAT) && (t->target_kb <= t->current_kb))) add_release(plan, t);
+  }
+
+  for (i = 0; i < MANAGED_COUNT; i++) {
+    LAYOUT_TARGET *t = &targets[i];
+    if ((t->change == CHANGE_GROW) || (t->change == CHANGE_CREATE) ||
+	((t->change == CHANGE_FORMAT) && (t->target_kb > t->current_kb))) add_claim(plan, t);
+  }
+
+  for (i = MANAGED_COUNT; i > 0; i--) add_restore(plan, &targets[i - 1]);
+}
+
+// Steps that only signal or remount still count for something.
+#define STEP_MIN_WEIGHT (1024*1024)
+
+static unsigned long long step_weight(const LAYOUT_STEP *step) {
+  unsigned long long weight = step->read_bytes + step->write_bytes;
+  return (weight < STEP_MIN_WEIGHT) ? STEP_MIN_WEIGHT : weight;
+}
+
+static void send_plan(LSMessage *message, const LAYOUT_PLAN *plan, const LAYOUT_TARGET *targets, bool dry_run) {
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  unsigned long long read_bytes = 0, write_bytes = 0;
+  size_t len;
+  int i;
+
+  len = snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"plan\", \"dryRun\": %s, \"volumes\": [",
+		 dry_run ? "true" : "false");
+
+  for (i = 0; i < (int)MANAGED_COUNT; i++) {
+    static const char *changes[] = { "none", "shrink", "grow", "create", "remove", "format" };
+    len += snprintf(buffer + len, sizeof buffer - len,
+		    "%s{\"name\": \"%s\", \"type\": \"%s\", \"currentKB\": %llu, \"targetKB\": %llu, "
+		    "\"usedKB\": %llu, \"change\": \"%s\"}",
+		    i ? ", " : "", targets[i].volume->name, fs_type_name(targets[i].current_type),
+		    targets[i].current_kb, targets[i].specified ? targets[i].target_kb : targets[i].current_kb,
+		    targets[i].used_kb, changes[targets[i].change]);
+  }
+
+  len += snprintf(buffer + len, sizeof buffer - len, "], \"steps\": [");
+
+  for (i = 0; (i < plan->count) && (len < sizeof buffer - MAXLINLEN); i++) {
+    len += snprintf(buffer + len, sizeof buffer - len, "%s{\"name\": \"%s\", \"volume\": \"%s\", \"command\": \"%s\"}",
+		    i ? ", " : "", plan->steps[i].name, plan->steps[i].volume,
+		    json_escape_buf(plan->steps[i].command, esc));
+    read_bytes += plan->steps[i].read_bytes;
+    write_bytes += plan->steps[i].write_bytes;
+  }
+
+  snprintf(buffer + len, sizeof buffer - len, "], \"eta\": %ld}",
+	   calibration_eta(read_bytes, write_bytes, 0));
+
+  respond_quietly(message, buffer);
+}
+
+//
+// Record the targets, and the state each volume was in when the plan
+// was made, so that a resume can build exactly the same plan.
+//
+static void save_targets(JOURNAL *journal, const LAYOUT_TARGET *targets) {
+  char value[MAXLINLEN];
+  unsigned int i;
+
+  for (i = 0; i < MANAGED_COUNT; i++) {
+    const LAYOUT_TARGET *t = &targets[i];
+    snprintf(value, sizeof value, "%d %llu %d %llu %d %llu %d", t->specified, t->target_kb, t->format,
+	     t->current_kb, (int)t->current_type, t->used_kb, t->mounted);
+    journal_set(journal, managed[i].name, value);
+  }
+}
+
+static const char *load_targets(LAYOUT_TARGET *targets, int *start) {
+  JOURNAL journal;
+  const char *sequence;
+  unsigned int i;
+
+  if (!journal_load(RESIZE_JOURNAL, &journal) || !(sequence = journal_get(&journal, "sequence")) ||
+      strcmp(sequence, LAYOUT_SEQUENCE)) {
+    return "No layout to resume";
+  }
+
+  for (i = 0; i < MANAGED_COUNT; i++) {
+    LAYOUT_TARGET *t = &targets[i];
+    const char *value = journal_get(&journal, managed[i].name);
+    int specified, format, type, mounted;
+
+    if (!value || (sscanf(value, "%d %llu %d %llu %d %llu %d", &specified, &t->target_kb, &format,
+			  &t->current_kb, &type, &t->used_kb, &mounted) != 7)) {
+      return "Layout journal is damaged";
+    }
+    t->specified = specified;
+    t->format = format;
+    t->current_type = (FS_TYPE)type;
+    t->mounted = mounted;
+  }
+
+  *start = (int)journal_get_number(&journal, "phase");
+
+  return NULL;
+}
+
+//
+// Whether the volume is already in the state a step would leave it in,
+// because an earlier run got that far or there is nothing to do.
+//
+static bool step_done(const LAYOUT_STEP *step) {
+  const LAYOUT_VOLUME *volume = &managed[step->index];
+
+  if ((step->flags & STEP_UNMOUNT) && !volume_in_use(volume)) return true;
+  if ((step->flags & STEP_MOUNT) && volume_in_use(volume)) return true;
+  if ((step->flags & STEP_VOLUME) && ((lvm_volume_bytes(LVM_GROUP_NAME, volume->name) >> 10) == step->volume_kb)) {
+    return true;
+  }
+
+  return false;
+}
+
+static bool step_succeeded(const LAYOUT_STEP *step, int code) {
+  if (step->flags & STEP_IGNORE_FAILURE) return true;
+  if (code == 0) return true;
+  if ((step->flags & STEP_FSCK) && (code == 1)) return true;
+  return false;
+}
+
+//
+// Run one step, passing its output back as status messages along with
+// the progress of the whole plan.  A step that puts a volume back is run
+// even once the plan has been cancelled.  Returns the exit code, or -1
+// if it could not be run or was killed.
+//
+static int run_step(LAYOUT_PLAN *plan, int index, unsigned long long done, unsigned long long total, bool always) {
+  const LAYOUT_STEP *step = &plan->steps[index];
+  unsigned long long weight = step_weight(step);
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char line[MAXLINLEN];
+  SPAWN_CHILD child;
+  bool cancelled;
+  int code;
+
+  log_printf(LOG_DEBUG, "Layout step %s on %s: %s\n", step->name, step->volume, step->command);
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"step\", \"step\": \"%s\", \"volume\": \"%s\", "
+	   "\"index\": %d, \"count\": %d, \"percent\": %d}",
+	   step->name, step->volume, index, plan->count, (int)(done * 100 / total));
+  respond_quietly(plan->message, buffer);
+
+  if (step->native) {
+    pthread_mutex_lock(&layout_lock);
+    cancelled = layout_cancelled && !always;
+    pthread_mutex_unlock(&layout_lock);
+    if (cancelled) return -1;
+
+    snprintf(line, sizeof line, "/dev/%s/%s", LVM_GROUP_NAME, step->volume);
+    return step->native(line) ? 0 : -1;
+  }
+
+  pthread_mutex_lock(&layout_lock);
+  if ((layout_cancelled && !always) || !spawn_command_policy(&layout_child, step->command, &plan->policy)) {
+    pthread_mutex_unlock(&layout_lock);
+    return -1;
+  }
+  child = layout_child;
+  pthread_mutex_unlock(&layout_lock);
+
+  while (fgets(line, sizeof line, child.fp)) {
+    int percent;
+
+    // Chomp the newline
+    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
+
+    percent = spawn_parse_percent(line);
+    if ((percent < 0) || (percent > 100)) percent = 0;
+
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"status\", \"step\": \"%s\", \"volume\": \"%s\", "
+	     "\"status\": \"%s\", \"percent\": %d}",
+	     step->name, step->volume, json_escape_buf(line, esc),
+	     (int)((done + weight * percent / 100) * 100 / total));
+    respond_quietly(plan->message, buffer);
+  }
+
+  pthread_mutex_lock(&layout_lock);
+  code = spawn_wait(&layout_child);
+  pthread_mutex_unlock(&layout_lock);
+
+  return code;
+}
+
+void *layout_thread(void *ctx) {
+  LAYOUT_PLAN *plan = (LAYOUT_PLAN *)ctx;
+  unsigned long long done = 0, total = 0;
+  bool down[MANAGED_COUNT];
+  char buffer[MAXLINLEN];
+  JOURNAL journal;
+  bool cancelled;
+  int i, failed = -1, code = 0;
+
+  memset(down, 0, sizeof down);
+
+  for (i = 0; i < plan->count; i++) {
+    total += step_weight(&plan->steps[i]);
+
+    // Steps before the resume point ran before the interruption.
+    if (i < plan->start) {
+      done += step_weight(&plan->steps[i]);
+      if (plan->steps[i].flags & STEP_TAKE_DOWN) down[plan->steps[i].index] = true;
+    }
+  }
+
+  journal_init(&journal);
+  if (plan->resuming) journal_load(RESIZE_JOURNAL, &journal);
+
+  journal_set(&journal, "sequence", LAYOUT_SEQUENCE);
+  if (!journal_get(&journal, "started")) journal_set_number(&journal, "started", time(NULL));
+  save_targets(&journal, plan->targets);
+
+  // Volumes put back after the interruption are taken out of use again.
+  for (i = 0; (i < plan->start) && (failed < 0); i++) {
+    const LAYOUT_STEP *step = &plan->steps[i];
+
+    if ((step->flags & STEP_TAKE_DOWN) && volume_in_use(&managed[step->index])) {
+      code = run_step(plan, i, done, total, false);
+      if (!step_succeeded(step, code)) failed = i;
+    }
+  }
+
+  for (i = plan->start; (i < plan->count) && (failed < 0); i++) {
+    const LAYOUT_STEP *step = &plan->steps[i];
+
+    // Checkpoint before starting, so an interruption names this step.
+    journal_set_number(&journal, "phase", i);
+    journal_set(&journal, "phaseName", step->name);
+    journal_set(&journal, "state", "running");
+    if (!journal_save(RESIZE_JOURNAL, &journal)) {
+      log_printf(LOG_ERR, "Unable to write resize journal\n");
+      code = -1;
+      failed = i;
+      break;
+    }
+
+    if (step->flags & STEP_TAKE_DOWN) down[step->index] = true;
+
+    if (!step_done(step)) {
+      code = run_step(plan, i, done, total, false);
+      if (!step_succeeded(step, code)) failed = i;
+    }
+
+    done += step_weight(step);
+  }
+
+  if (failed >= 0) {
+    pthread_mutex_lock(&layout_lock);
+    cancelled = layout_cancelled;
+    pthread_mutex_unlock(&layout_lock);
+
+    log_printf(LOG_ERR, "Layout step %s on %s failed with %d\n",
+	       plan->steps[failed].name, plan->steps[failed].volume, code);
+
+    // Whatever stopped the plan, put back every volume it took out of use.
+    for (i = failed + 1; i < plan->count; i++) {
+      const LAYOUT_STEP *step = &plan->steps[i];
+      if ((step->flags & STEP_RESTORE) && down[step->index] && !step_done(step)) {
+	run_step(plan, i, done, total, true);
+      }
+    }
+
+    // Keep the journal, so the layout can be resumed.
+    journal_set(&journal, "state", cancelled ? "cancelled" : "failed");
+    journal_set_number(&journal, "exitCode", (unsigned long long)(long long)code);
+    journal_save(RESIZE_JOURNAL, &journal);
+
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": false, \"errorCode\": %d, \"stage\": \"%s\", \"step\": \"%s\", \"volume\": \"%s\", "
+	     "\"index\": %d}",
+	     code, cancelled ? "cancelled" : "failed", plan->steps[failed].name, plan->steps[failed].volume, failed);
+  }
+  else {
+    journal_remove(RESIZE_JOURNAL);
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"completed\", \"count\": %d}", plan->count);
+  }
+
+  pthread_mutex_lock(&layout_lock);
+  layout_running = false;
+  layout_cancelled = false;
+  pthread_mutex_unlock(&layout_lock);
+
+  lvm_release();
+
+  respond_quietly(plan->message, buffer);
+
+  LSMessageUnref(plan->message);
+  free(plan);
+
+  return NULL;
+}
+
+//
+// Parse the volumes argument: a list of { name, size, type, format }.
+// A size of zero removes a volume; volumes not listed are left alone.
+//
+static const char *parse_targets(json_t *object, LAYOUT_TARGET *targets) {
+  json_t *volumes = json_find_first_label(object, "volumes");
+  json_t *item;
+  unsigned int i;
+
+  if (!volumes || !volumes->child || (volumes->child->type != JSON_ARRAY)) return "Invalid or missing volumes";
+
+  for (item = volumes->child->child; item; item = item->next) {
+    json_t *name = json_find_first_label(item, "name");
+    json_t *size = json_find_first_label(item, "size");
+    json_t *type = json_find_first_label(item, "type");
+    json_t *format = json_find_first_label(item, "format");
+    LAYOUT_TARGET *target = NULL;
+
+    if (!name || (name->child->type != JSON_STRING)) return "Invalid or missing volume name";
+
+    for (i = 0; i < MANAGED_COUNT; i++) {
+      if (!strcmp(managed[i].name, name->child->text)) target = &targets[i];
+    }
+    if (!target) return "Volume is not managed by tailor";
+
+    if (!size || ((size->child->type != JSON_STRING) && (size->child->type != JSON_NUMBER)) ||
+	(strspn(size->child->text, ALLOWED_CHARS) != strlen(size->child->text))) {
+      return "Invalid or missing volume size";
+    }
+
+    if (type && ((type->child->type != JSON_STRING) ||
+		 strcmp(type->child->text, fs_type_name(managed[target - targets].type)))) {
+      return "Unsupported filesystem type for volume";
+    }
+
+    target->specified = true;
+    target->target_kb = lvm_parse_size(size->child->text) >> 10;
+    target->format = format && (format->child->type == JSON_TRUE);
+  }
+
+  return NULL;
+}
+
+//
+// Bring the managed volumes in the store group to a target layout, in as
+// few steps as possible, as a single job.  Progress is kept in the resize
+// journal; with resume set, an interrupted layout carries on from the
+// step it was at.
+//
+bool apply_layout_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem;
+  LAYOUT_PLAN *plan;
+  pthread_t thread;
+  bool dry_run;
+  int start = 0;
+
+  plan = calloc(1, sizeof(LAYOUT_PLAN));
+  if (!plan) {
+    problem = "Out of memory";
+    goto refuse;
+  }
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *dry = json_find_first_label(object, "dryRun");
+  json_t *resume = json_find_first_label(object, "resume");
+  dry_run = dry && (dry->child->type == JSON_TRUE);
+  plan->resuming = resume && (resume->child->type == JSON_TRUE);
+  problem = plan->resuming ? NULL : parse_targets(object, plan->targets);
+  if (!problem) problem = io_policy_parse(object, &plan->policy);
+  json_free_value(&object);
+  if (problem) goto refuse;
+
+  if (plan->resuming) {
+    problem = load_targets(plan->targets, &start);
+    if (problem) goto refuse;
+  }
+  else if (access(RESIZE_JOURNAL, F_OK) == 0) {
+    problem = "An interrupted resize must be resumed or discarded first";
+    goto refuse;
+  }
+
+  problem = diff_layout(plan->targets, plan->resuming);
+  if (problem) goto refuse;
+
+  build_plan(plan, plan->targets);
+
+  if (plan->resuming) {
+    if ((start < 0) || (start >= plan->count)) {
+      problem = "Layout journal is damaged";
+      goto refuse;
+    }
+
+    // An interrupted relocation may have left the filesystem inconsistent,
+    // so go back to the check before it.
+    if ((plan->steps[start].flags & STEP_RELOCATE) && (start > 0) &&
+	(plan->steps[start - 1].flags & STEP_FSCK) && (plan->steps[start - 1].index == plan->steps[start].index)) {
+      start--;
+    }
+    plan->start = start;
+  }
+
+  send_plan(message, plan, plan->targets, dry_run);
+
+  if (dry_run || !plan->count) {
+    free(plan);
+    if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"completed\", \"count\": 0}", &lserror)) goto error;
+    return true;
+  }
+
+  pthread_mutex_lock(&layout_lock);
+  if (layout_running || !lvm_claim("layout")) {
+    pthread_mutex_unlock(&layout_lock);
+    problem = "Volume group is busy";
+    goto refuse;
+  }
+  layout_running = true;
+  layout_cancelled = false;
+  pthread_mutex_unlock(&layout_lock);
+
+  // Ref and save the message for use in layout thread
+  LSMessageRef(message);
+  plan->message = message;
+
+  if (pthread_create(&thread, NULL, layout_thread, (void*)plan)) {
+    LSMessageUnref(message);
+    pthread_mutex_lock(&layout_lock);
+    layout_running = false;
+    pthread_mutex_unlock(&layout_lock);
+    lvm_release();
+    problem = "Unable to start layout thread";
+    goto refuse;
+  }
+
+  pthread_detach(thread);
+
+  return true;
+
+ refuse:
+  free(plan);
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}", problem);
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+//
+// Kill the step in progress, which stops the rest of the plan.
+//
+bool kill_apply_layout_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  bool running;
+
+  pthread_mutex_lock(&layout_lock);
+  running = layout_running;
+  if (running) {
+    layout_cancelled = true;
+    spawn_kill(&layout_child, SIGTERM);
+  }
+  pthread_mutex_unlock(&layout_lock);
+
+  if (!LSMessageRespond(message, running ? "{\"returnValue\": true}" : "{\"returnValue\": false, \"stage\": \"failed\"}",
+			&lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
@@ -0,0 +1,33 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef LAYOUT_H_
+#define LAYOUT_H_
+
+#include <lunaservice.h>
+
+// Most steps a plan can have (every managed volume changed at once).
+#define LAYOUT_MAX_STEPS 40
+
+// Space left above the data when checking that a shrink can succeed.
+#define LAYOUT_SLACK_PERCENT 5
+
+bool apply_layout_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool kill_apply_layout_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* LAYOUT_H_ */
@@ -0,0 +1,269 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "luna_methods.h"
+#include "logger.h"
+
+//
+// Writers take the next sequence number and fill the slot it maps to,
+// marking the slot as being written while they do so.  Readers copy a
+// slot and then check its mark is unchanged, so nobody ever waits for
+// anyone else.  Where the compiler has no atomic builtins (the older ARM
+// toolchains), taking a number falls back to a mutex held only for the
+// increment.
+//
+
+typedef struct {
+  volatile uint32_t mark;
+  struct timeval when;
+  int priority;
+  char text[LOG_TEXT];
+} LOG_ENTRY;
+
+static LOG_ENTRY ring[LOG_SLOTS];
+static volatile uint32_t log_head = 0;
+
+static int log_level = LOG_NOTICE;
+static bool log_stderr = false;
+static volatile bool log_stop = false;
+static bool flusher_started = false;
+static pthread_t flusher;
+
+static const char *level_names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+#ifdef __GCC_HAVE_SYNC_COMPARE_AND_SWAP_4
+#define LOG_CLAIM()   __sync_fetch_and_add(&log_head, 1)
+#define LOG_BARRIER() __sync_synchronize()
+#else
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t log_claim(void) {
+  uint32_t seq;
+
+  pthread_mutex_lock(&claim_lock);
+  seq = log_head++;
+  pthread_mutex_unlock(&claim_lock);
+
+  return seq;
+}
+
+#define LOG_CLAIM()   log_claim()
+#define LOG_BARRIER() do { pthread_mutex_lock(&claim_lock); pthread_mutex_unlock(&claim_lock); } while (0)
+#endif
+
+void log_printf(int priority, const char *format, ...) {
+  char text[LOG_TEXT];
+  LOG_ENTRY *entry;
+  va_list args;
+  uint32_t seq;
+  size_t len;
+
+  if (priority > log_level) return;
+
+  va_start(args, format);
+  vsnprintf(text, sizeof text, format, args);
+  va_end(args);
+
+  // Callers end their lines as they would for syslog.
+  len = strlen(text);
+  if (len && (text[len - 1] == '\n')) text[len - 1] = '\0';
+
+  seq = LOG_CLAIM();
+  entry = &ring[seq & (LOG_SLOTS - 1)];
+
+  entry->mark = 0;
+  LOG_BARRIER();
+  gettimeofday(&entry->when, NULL);
+  entry->priority = priority;
+  strcpy(entry->text, text);
+  LOG_BARRIER();
+  entry->mark = seq + 1;
+}
+
+//
+// Copy out an entry.  Returns false if the slot does not (or no longer)
+// hold that entry.
+//
+static bool read_entry(uint32_t seq, LOG_ENTRY *copy) {
+  LOG_ENTRY *entry = &ring[seq & (LOG_SLOTS - 1)];
+
+  if (entry->mark != seq + 1) return false;
+  LOG_BARRIER();
+  memcpy(copy, (const void *)entry, sizeof *copy);
+  copy->text[LOG_TEXT - 1] = '\0';
+  LOG_BARRIER();
+
+  return entry->mark == seq + 1;
+}
+
+static void *flusher_thread(void *ctx) {
+  uint32_t flushed = 0;
+  bool stalled = false;
+  LOG_ENTRY copy;
+
+  while (true) {
+    bool stop = log_stop;
+    uint32_t head;
+
+    LOG_BARRIER();
+    head = log_head;
+
+    if (head - flushed > LOG_SLOTS) {
+      syslog(LOG_WARNING, "%u log entries overwritten before they were flushed", head - flushed - LOG_SLOTS);
+      flushed = head - LOG_SLOTS;
+    }
+
+    while (flushed != head) {
+      if (!read_entry(flushed, &copy)) {
+	uint32_t mark = ring[flushed & (LOG_SLOTS - 1)].mark;
+
+	// Still being written: give the writer until the next round.
+	if (!stop && !stalled && ((mark == 0) || (mark <= flushed))) {
+	  stalled = true;
+	  break;
+	}
+	stalled = false;
+	flushed++;
+	continue;
+      }
+
+      syslog(copy.priority, "%s", copy.text);
+      if (log_stderr) fprintf(stderr, "%s\n", copy.text);
+      stalled = false;
+      flushed++;
+    }
+
+    if (stop) break;
+    usleep(LOG_FLUSH_MSECS * 1000);
+  }
+
+  return NULL;
+}
+
+//
+// Set the level from the --debug option, and start the flusher.
+//
+void log_init(int debug) {
+  log_level = (debug >= 2) ? LOG_DEBUG : (debug == 1) ? LOG_INFO : LOG_NOTICE;
+  log_stderr = (debug > 0);
+
+  flusher_started = !pthread_create(&flusher, NULL, flusher_thread, NULL);
+}
+
+void log_shutdown(void) {
+  if (!flusher_started) return;
+
+  log_stop = true;
+  pthread_join(flusher, NULL);
+  flusher_started = false;
+}
+
+//
+// Return recent entries from memory: at most count of them, at or above
+// the given level, and no older than since (the next value of a previous
+// call), oldest first.
+//
+bool get_log_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  int count = LOG_DEFAULT_COUNT;
+  int level = LOG_DEBUG;
+  uint32_t since = 0, head, seq, first;
+  LOG_ENTRY *entries;
+  char esc[LOG_TEXT * 6 + 1];
+  char *buffer;
+  size_t size, len;
+  int found = 0, i;
+  bool ok;
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *count_arg = json_find_first_label(object, "count");
+  json_t *level_arg = json_find_first_label(object, "level");
+  json_t *since_arg = json_find_first_label(object, "since");
+
+  if (count_arg && (count_arg->child->type == JSON_NUMBER)) {
+    count = atoi(count_arg->child->text);
+    if ((count < 1) || (count > LOG_SLOTS)) count = LOG_SLOTS;
+  }
+  if (level_arg && (level_arg->child->type == JSON_STRING)) {
+    for (i = 0; i <= LOG_DEBUG; i++) {
+      if (!strcmp(level_arg->child->text, level_names[i])) level = i;
+    }
+  }
+  if (since_arg && (since_arg->child->type == JSON_NUMBER)) {
+    since = (uint32_t)strtoul(since_arg->child->text, NULL, 10);
+  }
+
+  json_free_value(&object);
+
+  LOG_BARRIER();
+  head = log_head;
+  first = (head > LOG_SLOTS) ? head - LOG_SLOTS : 0;
+  if (since > first) first = since;
+  if (first > head) first = head;
+
+  entries = malloc(LOG_SLOTS * sizeof(LOG_ENTRY));
+  size = (size_t)count * (sizeof esc + 96) + 128;
+  buffer = malloc(size);
+  if (!entries || !buffer) {
+    free(entries);
+    free(buffer);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Out of memory\"}", &lserror)) goto error;
+    return true;
+  }
+
+  // Keep the newest count entries which match.
+  for (seq = first; seq != head; seq++) {
+    LOG_ENTRY copy;
+    if (!read_entry(seq, &copy) || (copy.priority > level)) continue;
+    entries[found++ % count] = copy;
+  }
+
+  len = snprintf(buffer, size, "{\"returnValue\": true, \"next\": %u, \"level\": \"%s\", \"entries\": [",
+		 head, level_names[log_level]);
+
+  for (i = (found > count) ? found - count : 0; i < found; i++) {
+    LOG_ENTRY *entry = &entries[i % count];
+    len += snprintf(buffer + len, size - len, "%s{\"time\": %ld.%03ld, \"priority\": \"%s\", \"text\": \"%s\"}",
+		    (len && buffer[len - 1] == '[') ? "" : ", ", (long)entry->when.tv_sec, (long)entry->when.tv_usec / 1000,
+		    level_names[entry->priority & 7], json_escape_buf(entry->text, esc));
+  }
+
+  snprintf(buffer + len, size - len, "]}");
+
+  ok = LSMessageRespond(message, buffer, &lserror);
+  free(entries);
+  free(buffer);
+  if (!ok) goto error;
+
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
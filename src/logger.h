@@ -0,0 +1,49 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include <stdbool.h>
+#include <syslog.h>
+#include <lunaservice.h>
+
+//
+// An in-memory ring of recent log entries, at the syslog priorities.
+// log_printf only formats into a slot; a flusher thread passes entries
+// on to syslog (and to stderr when debugging), and getLog reads them
+// straight from the ring.
+//
+
+// Entries kept, which must be a power of two, and the text each holds.
+#define LOG_SLOTS 512
+#define LOG_TEXT  256
+
+// How often the flusher looks for new entries.
+#define LOG_FLUSH_MSECS 250
+
+// Entries returned by getLog when no count is given.
+#define LOG_DEFAULT_COUNT 50
+
+void log_init(int debug);
+void log_shutdown(void);
+void log_printf(int priority, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+
+bool get_log_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* LOGGER_H_ */
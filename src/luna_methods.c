@@ -21,12 +21,23 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <syslog.h>
 
 #include "luna_service.h"
 #include "luna_methods.h"
-
-#define ALLOWED_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-"
+#include "logger.h"
+#include "scan_usage.h"
+#include "calibrate.h"
+#include "resize.h"
+#include "swap.h"
+#include "backup.h"
+#include "layout.h"
+#include "ext3_check.h"
+#include "ext3_upgrade.h"
+#include "profile.h"
+#include "verify.h"
+#include "fat_check.h"
+#include "compact.h"
+#include "iostats.h"
 
 #define API_VERSION "1"
 
@@ -39,31 +50,24 @@ static char esc_buffer[MAXBUFLEN];
 static char run_command_buffer[MAXBUFLEN];
 static char read_file_buffer[CHUNKSIZE+CHUNKSIZE+1];
 
-typedef struct {
-  LSMessage *message;
-  FILE *fp;
-} THREAD_DATA;
-
-pthread_t resizeMediaThread = 0;
-
 //
 // Escape a string so that it can be used directly in a JSON response.
 // In general, this means escaping quotes, backslashes and control chars.
-// It uses the static esc_buffer, which must be twice as large as the
-// largest string this routine can handle.
+// The output buffer must be twice as large as the largest string this
+// routine can handle.  Worker threads use this with their own buffer.
 //
-static char *json_escape_str(char *str)
+char *json_escape_buf(const char *str, char *out)
 {
   const char *json_hex_chars = "0123456789abcdef";
 
   // Initialise the output buffer
-  strcpy(esc_buffer, "");
+  strcpy(out, "");
 
   // Check the constraints on the input string
-  if (strlen(str) > MAXBUFLEN) return (char *)esc_buffer;
+  if (strlen(str) > MAXBUFLEN) return out;
 
   // Initialise the pointers used to step through the input and output.
-  char *resultsPt = (char *)esc_buffer;
+  char *resultsPt = out;
   int pos = 0, start_offset = 0;
 
   // Traverse the input, copying to the output in the largest chunks
@@ -136,7 +140,28 @@ static char *json_escape_str(char *str)
   memcpy(resultsPt, "\0", 1);
 
   // and return a pointer to it.
-  return (char *)esc_buffer;
+  return out;
+}
+
+//
+// Send a response from a worker thread, where a failure can only be logged.
+//
+void respond_quietly(LSMessage *message, const char *payload) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  if (!LSMessageRespond(message, payload, &lserror)) {
+    LSErrorPrint(&lserror, stderr);
+    LSErrorFree(&lserror);
+  }
+}
+
+//
+// Escape a string into the static esc_buffer, for use on the main thread.
+//
+static char *json_escape_str(char *str)
+{
+  return json_escape_buf(str, esc_buffer);
 }
 
 //
@@ -187,7 +212,7 @@ static bool run_command(char *command, bool escape) {
   // Local buffers to store the current and previous lines.
   char line[MAXLINLEN];
 
-  fprintf(stderr, "Running command %s\n", command);
+  log_printf(LOG_DEBUG, "Running command %s\n", command);
 
   // run_command_buffer is assumed to be initialised, ready for strcat to append.
 
@@ -289,7 +314,7 @@ static bool report_command_failure(LSMessage *message, char *command, char *stdE
   // Terminate the JSON reply message ...
   strcat(buffer, "}");
 
-  fprintf(stderr, "Message is %s\n", buffer);
+  log_printf(LOG_DEBUG, "Message is %s\n", buffer);
 
   // and send it.
   if (!LSMessageRespond(message, buffer, &lserror)) goto error;
@@ -318,7 +343,7 @@ static bool simple_command(LSMessage *message, char *command) {
     // Finalise the message ...
     strcat(run_command_buffer, "], \"returnValue\": true}");
 
-    fprintf(stderr, "Message is %s\n", run_command_buffer);
+    log_printf(LOG_DEBUG, "Message is %s\n", run_command_buffer);
 
     // and send it to webOS.
     if (!LSMessageRespond(message, run_command_buffer, &lserror)) goto error;
@@ -340,146 +365,6 @@ static bool simple_command(LSMessage *message, char *command) {
   return false;
 }
 
-void resize_media_thread_cleanup(void *arg) {
-  THREAD_DATA *data = (THREAD_DATA *)arg;
-
-  syslog(LOG_DEBUG, "Resize thread cleanup, closing pipe %p, unref message %p\n", 
-      data->fp, data->message);
-
-  if (data->fp) pclose(data->fp);
-  if (data->message) LSMessageUnref(data->message);
-}
-
-
-void *resize_media_thread(void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-  char buffer[MAXBUFLEN];
-  char esc_buffer[MAXBUFLEN];
-  char command[MAXLINLEN];
-  THREAD_DATA data;
-  char line[MAXLINLEN];
-  pthread_key_t key;
-
-  data.message = (LSMessage *)ctx;
-
-  // Extract the group argument from the message
-  json_t *object = json_parse_document(LSMessageGetPayload(data.message));
-  json_t *size = json_find_first_label(object, "size");               
-  if (!size || (size->child->type != JSON_STRING) ||
-      (strspn(size->child->text, ALLOWED_CHARS) != strlen(size->child->text))) {
-    if (!LSMessageRespond(data.message,
-			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing size\"}",
-			&lserror)) goto error;
-    return NULL;
-  }
-
-  // Initialise the command
-  sprintf(command, "/bin/resizefat -v /dev/mapper/store-media %s 2>&1", size->child->text);
-
-  // Create thread key/value
-  pthread_key_create(&key, resize_media_thread_cleanup);
-  pthread_setspecific(key, &data);
-
-  data.fp = popen(command, "r");
-  syslog(LOG_DEBUG, "resize pipe fp %p\n", data.fp);
-
-  if (!data.fp) {
-    if (!LSMessageRespond(data.message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
-    return NULL;
-  }
-
-  // Loop through the output lines
-  while (fgets(line, sizeof line, data.fp)) {
-    // Chomp the newline
-    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
-
-    // Send it as a status message.
-    strcpy(buffer, "{\"returnValue\": true, \"stage\": \"status\", \"status\": \"");
-    strcat(buffer, json_escape_str(line));
-    strcat(buffer, "\"}");
-
-    // %%% Should we break out of the loop here, or just ignore the error? %%%
-    if (!LSMessageRespond(data.message, buffer, &lserror)) goto error;
-
-  }
-
-  if (!LSMessageRespond(data.message, "{\"returnValue\": true, \"stage\": \"completed\"}", &lserror)) goto error;
-
-  goto end;
-
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return NULL;
-}
-
-//
-// Run resizefat and provide the output back to Mojo
-//
-bool resize_media_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  if (resizeMediaThread) {
-    syslog(LOG_NOTICE, "Resize thread already running\n");
-    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
-    return true;
-  }
-
-  syslog(LOG_DEBUG, "Create resize thread, ref message %p\n", message);
-
-  // Ref and save the message for use in resize thread
-  LSMessageRef(message);
-
-  if (pthread_create(&resizeMediaThread, NULL, resize_media_thread, (void*)message)) {
-    syslog(LOG_ERR, "Creating resize thread failed (0x%x)\n", resizeMediaThread);
-    // Report that the resize operation was not able to start
-    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to start resize thread\"}", &lserror)) goto error;
-  }
-  else {
-    syslog(LOG_DEBUG, "Created resize thread successfully (0x%x)\n", resizeMediaThread);
-    // Report that the resize operation has begun
-    if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
-  }
-
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
-}
-
-//
-// Kill the currently running resize
-//
-bool kill_resize_media_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
-  LSError lserror;
-  LSErrorInit(&lserror);
-
-  if (!resizeMediaThread) {
-    syslog(LOG_NOTICE, "Resize thread 0x%x not running\n", resizeMediaThread);
-    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
-    return true;
-  }
-
-  syslog(LOG_DEBUG, "Killing resize thread 0x%x\n", resizeMediaThread);
-  
-  pthread_cancel(resizeMediaThread);
-  resizeMediaThread = 0;
-
-  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"completed\"}", &lserror)) goto error;
-
-  return true;
- error:
-  LSErrorPrint(&lserror, stderr);
-  LSErrorFree(&lserror);
- end:
-  return false;
-}
-
 //
 // Run command to retrieve volume group information.
 //
@@ -591,7 +476,7 @@ bool get_usage_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
 
 // Run command to unmount a bind mount
 //
-bool unmount_bind__method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+bool unmount_bind_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
   LSError lserror;
   LSErrorInit(&lserror);
 
@@ -760,10 +645,37 @@ LSMethod luna_methods[] = {
   { "listVolumes",	list_volumes_method },
   { "listMounts",	list_mounts_method },
   { "getUsage",		get_usage_method },
+  { "scanUsage",	scan_usage_method },
+  { "calibrateDevice",	calibrate_device_method },
+  { "getCalibration",	get_calibration_method },
   { "unmountBind",	unmount_bind_method },
   { "unmountMedia",	unmount_media_method },
   { "resizeMedia",	resize_media_method },
   { "killResizeMedia",	kill_resize_media_method },
+  { "resizeVolume",	resize_volume_method },
+  { "resumeResize",	resume_resize_method },
+  { "getResizeJournal",	get_resize_journal_method },
+  { "discardResize",	discard_resize_method },
+  { "getSwap",		get_swap_method },
+  { "resizeSwap",	resize_swap_method },
+  { "setSwapPriority",	set_swap_priority_method },
+  { "configureZram",	configure_zram_method },
+  { "backupVolume",	backup_volume_method },
+  { "restoreVolume",	restore_volume_method },
+  { "killBackupVolume",	kill_backup_volume_method },
+  { "applyLayout",	apply_layout_method },
+  { "killApplyLayout",	kill_apply_layout_method },
+  { "checkExt3fs",	check_ext3fs_method },
+  { "upgradeExt3fs",	upgrade_ext3fs_method },
+  { "applyProfile",	apply_profile_method },
+  { "listProfiles",	list_profiles_method },
+  { "verifyVolume",	verify_volume_method },
+  { "killVerifyVolume",	kill_verify_volume_method },
+  { "checkMedia",	check_media_method },
+  { "compactMedia",	compact_media_method },
+  { "killCompactMedia",	kill_compact_media_method },
+  { "ioStats",	io_stats_method },
+  { "getLog",	get_log_method },
   //  { "reduceMedia",	reduce_media_method },
   //  { "extendMedia",	extend_media_method },
   { "mountMedia",	mount_media_method },
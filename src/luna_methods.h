@@ -23,6 +23,12 @@
 
 bool register_methods(LSPalmService *serviceHandle, LSError lserror);
 
+char *json_escape_buf(const char *str, char *out);
+void respond_quietly(LSMessage *message, const char *payload);
+
+// Characters permitted in arguments which are passed on to a command.
+#define ALLOWED_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-"
+
 // Twice the chunk size (so any character can be escaped), plus a terminating null.
 #define MAXBUFLEN 8193
 // Size of file chunks to pass back up to webOS.
@@ -33,5 +39,9 @@ bool register_methods(LSPalmService *serviceHandle, LSError lserror);
 #define MAXNAMLEN  128
 // Max size of a version number or size string.
 #define MAXNUMLEN   32
+// Where state which must survive a restart (or a crash) is kept.
+#define STATE_DIR "/var/preferences/org.webosinternals.tailor"
+// Cluster size of the media volume, as created by mkdosfs -s 64.
+#define MEDIA_CLUSTER_SIZE (64*512)
 
 #endif /* LUNA_METHODS_H_ */
@@ -0,0 +1,170 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "luna_methods.h"
+#include "lvm.h"
+
+// The job (if any) currently changing the volumes in the group.
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *claim_owner = NULL;
+
+//
+// Read the extent size and free extent count of a volume group.
+// Uses the colon separated output of vgdisplay -c, in which field 13 is the
+// extent size in KiB, 14 the total extents and 16 the free extents.
+//
+bool lvm_group_info(const char *group, LVM_GROUP *info) {
+  char command[MAXLINLEN];
+  char line[MAXLINLEN];
+  bool found = false;
+  FILE *fp;
+
+  snprintf(command, sizeof command, "/usr/sbin/vgdisplay -c %s 2>/dev/null", group);
+
+  fp = popen(command, "r");
+  if (!fp) return false;
+
+  while (fgets(line, sizeof line, fp)) {
+    char *fields[17];
+    char *p = line;
+    int n = 0;
+
+    while (*p == ' ') p++;
+
+    while (n < 17) {
+      fields[n++] = p;
+      p = strchr(p, ':');
+      if (!p) break;
+      *p++ = '\0';
+    }
+
+    if ((n == 17) && !strcmp(fields[0], group)) {
+      info->extent_kb = strtoul(fields[12], NULL, 10);
+      info->total_extents = strtoul(fields[13], NULL, 10);
+      info->free_extents = strtoul(fields[15], NULL, 10);
+      found = (info->extent_kb > 0);
+    }
+  }
+
+  pclose(fp);
+  return found;
+}
+
+//
+// Size in bytes of a logical volume, or zero if it does not exist.
+//
+unsigned long long lvm_volume_bytes(const char *group, const char *volume) {
+  unsigned long long bytes = 0;
+  char device[MAXLINLEN];
+  int fd;
+
+  snprintf(device, sizeof device, "/dev/%s/%s", group, volume);
+
+  fd = open(device, O_RDONLY);
+  if (fd < 0) return 0;
+
+  if (ioctl(fd, BLKGETSIZE64, &bytes)) bytes = 0;
+
+  close(fd);
+  return bytes;
+}
+
+//
+// Run an LVM (or other) tool, collecting the last of its output in the
+// supplied buffer for use in an error report.  Returns true on success.
+//
+bool lvm_run(const char *command, char *output, size_t size) {
+  char redirected[MAXLINLEN];
+  char line[MAXLINLEN];
+  FILE *fp;
+
+  snprintf(redirected, sizeof redirected, "%s 2>&1", command);
+
+  if (output && size) output[0] = '\0';
+
+  fp = popen(redirected, "r");
+  if (!fp) return false;
+
+  while (fgets(line, sizeof line, fp)) {
+    char *nl = strchr(line, '\n'); if (nl) *nl = 0;
+    if (output && size) {
+      strncpy(output, line, size - 1);
+      output[size - 1] = '\0';
+    }
+  }
+
+  return (pclose(fp) == 0);
+}
+
+//
+// Parse a size argument such as "2048M" or "2G" into bytes.
+// A bare number is taken as MiB, as it is by the LVM tools.
+//
+unsigned long long lvm_parse_size(const char *text) {
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+
+  switch (*end) {
+  case 'k': case 'K': return value << 10;
+  case 'g': case 'G': return value << 30;
+  case 'b': case 'B': return value;
+  default:            return value << 20;
+  }
+}
+
+//
+// Only one job at a time may resize, create or remove volumes.
+// Returns false if another job already holds the group.
+//
+bool lvm_claim(const char *owner) {
+  bool claimed = false;
+
+  pthread_mutex_lock(&claim_lock);
+  if (!claim_owner) {
+    claim_owner = owner;
+    claimed = true;
+  }
+  pthread_mutex_unlock(&claim_lock);
+
+  return claimed;
+}
+
+void lvm_release(void) {
+  pthread_mutex_lock(&claim_lock);
+  claim_owner = NULL;
+  pthread_mutex_unlock(&claim_lock);
+}
+
+const char *lvm_claimed_by(void) {
+  const char *owner;
+
+  pthread_mutex_lock(&claim_lock);
+  owner = claim_owner;
+  pthread_mutex_unlock(&claim_lock);
+
+  return owner;
+}
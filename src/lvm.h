@@ -0,0 +1,43 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef LVM_H_
+#define LVM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The volume group holding media, ext3fs and swap.
+#define LVM_GROUP_NAME "store"
+
+typedef struct {
+  unsigned long extent_kb;
+  unsigned long total_extents;
+  unsigned long free_extents;
+} LVM_GROUP;
+
+bool lvm_group_info(const char *group, LVM_GROUP *info);
+unsigned long long lvm_volume_bytes(const char *group, const char *volume);
+bool lvm_run(const char *command, char *output, size_t size);
+unsigned long long lvm_parse_size(const char *text);
+
+bool lvm_claim(const char *owner);
+void lvm_release(void);
+const char *lvm_claimed_by(void);
+
+#endif /* LVM_H_ */
@@ -0,0 +1,443 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "spawn.h"
+#include "journal.h"
+#include "fs_probe.h"
+#include "fstab.h"
+#include "ext3_check.h"
+#include "profile.h"
+
+//
+// "balanced" is what the volume has been mounted with until now: the ext3
+// defaults for a plain rw,noatime mount, mke2fs's 5% reserve, and the
+// cluster size createMedia uses.
+//
+static const FS_PROFILE profiles[] = {
+  { "balanced",   "ordered",   5,  false, false, 5, MEDIA_CLUSTER_SIZE / 512 },
+  { "throughput", "writeback", 30, false, false, 0, 128 },
+  { "durable",    "journal",   5,  true,  false, 1, 32 },
+  { "flash",      "ordered",   15, true,  true,  0, 64 },
+  { NULL }
+};
+
+typedef struct {
+  long write_kbps;
+  long read_kbps;
+  long metadata_ops;
+} BENCH_RESULT;
+
+typedef struct {
+  LSMessage *message;
+  const FS_PROFILE *profile;
+  char device[MAXLINLEN];
+  char mountpoint[MAXLINLEN];
+  bool was_mounted;
+} PROFILE_JOB;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool profile_running = false;
+
+static const FS_PROFILE *find_profile(const char *name) {
+  int i;
+
+  for (i = 0; profiles[i].name; i++) {
+    if (!strcmp(profiles[i].name, name)) return &profiles[i];
+  }
+
+  return NULL;
+}
+
+static void profile_options(const FS_PROFILE *profile, bool ext4, char *options, size_t size) {
+  snprintf(options, size, "rw,noatime,data=%s,commit=%d,barrier=%d%s", profile->data_mode,
+	   profile->commit_secs, profile->barrier ? 1 : 0, (ext4 && profile->discard) ? ",discard" : "");
+}
+
+static bool volume_is_ext4(const char *device) {
+  FS_INFO info;
+  bool ext4;
+  int fd;
+
+  fd = open(device, O_RDONLY);
+  if (fd < 0) return false;
+  ext4 = fs_probe(fd, &info) && (info.type == FS_EXT3) &&
+    (info.ext3.feature_incompat & EXT3_FEATURE_INCOMPAT_EXTENTS);
+  close(fd);
+
+  return ext4;
+}
+
+//
+// Run a tool, passing its output back as status messages for the given
+// phase.  Returns its exit code (or -1).
+//
+static int run_tool(PROFILE_JOB *job, const char *phase, const char *command) {
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char line[MAXLINLEN];
+  SPAWN_CHILD child;
+
+  log_printf(LOG_INFO, "Running command %s\n", command);
+
+  if (!spawn_command(&child, command)) return -1;
+
+  while (fgets(line, sizeof line, child.fp)) {
+    // Chomp the newline
+    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
+
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"%s\", \"status\": \"%s\"}",
+	     phase, json_escape_buf(line, esc));
+    respond_quietly(job->message, buffer);
+  }
+
+  return spawn_wait(&child);
+}
+
+static long elapsed_msecs(const struct timespec *start) {
+  struct timespec now;
+  long msecs;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  msecs = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+
+  return msecs ? msecs : 1;
+}
+
+//
+// Measure the mounted volume: durable sequential writes, reads from the
+// flash rather than the page cache, and small synced files.
+//
+static const char *run_benchmark(const char *mountpoint, BENCH_RESULT *result) {
+  char dir[MAXLINLEN];
+  char path[MAXLINLEN];
+  const char *failure = NULL;
+  struct timespec start;
+  char *buffer;
+  size_t done;
+  struct stat st;
+  int fd, i;
+
+  snprintf(dir, sizeof dir, "%s/" PROFILE_BENCH_DIR, mountpoint);
+  if (mkdir(dir, 0700) && (errno != EEXIST)) return "Unable to create the benchmark directory";
+
+  buffer = malloc(PROFILE_BENCH_CHUNK);
+  if (!buffer) {
+    failure = "Out of memory";
+    goto end;
+  }
+  for (done = 0; done < PROFILE_BENCH_CHUNK; done++) buffer[done] = (char)(done * 31);
+
+  snprintf(path, sizeof path, "%s/data", dir);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  for (done = 0; (fd >= 0) && (done < PROFILE_BENCH_BYTES); done += PROFILE_BENCH_CHUNK) {
+    if (write(fd, buffer, PROFILE_BENCH_CHUNK) != PROFILE_BENCH_CHUNK) break;
+  }
+  if ((fd < 0) | (done < PROFILE_BENCH_BYTES) | fsync(fd)) {
+    if (fd >= 0) close(fd);
+    failure = "Benchmark write failed";
+    goto end;
+  }
+  result->write_kbps = (PROFILE_BENCH_BYTES / 1024) * 1000L / elapsed_msecs(&start);
+
+  // Best effort: the pages are clean after the fsync, and dropping them
+  // makes the read come from the flash rather than memory.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (close(fd)) {
+    failure = "Benchmark write failed";
+    goto end;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fd = open(path, O_RDONLY);
+  for (done = 0; (fd >= 0) && (done < PROFILE_BENCH_BYTES); done += PROFILE_BENCH_CHUNK) {
+    if (read(fd, buffer, PROFILE_BENCH_CHUNK) != PROFILE_BENCH_CHUNK) break;
+  }
+  if ((fd < 0) | (done < PROFILE_BENCH_BYTES) | close(fd)) {
+    failure = "Benchmark read failed";
+    goto end;
+  }
+  result->read_kbps = (PROFILE_BENCH_BYTES / 1024) * 1000L / elapsed_msecs(&start);
+  unlink(path);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < PROFILE_BENCH_FILES; i++) {
+    snprintf(path, sizeof path, "%s/f%d", dir, i);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if ((fd < 0) | (write(fd, buffer, PROFILE_BENCH_FILE_BYTES) != PROFILE_BENCH_FILE_BYTES) | fsync(fd) | close(fd)) {
+      failure = "Benchmark file creation failed";
+      goto end;
+    }
+  }
+  for (i = 0; i < PROFILE_BENCH_FILES; i++) {
+    snprintf(path, sizeof path, "%s/f%d", dir, i);
+    if (stat(path, &st) || unlink(path)) {
+      failure = "Benchmark file removal failed";
+      goto end;
+    }
+  }
+  result->metadata_ops = PROFILE_BENCH_FILES * 3 * 1000L / elapsed_msecs(&start);
+
+ end:
+  if (failure) {
+    snprintf(path, sizeof path, "%s/data", dir);
+    unlink(path);
+    for (i = 0; i < PROFILE_BENCH_FILES; i++) {
+      snprintf(path, sizeof path, "%s/f%d", dir, i);
+      unlink(path);
+    }
+  }
+  rmdir(dir);
+  free(buffer);
+  return failure;
+}
+
+static void report_benchmark(PROFILE_JOB *job, const char *phase, const BENCH_RESULT *result) {
+  char buffer[MAXLINLEN];
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"%s\", "
+	   "\"writeKBps\": %ld, \"readKBps\": %ld, \"metadataOps\": %ld}",
+	   phase, result->write_kbps, result->read_kbps, result->metadata_ops);
+  respond_quietly(job->message, buffer);
+}
+
+void *profile_thread(void *ctx) {
+  PROFILE_JOB *job = (PROFILE_JOB *)ctx;
+  const FS_PROFILE *profile = job->profile;
+  BENCH_RESULT before, after;
+  char command[MAXLINLEN];
+  char options[MAXLINLEN];
+  char buffer[MAXBUFLEN];
+  const char *failure = NULL;
+  const char *type;
+  bool mounted = job->was_mounted;
+  JOURNAL journal;
+  int changed = 0;
+
+  if (!mounted) {
+    snprintf(command, sizeof command, "/bin/mount %s", job->mountpoint);
+    if (run_tool(job, "mount", command) != 0) {
+      failure = "Unable to mount the volume";
+      goto end;
+    }
+    mounted = true;
+  }
+
+  failure = run_benchmark(job->mountpoint, &before);
+  if (failure) goto end;
+  report_benchmark(job, "benchmarkBefore", &before);
+
+  type = volume_is_ext4(job->device) ? "ext4" : "ext3";
+  profile_options(profile, !strcmp(type, "ext4"), options, sizeof options);
+
+  snprintf(command, sizeof command, "/sbin/tune2fs -m %d %s", profile->reserved_percent, job->device);
+  if (run_tool(job, "tune2fs", command) != 0) {
+    failure = "Unable to set the reserved blocks";
+    goto end;
+  }
+
+  // The journal mode only changes on a fresh mount.  Try the options by
+  // hand first, so that a kernel which refuses them leaves fstab alone.
+  snprintf(command, sizeof command, "/bin/umount %s", job->mountpoint);
+  if (run_tool(job, "unmount", command) != 0) {
+    failure = "Unable to unmount the volume";
+    goto end;
+  }
+  mounted = false;
+
+  snprintf(command, sizeof command, "/bin/mount -t %s -o %s %s %s", type, options, job->device, job->mountpoint);
+  if (run_tool(job, "mount", command) != 0) {
+    snprintf(command, sizeof command, "/bin/mount %s", job->mountpoint);
+    mounted = (run_tool(job, "mount", command) == 0);
+    failure = "Options were refused by the kernel";
+    goto end;
+  }
+  mounted = true;
+
+  failure = fstab_update(job->device, job->mountpoint, NULL, type, options, &changed);
+  if (failure) goto end;
+
+  failure = run_benchmark(job->mountpoint, &after);
+  if (failure) goto end;
+  report_benchmark(job, "benchmarkAfter", &after);
+
+  journal_init(&journal);
+  journal_set(&journal, "profile", profile->name);
+  journal_set(&journal, "options", options);
+  journal_set_number(&journal, "mediaClusterSize", profile->media_cluster);
+  if (!journal_save(PROFILE_JOURNAL, &journal)) log_printf(LOG_WARNING, "Unable to record profile %s\n", profile->name);
+
+ end:
+  if (mounted && !job->was_mounted) {
+    snprintf(command, sizeof command, "/bin/umount %s", job->mountpoint);
+    run_tool(job, "unmount", command);
+  }
+
+  if (failure) {
+    log_printf(LOG_ERR, "Applying profile %s failed: %s\n", profile->name, failure);
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}",
+	     failure);
+  }
+  else {
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"completed\", \"profile\": \"%s\", \"options\": \"%s\", "
+	     "\"reservedPercent\": %d, \"mediaClusterSize\": %d, \"fstabEntries\": %d, "
+	     "\"before\": {\"writeKBps\": %ld, \"readKBps\": %ld, \"metadataOps\": %ld}, "
+	     "\"after\": {\"writeKBps\": %ld, \"readKBps\": %ld, \"metadataOps\": %ld}}",
+	     profile->name, options, profile->reserved_percent, profile->media_cluster, changed,
+	     before.write_kbps, before.read_kbps, before.metadata_ops,
+	     after.write_kbps, after.read_kbps, after.metadata_ops);
+  }
+  respond_quietly(job->message, buffer);
+
+  pthread_mutex_lock(&profile_lock);
+  profile_running = false;
+  pthread_mutex_unlock(&profile_lock);
+  lvm_release();
+
+  LSMessageUnref(job->message);
+  free(job);
+
+  return NULL;
+}
+
+//
+// Apply a named profile to the ext3fs volume, benchmarking it before
+// and after so that the change can be judged on this device.
+//
+bool apply_profile_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem = NULL;
+  pthread_t thread;
+  PROFILE_JOB *job;
+  bool writable;
+
+  job = calloc(1, sizeof(PROFILE_JOB));
+  if (!job) {
+    problem = "Out of memory";
+    goto refuse;
+  }
+
+  strcpy(job->device, EXT3_DEFAULT_DEVICE);
+  strcpy(job->mountpoint, EXT3_DEFAULT_MOUNTPOINT);
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *name = json_find_first_label(object, "profile");
+  if (name && (name->child->type == JSON_STRING)) job->profile = find_profile(name->child->text);
+  json_free_value(&object);
+
+  if (!job->profile) {
+    problem = "Invalid or missing profile";
+    goto refuse;
+  }
+
+  job->was_mounted = fs_device_mounted(job->device, &writable);
+
+  pthread_mutex_lock(&profile_lock);
+  if (profile_running || !lvm_claim("profile")) {
+    pthread_mutex_unlock(&profile_lock);
+    log_printf(LOG_NOTICE, "Profile thread already running\n");
+    free(job);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  profile_running = true;
+  pthread_mutex_unlock(&profile_lock);
+
+  // Ref and save the message for use in profile thread
+  LSMessageRef(message);
+  job->message = message;
+
+  if (pthread_create(&thread, NULL, profile_thread, (void*)job)) {
+    LSMessageUnref(message);
+    pthread_mutex_lock(&profile_lock);
+    profile_running = false;
+    pthread_mutex_unlock(&profile_lock);
+    lvm_release();
+    problem = "Unable to start profile thread";
+    goto refuse;
+  }
+
+  pthread_detach(thread);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ refuse:
+  free(job);
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}", problem);
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+bool list_profiles_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXBUFLEN];
+  const char *current = NULL;
+  JOURNAL journal;
+  size_t len;
+  int i;
+
+  if (journal_load(PROFILE_JOURNAL, &journal)) current = journal_get(&journal, "profile");
+
+  if (current) len = snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"current\": \"%s\", \"profiles\": [", current);
+  else len = snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"profiles\": [");
+
+  for (i = 0; profiles[i].name && (len < sizeof buffer - MAXLINLEN); i++) {
+    len += snprintf(buffer + len, sizeof buffer - len,
+		    "%s{\"name\": \"%s\", \"dataMode\": \"%s\", \"commit\": %d, \"barrier\": %s, \"discard\": %s, "
+		    "\"reservedPercent\": %d, \"mediaClusterSize\": %d}",
+		    i ? ", " : "", profiles[i].name, profiles[i].data_mode, profiles[i].commit_secs,
+		    profiles[i].barrier ? "true" : "false", profiles[i].discard ? "true" : "false",
+		    profiles[i].reserved_percent, profiles[i].media_cluster);
+  }
+
+  snprintf(buffer + len, sizeof buffer - len, "]}");
+
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
@@ -0,0 +1,55 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdbool.h>
+#include <lunaservice.h>
+
+#include "luna_methods.h"
+
+//
+// A named set of filesystem settings.  The ext3fs ones are applied by
+// applyProfile; the media cluster size only takes effect when the media
+// volume is next created, so it is handed back for createMedia.
+//
+typedef struct {
+  const char *name;
+  const char *data_mode;	// ordered, writeback or journal
+  int commit_secs;
+  bool barrier;
+  bool discard;			// only where mounted as ext4
+  int reserved_percent;
+  int media_cluster;		// sectors, as mkdosfs -s takes them
+} FS_PROFILE;
+
+#define PROFILE_JOURNAL STATE_DIR "/profile.journal"
+
+// The benchmark: a sequential file written and read back, then small
+// files created, synced, looked up and removed.
+#define PROFILE_BENCH_DIR        ".tailor-benchmark"
+#define PROFILE_BENCH_BYTES      (16*1024*1024)
+#define PROFILE_BENCH_CHUNK      (256*1024)
+#define PROFILE_BENCH_FILES      200
+#define PROFILE_BENCH_FILE_BYTES 4096
+
+bool apply_profile_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool list_profiles_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* PROFILE_H_ */
@@ -0,0 +1,854 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "calibrate.h"
+#include "journal.h"
+#include "spawn.h"
+#include "io_policy.h"
+#include "fs_probe.h"
+#include "resize.h"
+
+// The outcome of this phase does not matter (signalling cryptofs).
+#define PHASE_IGNORE_FAILURE 0x01
+// A filesystem check, where exit code 1 means errors were corrected.
+#define PHASE_FSCK           0x02
+// Skipped if the volume is not mounted.
+#define PHASE_UNMOUNT        0x04
+// Skipped if the volume is already mounted.
+#define PHASE_MOUNT          0x08
+// Skipped if the volume is already at the target size.
+#define PHASE_VOLUME         0x10
+// Moves data around; checked before resuming, and progress is journaled.
+#define PHASE_RELOCATE       0x20
+// Takes the volume out of use; repeated on resume if it is mounted again.
+#define PHASE_TAKE_DOWN      0x40
+
+//
+// In the phase commands, %T is replaced by the target size in MiB and %F by
+// the size to shrink the filesystem to before the volume is reduced.
+//
+typedef struct {
+  const char *name;
+  const char *command;
+  int flags;
+} RESIZE_PHASE;
+
+typedef struct {
+  const char *name;
+  const char *volume;
+  const char *mountpoint;
+  const char *check;
+  const RESIZE_PHASE *phases;
+} RESIZE_SEQUENCE;
+
+//
+// These follow sbin/resize_media_internal.sh and sbin/resize_ext3fs.sh.
+//
+static const RESIZE_PHASE media_shrink_phases[] = {
+  { "stopCryptofs",	"/usr/bin/pkill -SIGUSR1 cryptofs",			PHASE_IGNORE_FAILURE | PHASE_TAKE_DOWN },
+  { "unmount",		"/bin/umount /media/internal",				PHASE_UNMOUNT | PHASE_TAKE_DOWN },
+  { "check",		"/usr/sbin/fsck.vfat -a /dev/store/media",		PHASE_FSCK },
+  { "shrinkFilesystem",	"/bin/resizefat -v /dev/store/media %FM",		PHASE_RELOCATE },
+  { "reduceVolume",	"/usr/sbin/lvreduce -f -L %TM /dev/store/media",	PHASE_VOLUME },
+  { "fillFilesystem",	"/bin/resizefat -v /dev/store/media %TM",		0 },
+  { "check",		"/usr/sbin/fsck.vfat -a /dev/store/media",		PHASE_FSCK },
+  { "mount",		"/bin/mount /media/internal",				PHASE_MOUNT },
+  { "startCryptofs",	"/usr/bin/pkill -SIGUSR2 cryptofs",			PHASE_IGNORE_FAILURE },
+  { 0, 0, 0 }
+};
+
+static const RESIZE_PHASE media_grow_phases[] = {
+  { "stopCryptofs",	"/usr/bin/pkill -SIGUSR1 cryptofs",			PHASE_IGNORE_FAILURE | PHASE_TAKE_DOWN },
+  { "unmount",		"/bin/umount /media/internal",				PHASE_UNMOUNT | PHASE_TAKE_DOWN },
+  { "check",		"/usr/sbin/fsck.vfat -a /dev/store/media",		PHASE_FSCK },
+  { "extendVolume",	"/usr/sbin/lvresize -f -L %TM /dev/store/media",	PHASE_VOLUME },
+  { "growFilesystem",	"/bin/resizefat -v /dev/store/media %TM",		0 },
+  { "check",		"/usr/sbin/fsck.vfat -a /dev/store/media",		PHASE_FSCK },
+  { "mount",		"/bin/mount /media/internal",				PHASE_MOUNT },
+  { "startCryptofs",	"/usr/bin/pkill -SIGUSR2 cryptofs",			PHASE_IGNORE_FAILURE },
+  { 0, 0, 0 }
+};
+
+static const RESIZE_PHASE ext3fs_shrink_phases[] = {
+  { "unmount",		"/bin/umount /media/ext3fs",				PHASE_UNMOUNT | PHASE_TAKE_DOWN },
+  { "check",		"/sbin/e2fsck -f -y /dev/store/ext3fs",			PHASE_FSCK },
+  { "shrinkFilesystem",	"/sbin/resize2fs -f -p /dev/store/ext3fs %FM",		PHASE_RELOCATE },
+  { "reduceVolume",	"/usr/sbin/lvreduce -f -L %TM /dev/store/ext3fs",	PHASE_VOLUME },
+  { "fillFilesystem",	"/sbin/resize2fs -f -p /dev/store/ext3fs",		0 },
+  { "check",		"/sbin/e2fsck -f -y /dev/store/ext3fs",			PHASE_FSCK },
+  { "mount",		"/bin/mount /media/ext3fs",				PHASE_MOUNT },
+  { 0, 0, 0 }
+};
+
+static const RESIZE_PHASE ext3fs_grow_phases[] = {
+  { "unmount",		"/bin/umount /media/ext3fs",				PHASE_UNMOUNT | PHASE_TAKE_DOWN },
+  { "check",		"/sbin/e2fsck -f -y /dev/store/ext3fs",			PHASE_FSCK },
+  { "extendVolume",	"/usr/sbin/lvresize -f -L %TM /dev/store/ext3fs",	PHASE_VOLUME },
+  { "growFilesystem",	"/sbin/resize2fs -f -p /dev/store/ext3fs",		0 },
+  { "check",		"/sbin/e2fsck -f -y /dev/store/ext3fs",			PHASE_FSCK },
+  { "mount",		"/bin/mount /media/ext3fs",				PHASE_MOUNT },
+  { 0, 0, 0 }
+};
+
+// The original resizeMedia: only the resizefat step, the caller does the rest.
+static const RESIZE_PHASE resizefat_phases[] = {
+  { "resizeFilesystem",	"/bin/resizefat -v /dev/mapper/store-media %TM",	PHASE_RELOCATE },
+  { 0, 0, 0 }
+};
+
+static const RESIZE_SEQUENCE sequences[] = {
+  { "mediaShrink",  "media",  "/media/internal", "/usr/sbin/fsck.vfat -a /dev/store/media", media_shrink_phases },
+  { "mediaGrow",    "media",  "/media/internal", "/usr/sbin/fsck.vfat -a /dev/store/media", media_grow_phases },
+  { "ext3fsShrink", "ext3fs", "/media/ext3fs",   "/sbin/e2fsck -f -y /dev/store/ext3fs",    ext3fs_shrink_phases },
+  { "ext3fsGrow",   "ext3fs", "/media/ext3fs",   "/sbin/e2fsck -f -y /dev/store/ext3fs",    ext3fs_grow_phases },
+  { "resizefat",    "media",  "/media/internal", "/usr/sbin/fsck.vfat -a /dev/store/media", resizefat_phases },
+  { 0, 0, 0, 0, 0 }
+};
+
+typedef struct {
+  LSMessage *message;
+  const RESIZE_SEQUENCE *sequence;
+  unsigned long target_mb;
+  int phase;
+  bool resuming;
+  IO_POLICY policy;
+} RESIZE_JOB;
+
+// Protects everything below.
+static pthread_mutex_t resize_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool resize_running = false;
+static bool resize_cancelled = false;
+static SPAWN_CHILD resize_child;
+
+static const RESIZE_SEQUENCE *find_sequence(const char *name) {
+  int i;
+
+  for (i = 0; sequences[i].name; i++) {
+    if (!strcmp(sequences[i].name, name)) return &sequences[i];
+  }
+
+  return NULL;
+}
+
+static int count_phases(const RESIZE_SEQUENCE *sequence) {
+  int n = 0;
+
+  while (sequence->phases[n].name) n++;
+
+  return n;
+}
+
+//
+// Whether a volume is already the target size, allowing for the target
+// being rounded up to a whole number of extents.
+//
+static bool volume_at_target(const char *volume, unsigned long target_mb) {
+  unsigned long long current_kb = lvm_volume_bytes(LVM_GROUP_NAME, volume) >> 10;
+  unsigned long long target_kb = (unsigned long long)target_mb << 10;
+  LVM_GROUP group;
+
+  if (lvm_group_info(LVM_GROUP_NAME, &group)) {
+    target_kb = (target_kb + group.extent_kb - 1) / group.extent_kb * group.extent_kb;
+  }
+
+  return (current_kb == target_kb);
+}
+
+//
+// Substitute the sizes into a phase command.
+//
+static void expand_command(const char *template, unsigned long target_mb, char *command, size_t size) {
+  unsigned long shrink_mb = (target_mb > RESIZE_MARGIN_MB * 2) ? target_mb - RESIZE_MARGIN_MB : target_mb;
+  size_t len = 0;
+  const char *p;
+
+  for (p = template; *p && (len + MAXNUMLEN < size); p++) {
+    if ((p[0] == '%') && (p[1] == 'T')) {
+      len += sprintf(command + len, "%lu", target_mb);
+      p++;
+    }
+    else if ((p[0] == '%') && (p[1] == 'F')) {
+      len += sprintf(command + len, "%lu", shrink_mb);
+      p++;
+    }
+    else {
+      command[len++] = *p;
+    }
+  }
+  command[len] = '\0';
+}
+
+//
+// Run one command, passing its output back as status messages.
+// While data is being relocated the progress is checkpointed to the journal.
+// Returns the exit code, or -1 if it could not be run or was killed.
+//
+static int run_phase(RESIZE_JOB *job, const char *name, const char *command,
+		     JOURNAL *journal, bool relocating) {
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char line[MAXLINLEN];
+  time_t checkpoint = time(NULL);
+  SPAWN_CHILD child;
+  int code;
+
+  log_printf(LOG_DEBUG, "Resize phase %s: %s\n", name, command);
+
+  pthread_mutex_lock(&resize_lock);
+  if (resize_cancelled || !spawn_command_policy(&resize_child, command, &job->policy)) {
+    pthread_mutex_unlock(&resize_lock);
+    return -1;
+  }
+  child = resize_child;
+  pthread_mutex_unlock(&resize_lock);
+
+  while (fgets(line, sizeof line, child.fp)) {
+    // Chomp the newline
+    char *nl = strchr(line,'\n'); if (nl) *nl = 0;
+
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"status\", \"phase\": \"%s\", \"status\": \"%s\"}",
+	     name, json_escape_buf(line, esc));
+    respond_quietly(job->message, buffer);
+
+    if (relocating) {
+      int percent = spawn_parse_percent(line);
+      if (percent >= 0) {
+	journal_set_number(journal, "position", percent);
+	journal_set(journal, "status", line);
+	if (time(NULL) - checkpoint >= CHECKPOINT_SECS) {
+	  journal_save(RESIZE_JOURNAL, journal);
+	  checkpoint = time(NULL);
+	}
+      }
+    }
+  }
+
+  pthread_mutex_lock(&resize_lock);
+  code = spawn_wait(&resize_child);
+  pthread_mutex_unlock(&resize_lock);
+
+  return code;
+}
+
+static bool phase_succeeded(const RESIZE_PHASE *phase, int code) {
+  if (phase->flags & PHASE_IGNORE_FAILURE) return true;
+  if (code == 0) return true;
+  if ((phase->flags & PHASE_FSCK) && (code == 1)) return true;
+  return false;
+}
+
+//
+// Whether the volume should still be out of use when the given phase runs,
+// which it is until a mount phase has brought it back.
+//
+static bool volume_down_at(const RESIZE_SEQUENCE *sequence, int index) {
+  int i;
+
+  for (i = 0; i < index; i++) {
+    if (sequence->phases[i].flags & PHASE_MOUNT) return false;
+  }
+
+  return true;
+}
+
+static bool take_down_before(const RESIZE_SEQUENCE *sequence, int index) {
+  int i;
+
+  for (i = 0; i < index; i++) {
+    if (sequence->phases[i].flags & PHASE_TAKE_DOWN) return true;
+  }
+
+  return false;
+}
+
+//
+// A resume after a reboot finds the volume mounted again, so repeat the
+// phases which took it down before picking up where the journal left off.
+// Returns the exit code of the phase which failed, or 0.
+//
+static int take_down_again(RESIZE_JOB *job, JOURNAL *journal) {
+  const RESIZE_SEQUENCE *sequence = job->sequence;
+  int count = count_phases(sequence);
+  char buffer[MAXBUFLEN];
+  char command[MAXLINLEN];
+  int i, code;
+
+  if (!volume_down_at(sequence, job->phase) || !fs_mountpoint_mounted(sequence->mountpoint)) return 0;
+
+  for (i = 0; i < job->phase; i++) {
+    const RESIZE_PHASE *phase = &sequence->phases[i];
+
+    if (!(phase->flags & PHASE_TAKE_DOWN)) continue;
+    if ((phase->flags & PHASE_UNMOUNT) && !fs_mountpoint_mounted(sequence->mountpoint)) continue;
+
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"phase\", \"phase\": \"%s\", \"index\": %d, \"count\": %d, \"resumed\": false}",
+	     phase->name, i, count);
+    respond_quietly(job->message, buffer);
+
+    expand_command(phase->command, job->target_mb, command, sizeof command);
+    code = run_phase(job, phase->name, command, journal, false);
+    if (!phase_succeeded(phase, code)) return code ? code : -1;
+  }
+
+  return fs_mountpoint_mounted(sequence->mountpoint) ? -1 : 0;
+}
+
+static void send_estimate(RESIZE_JOB *job) {
+  char buffer[MAXLINLEN];
+  unsigned long long current = lvm_volume_bytes(LVM_GROUP_NAME, job->sequence->volume);
+  unsigned long long target = (unsigned long long)job->target_mb << 20;
+  unsigned long long moved, metadata;
+  long eta;
+
+  if (!current) return;
+
+  // A shrink may relocate everything past the new end; checks and
+  // resizes read and rewrite the allocation metadata.
+  moved = (target < current) ? current - target : 0;
+  metadata = ((target > current) ? target : current) / MEDIA_CLUSTER_SIZE * 4;
+
+  eta = calibration_eta(moved + metadata * count_phases(job->sequence), moved + metadata, 0);
+  if (eta < 0) return;
+
+  snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"estimate\", \"eta\": %ld}", eta);
+  respond_quietly(job->message, buffer);
+}
+
+void *resize_thread(void *ctx) {
+  RESIZE_JOB *job = (RESIZE_JOB *)ctx;
+  const RESIZE_SEQUENCE *sequence = job->sequence;
+  int count = count_phases(sequence);
+  char buffer[MAXBUFLEN];
+  char command[MAXLINLEN];
+  JOURNAL journal;
+  bool cancelled;
+  int i, code = 0;
+
+  journal_init(&journal);
+  if (job->resuming) journal_load(RESIZE_JOURNAL, &journal);
+
+  journal_set(&journal, "sequence", sequence->name);
+  journal_set_number(&journal, "target", job->target_mb);
+  if (!journal_get(&journal, "started")) journal_set_number(&journal, "started", time(NULL));
+
+  send_estimate(job);
+
+  if (job->resuming) {
+    code = take_down_again(job, &journal);
+    if (code) goto stopped;
+  }
+
+  for (i = job->phase; i < count; i++) {
+    const RESIZE_PHASE *phase = &sequence->phases[i];
+    bool resumed_here = job->resuming && (i == job->phase);
+
+    // Checkpoint before starting, so an interruption names this phase.
+    journal_set_number(&journal, "phase", i);
+    journal_set(&journal, "phaseName", phase->name);
+    journal_set(&journal, "state", "running");
+    if (!resumed_here) {
+      journal_set_number(&journal, "position", 0);
+      journal_set(&journal, "status", "");
+    }
+    if (!journal_save(RESIZE_JOURNAL, &journal)) {
+      respond_quietly(job->message,
+		      "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to write resize journal\", \"stage\": \"failed\"}");
+      goto end;
+    }
+
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"phase\", \"phase\": \"%s\", \"index\": %d, \"count\": %d, \"resumed\": %s}",
+	     phase->name, i, count, resumed_here ? "true" : "false");
+    respond_quietly(job->message, buffer);
+
+    // Work out whether an earlier run already got past this phase.
+    if ((phase->flags & PHASE_UNMOUNT) && !fs_mountpoint_mounted(sequence->mountpoint)) continue;
+    if ((phase->flags & PHASE_MOUNT) && fs_mountpoint_mounted(sequence->mountpoint)) continue;
+    if ((phase->flags & PHASE_VOLUME) && volume_at_target(sequence->volume, job->target_mb)) continue;
+
+    // An interrupted relocation may have left the filesystem inconsistent,
+    // so repair it before picking up where we left off.
+    if (resumed_here && (phase->flags & PHASE_RELOCATE)) {
+      code = run_phase(job, "resumeCheck", sequence->check, &journal, false);
+      if ((code != 0) && (code != 1)) goto stopped;
+    }
+
+    expand_command(phase->command, job->target_mb, command, sizeof command);
+
+    code = run_phase(job, phase->name, command, &journal, (phase->flags & PHASE_RELOCATE) != 0);
+    if (!phase_succeeded(phase, code)) goto stopped;
+  }
+
+  journal_remove(RESIZE_JOURNAL);
+
+  respond_quietly(job->message, "{\"returnValue\": true, \"stage\": \"completed\"}");
+  goto end;
+
+ stopped:
+  pthread_mutex_lock(&resize_lock);
+  cancelled = resize_cancelled;
+  pthread_mutex_unlock(&resize_lock);
+
+  // Keep the journal either way, so the resize can be resumed.
+  journal_set(&journal, "state", cancelled ? "cancelled" : "failed");
+  journal_set_number(&journal, "exitCode", (unsigned long long)(long long)code);
+  journal_save(RESIZE_JOURNAL, &journal);
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": %d, \"stage\": \"%s\", \"phase\": \"%s\"}",
+	   code, cancelled ? "cancelled" : "failed", journal_get(&journal, "phaseName"));
+  respond_quietly(job->message, buffer);
+
+ end:
+  LSMessageUnref(job->message);
+  free(job);
+
+  pthread_mutex_lock(&resize_lock);
+  resize_running = false;
+  resize_cancelled = false;
+  pthread_mutex_unlock(&resize_lock);
+
+  lvm_release();
+
+  return NULL;
+}
+
+//
+// Start a resize thread, unless one is already running.
+// Responds to the message either way.
+//
+static bool start_resize(LSMessage *message, const RESIZE_SEQUENCE *sequence,
+			 unsigned long target_mb, int phase, bool resuming, const IO_POLICY *policy) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  pthread_t thread;
+  RESIZE_JOB *job;
+
+  pthread_mutex_lock(&resize_lock);
+  if (resize_running) {
+    pthread_mutex_unlock(&resize_lock);
+    log_printf(LOG_NOTICE, "Resize thread already running\n");
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  if (!lvm_claim("resize")) {
+    pthread_mutex_unlock(&resize_lock);
+    log_printf(LOG_NOTICE, "Volume group busy with %s\n", lvm_claimed_by());
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Volume group is busy\", \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  resize_running = true;
+  resize_cancelled = false;
+  pthread_mutex_unlock(&resize_lock);
+
+  job = calloc(1, sizeof(RESIZE_JOB));
+  if (!job) goto failed;
+
+  job->message = message;
+  job->sequence = sequence;
+  job->target_mb = target_mb;
+  job->phase = phase;
+  job->resuming = resuming;
+  job->policy = *policy;
+
+  log_printf(LOG_DEBUG, "Create resize thread (%s to %luM from phase %d), ref message %p\n",
+	 sequence->name, target_mb, phase, message);
+
+  // Ref and save the message for use in resize thread
+  LSMessageRef(message);
+
+  if (pthread_create(&thread, NULL, resize_thread, (void*)job)) {
+    LSMessageUnref(message);
+    free(job);
+    goto failed;
+  }
+
+  pthread_detach(thread);
+
+  // Report that the resize operation has begun
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ failed:
+  log_printf(LOG_ERR, "Creating resize thread failed\n");
+  pthread_mutex_lock(&resize_lock);
+  resize_running = false;
+  pthread_mutex_unlock(&resize_lock);
+  lvm_release();
+  if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to start resize thread\"}", &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+//
+// Refuse to start a new resize over the top of an interrupted one.
+//
+static bool refuse_if_pending(LSMessage *message, bool *refused) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  *refused = (access(RESIZE_JOURNAL, F_OK) == 0);
+  if (!*refused) return true;
+
+  if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"An interrupted resize must be resumed or discarded first\", \"stage\": \"failed\"}",
+			&lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+//
+// Read the I/O policy arguments, answering the message if they are bad.
+//
+static bool policy_argument(LSMessage *message, json_t *object, IO_POLICY *policy, bool *refused) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem = io_policy_parse(object, policy);
+
+  *refused = (problem != NULL);
+  if (!*refused) return true;
+
+  snprintf(buffer, sizeof buffer, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\"}", problem);
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+//
+// Parse and check a size argument, returning it in MiB (zero if invalid).
+//
+static unsigned long size_argument(json_t *object) {
+  json_t *size = json_find_first_label(object, "size");
+
+  if (!size || (size->child->type != JSON_STRING && size->child->type != JSON_NUMBER) ||
+      (strspn(size->child->text, ALLOWED_CHARS) != strlen(size->child->text))) {
+    return 0;
+  }
+
+  return (unsigned long)(lvm_parse_size(size->child->text) >> 20);
+}
+
+//
+// Called at startup: a journal still marked as running means the service
+// (or the device) died part way through a resize.
+//
+void resize_journal_detect(void) {
+  JOURNAL journal;
+  const char *state;
+
+  if (!journal_load(RESIZE_JOURNAL, &journal)) return;
+
+  state = journal_get(&journal, "state");
+  if (state && !strcmp(state, "running")) {
+    journal_set(&journal, "state", "interrupted");
+    journal_save(RESIZE_JOURNAL, &journal);
+  }
+
+  log_printf(LOG_NOTICE, "Found %s resize journal (%s, phase %s), waiting to resume\n",
+	 journal_get(&journal, "state"), journal_get(&journal, "sequence"),
+	 journal_get(&journal, "phaseName"));
+}
+
+//
+// Run resizefat and provide the output back to Mojo
+//
+bool resize_media_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  unsigned long target_mb;
+  IO_POLICY policy;
+  bool refused;
+
+  if (!refuse_if_pending(message, &refused)) return false;
+  if (refused) return true;
+
+  // Extract the size and policy arguments from the message
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  target_mb = size_argument(object);
+  if (!policy_argument(message, object, &policy, &refused)) {
+    json_free_value(&object);
+    return false;
+  }
+  json_free_value(&object);
+  if (refused) return true;
+
+  if (!target_mb) {
+    if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing size\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  return start_resize(message, find_sequence("resizefat"), target_mb, 0, false, &policy);
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Resize the media or ext3fs volume, running every phase (unmount, check,
+// filesystem and volume resize, remount) with a journal of progress.
+//
+bool resize_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char name[MAXNAMLEN];
+  unsigned long long current;
+  unsigned long target_mb;
+  IO_POLICY policy;
+  bool refused;
+
+  if (!refuse_if_pending(message, &refused)) return false;
+  if (refused) return true;
+
+  // Extract the arguments from the message
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *volume = json_find_first_label(object, "volume");
+  target_mb = size_argument(object);
+  if (!policy_argument(message, object, &policy, &refused)) {
+    json_free_value(&object);
+    return false;
+  }
+  if (refused) {
+    json_free_value(&object);
+    return true;
+  }
+
+  if (!volume || (volume->child->type != JSON_STRING) ||
+      (strcmp(volume->child->text, "media") && strcmp(volume->child->text, "ext3fs")) || !target_mb) {
+    json_free_value(&object);
+    if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing volume or size\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  current = lvm_volume_bytes(LVM_GROUP_NAME, volume->child->text);
+  snprintf(name, sizeof name, "%s%s", volume->child->text,
+	   ((current >> 20) > target_mb) ? "Shrink" : "Grow");
+  json_free_value(&object);
+
+  if (!current) {
+    if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Volume does not exist\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  return start_resize(message, find_sequence(name), target_mb, 0, false, &policy);
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Pick up an interrupted resize from its last checkpoint.
+//
+bool resume_resize_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  const RESIZE_SEQUENCE *sequence = NULL;
+  IO_POLICY policy;
+  JOURNAL journal;
+  const char *name = NULL;
+  bool refused;
+
+  // The policy is not journaled; a resume runs under its own.
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  if (!policy_argument(message, object, &policy, &refused)) {
+    json_free_value(&object);
+    return false;
+  }
+  json_free_value(&object);
+  if (refused) return true;
+
+  if (journal_load(RESIZE_JOURNAL, &journal) && (name = journal_get(&journal, "sequence"))) {
+    sequence = find_sequence(name);
+  }
+
+  if (name && !strcmp(name, LAYOUT_SEQUENCE)) {
+    if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"An interrupted layout is resumed with applyLayout\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  if (!sequence || !journal_get_number(&journal, "target") ||
+      (journal_get_number(&journal, "phase") >= (unsigned long long)count_phases(sequence))) {
+    if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"No resize to resume\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  // Without phases of its own to take the volume down, the caller must.
+  if (volume_down_at(sequence, (int)journal_get_number(&journal, "phase")) &&
+      !take_down_before(sequence, (int)journal_get_number(&journal, "phase")) &&
+      fs_mountpoint_mounted(sequence->mountpoint)) {
+    if (!LSMessageRespond(message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Volume is mounted\", \"stage\": \"failed\"}",
+			&lserror)) goto error;
+    return true;
+  }
+
+  return start_resize(message, sequence, (unsigned long)journal_get_number(&journal, "target"),
+		      (int)journal_get_number(&journal, "phase"), true, &policy);
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Report the state of an interrupted (or running) resize.
+//
+bool get_resize_journal_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  JOURNAL journal;
+  bool running;
+
+  pthread_mutex_lock(&resize_lock);
+  running = resize_running;
+  pthread_mutex_unlock(&resize_lock);
+
+  if (!journal_load(RESIZE_JOURNAL, &journal)) {
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"pending\": false, \"running\": %s}",
+	     running ? "true" : "false");
+  }
+  else {
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"pending\": true, \"running\": %s, \"sequence\": \"%s\", "
+	     "\"target\": %llu, \"phase\": %llu, \"phaseName\": \"%s\", \"state\": \"%s\", "
+	     "\"position\": %llu, \"started\": %llu, \"status\": \"%s\"}",
+	     running ? "true" : "false",
+	     journal_get(&journal, "sequence") ? journal_get(&journal, "sequence") : "",
+	     journal_get_number(&journal, "target"), journal_get_number(&journal, "phase"),
+	     journal_get(&journal, "phaseName") ? journal_get(&journal, "phaseName") : "",
+	     journal_get(&journal, "state") ? journal_get(&journal, "state") : "",
+	     journal_get_number(&journal, "position"), journal_get_number(&journal, "started"),
+	     json_escape_buf(journal_get(&journal, "status") ? journal_get(&journal, "status") : "", esc));
+  }
+
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Forget an interrupted resize, once the volumes have been dealt with by hand.
+//
+bool discard_resize_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  bool running;
+
+  pthread_mutex_lock(&resize_lock);
+  running = resize_running;
+  pthread_mutex_unlock(&resize_lock);
+
+  if (running || journal_remove(RESIZE_JOURNAL)) {
+    if (!LSMessageRespond(message, running ? "{\"returnValue\": false, \"stage\": \"failed\"}" : "{\"returnValue\": true}",
+			  &lserror)) goto error;
+    return true;
+  }
+
+  if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"No resize journal\"}", &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
+
+//
+// Kill the currently running resize.  The child is signalled and the
+// thread records the interrupted phase, so the resize can be resumed.
+//
+bool kill_resize_media_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+
+  pthread_mutex_lock(&resize_lock);
+  if (!resize_running) {
+    pthread_mutex_unlock(&resize_lock);
+    log_printf(LOG_NOTICE, "Resize thread not running\n");
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+
+  log_printf(LOG_DEBUG, "Killing resize child %d\n", (int)resize_child.pid);
+
+  resize_cancelled = true;
+  spawn_kill(&resize_child, SIGTERM);
+  pthread_mutex_unlock(&resize_lock);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"completed\"}", &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
@@ -0,0 +1,47 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef RESIZE_H_
+#define RESIZE_H_
+
+#include <lunaservice.h>
+
+#include "luna_methods.h"
+
+// Record of the phases completed by the resize in progress.
+#define RESIZE_JOURNAL STATE_DIR "/resize.journal"
+
+// The sequence applyLayout records in the same journal.
+#define LAYOUT_SEQUENCE "layout"
+
+// Filesystems are shrunk this far below the target, then grown to fill the volume.
+#define RESIZE_MARGIN_MB 100
+
+// Minimum interval between journal updates while data is being relocated.
+#define CHECKPOINT_SECS 5
+
+void resize_journal_detect(void);
+
+bool resize_media_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool kill_resize_media_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool resize_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool resume_resize_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool get_resize_journal_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool discard_resize_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* RESIZE_H_ */
@@ -0,0 +1,635 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "thread_pool.h"
+#include "scan_usage.h"
+
+// Size of each worker's getdents64 buffer.
+#define DENTS_BUFLEN 32768
+
+// Number of tree nodes carved out of each allocation.
+#define NODES_PER_BLOCK 512
+
+// Size of each block of name storage.
+#define NAMES_BLOCKLEN 65536
+
+// Interval between streamed progress reports.
+#define REPORT_MSECS 1000
+
+// Directory entry types, as returned by the kernel.
+#define DENT_UNKNOWN 0
+#define DENT_DIR     4
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+typedef struct usage_node {
+  struct usage_node *parent;
+  const char *name;
+  int depth;
+  // Written only by the worker which scans this directory.
+  unsigned long long own_bytes;
+  unsigned long own_files;
+  // Rolled up from completed descendants, under the tree lock.
+  unsigned long long total_bytes;
+  unsigned long total_files;
+} USAGE_NODE;
+
+typedef struct node_block {
+  struct node_block *next;
+  int used;
+  USAGE_NODE nodes[NODES_PER_BLOCK];
+} NODE_BLOCK;
+
+typedef struct name_block {
+  struct name_block *next;
+  size_t used;
+  char data[NAMES_BLOCKLEN];
+} NAME_BLOCK;
+
+// Per-worker state, so that workers never contend on allocation.
+typedef struct {
+  NODE_BLOCK *nodes;
+  NAME_BLOCK *names;
+  char path[PATH_MAX];
+  char dents[DENTS_BUFLEN];
+} USAGE_WORKER;
+
+typedef struct {
+  char root_path[MAXLINLEN];
+  int root_fd;
+  dev_t root_dev;
+  unsigned int mounts_hash;
+  int report_depth;
+  thread_pool_t *pool;
+
+  USAGE_NODE root;
+  USAGE_WORKER workers[POOL_MAX_THREADS];
+
+  // Protects the totals, the counters and the report list.
+  pthread_mutex_t lock;
+  unsigned long dirs_scanned;
+  unsigned long errors;
+  USAGE_NODE **report;
+  int report_count;
+  int report_size;
+} USAGE_TREE;
+
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool scan_running = false;
+
+// The most recent completed scan, kept until the mount table changes.
+static USAGE_TREE *cached_tree = NULL;
+
+//
+// Hash the mount table, so that a cached tree can be discarded as soon as
+// anything is mounted or unmounted.
+//
+static unsigned int mounts_hash(void) {
+  unsigned int hash = 2166136261U;
+  char line[MAXLINLEN];
+  FILE *fp = fopen("/proc/mounts", "r");
+  unsigned char *p;
+
+  if (!fp) return 0;
+
+  while (fgets(line, sizeof line, fp)) {
+    for (p = (unsigned char *)line; *p; p++) {
+      hash = (hash ^ *p) * 16777619U;
+    }
+  }
+
+  fclose(fp);
+  return hash;
+}
+
+static USAGE_NODE *new_node(USAGE_WORKER *worker, USAGE_NODE *parent, const char *name) {
+  NODE_BLOCK *nblock = worker->nodes;
+  NAME_BLOCK *sblock = worker->names;
+  size_t len = strlen(name) + 1;
+  USAGE_NODE *node;
+  char *copy;
+
+  if (!nblock || nblock->used == NODES_PER_BLOCK) {
+    nblock = malloc(sizeof(NODE_BLOCK));
+    if (!nblock) return NULL;
+    nblock->next = worker->nodes;
+    nblock->used = 0;
+    worker->nodes = nblock;
+  }
+
+  if (!sblock || sblock->used + len > NAMES_BLOCKLEN) {
+    sblock = malloc(sizeof(NAME_BLOCK));
+    if (!sblock) return NULL;
+    sblock->next = worker->names;
+    sblock->used = 0;
+    worker->names = sblock;
+  }
+
+  copy = sblock->data + sblock->used;
+  memcpy(copy, name, len);
+  sblock->used += len;
+
+  node = &nblock->nodes[nblock->used++];
+  memset(node, 0, sizeof(USAGE_NODE));
+  node->parent = parent;
+  node->name = copy;
+  node->depth = parent->depth + 1;
+
+  return node;
+}
+
+static void free_tree(USAGE_TREE *tree) {
+  int i;
+
+  if (!tree) return;
+
+  for (i = 0; i < POOL_MAX_THREADS; i++) {
+    while (tree->workers[i].nodes) {
+      NODE_BLOCK *next = tree->workers[i].nodes->next;
+      free(tree->workers[i].nodes);
+      tree->workers[i].nodes = next;
+    }
+    while (tree->workers[i].names) {
+      NAME_BLOCK *next = tree->workers[i].names->next;
+      free(tree->workers[i].names);
+      tree->workers[i].names = next;
+    }
+  }
+
+  if (tree->root_fd >= 0) close(tree->root_fd);
+  pthread_mutex_destroy(&tree->lock);
+  free(tree->report);
+  free(tree);
+}
+
+//
+// Build the path of a node relative to the scan root.
+// Returns false if it does not fit.
+//
+static bool node_path(USAGE_NODE *node, char *path, size_t size) {
+  USAGE_NODE *n;
+  size_t len = 0, nlen;
+  char *end;
+
+  if (!node->parent) {
+    if (size < 2) return false;
+    strcpy(path, ".");
+    return true;
+  }
+
+  // Names plus separators, where the last separator becomes the terminator.
+  for (n = node; n->parent; n = n->parent) {
+    len += strlen(n->name) + 1;
+  }
+  if (len > size) return false;
+
+  end = path + len - 1;
+  *end = '\0';
+  for (n = node; n->parent; n = n->parent) {
+    nlen = strlen(n->name);
+    end -= nlen;
+    memcpy(end, n->name, nlen);
+    if (n->parent->parent) *--end = '/';
+  }
+
+  return true;
+}
+
+static void report_add(USAGE_TREE *tree, USAGE_NODE *node) {
+  if (tree->report_count == tree->report_size) {
+    int size = tree->report_size ? tree->report_size * 2 : 64;
+    USAGE_NODE **report = realloc(tree->report, size * sizeof(USAGE_NODE *));
+    if (!report) return;
+    tree->report = report;
+    tree->report_size = size;
+  }
+  tree->report[tree->report_count++] = node;
+}
+
+static void scan_dir_task(void *arg, int index);
+
+typedef struct {
+  USAGE_TREE *tree;
+  USAGE_NODE *node;
+} SCAN_TASK;
+
+//
+// Scan a single directory: total up its files, and hand each subdirectory
+// back to the pool as a new task.
+//
+static void scan_dir(USAGE_TREE *tree, USAGE_NODE *node, int index) {
+  USAGE_WORKER *worker = &tree->workers[index];
+  unsigned long errors = 0;
+  struct stat st;
+  USAGE_NODE *n;
+  int fd, nread, pos;
+
+  if (!node_path(node, worker->path, sizeof worker->path)) {
+    errors++;
+    goto rollup;
+  }
+
+  fd = openat(tree->root_fd, worker->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd < 0) {
+    errors++;
+    goto rollup;
+  }
+
+  while ((nread = syscall(SYS_getdents64, fd, worker->dents, DENTS_BUFLEN)) > 0) {
+    for (pos = 0; pos < nread; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(worker->dents + pos);
+      bool is_dir;
+
+      pos += d->d_reclen;
+
+      if (d->d_name[0] == '.' &&
+	  (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+	continue;
+      }
+
+      if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+	errors++;
+	continue;
+      }
+
+      is_dir = (d->d_type == DENT_DIR) || (d->d_type == DENT_UNKNOWN && S_ISDIR(st.st_mode));
+
+      if (!is_dir) {
+	node->own_bytes += (unsigned long long)st.st_blocks * 512;
+	node->own_files++;
+	continue;
+      }
+
+      // Stay on this filesystem, like du -x.
+      if (st.st_dev != tree->root_dev) continue;
+
+      SCAN_TASK *task = malloc(sizeof(SCAN_TASK));
+      USAGE_NODE *child = task ? new_node(worker, node, d->d_name) : NULL;
+      if (!child) {
+	free(task);
+	errors++;
+	continue;
+      }
+
+      // The directory's own blocks count towards it, as with du.
+      child->own_bytes = (unsigned long long)st.st_blocks * 512;
+
+      if (child->depth <= tree->report_depth) {
+	pthread_mutex_lock(&tree->lock);
+	report_add(tree, child);
+	pthread_mutex_unlock(&tree->lock);
+      }
+
+      task->tree = tree;
+      task->node = child;
+      if (!pool_submit(tree->pool, index, scan_dir_task, task)) {
+	free(task);
+	errors++;
+      }
+    }
+  }
+
+  if (nread < 0) errors++;
+
+  close(fd);
+
+ rollup:
+  pthread_mutex_lock(&tree->lock);
+  for (n = node; n; n = n->parent) {
+    n->total_bytes += node->own_bytes;
+    n->total_files += node->own_files;
+  }
+  tree->dirs_scanned++;
+  tree->errors += errors;
+  pthread_mutex_unlock(&tree->lock);
+}
+
+static void scan_dir_task(void *arg, int index) {
+  SCAN_TASK *task = (SCAN_TASK *)arg;
+
+  scan_dir(task->tree, task->node, index);
+  free(task);
+}
+
+//
+// Pick the largest directories no deeper than depth, biggest first.
+// Must be called with the tree lock held (or once the scan is complete).
+//
+static int select_top(USAGE_TREE *tree, int depth, int count, USAGE_NODE **top) {
+  int i, j, n = 0;
+
+  for (i = 0; i < tree->report_count; i++) {
+    USAGE_NODE *node = tree->report[i];
+
+    if (node->depth > depth) continue;
+    if ((n == count) && (node->total_bytes <= top[n-1]->total_bytes)) continue;
+
+    j = (n < count) ? n++ : n - 1;
+    while ((j > 0) && (top[j-1]->total_bytes < node->total_bytes)) {
+      top[j] = top[j-1];
+      j--;
+    }
+    top[j] = node;
+  }
+
+  return n;
+}
+
+//
+// Format the current state of a tree as a JSON response.
+// Must be called with the tree lock held (or once the scan is complete).
+//
+static void format_usage(USAGE_TREE *tree, const char *stage, int depth, int count,
+			 bool cached, long elapsed, char *buffer, size_t size) {
+  USAGE_NODE *top[SCAN_MAX_COUNT];
+  char path[PATH_MAX];
+  char full[PATH_MAX + MAXLINLEN];
+  char esc[MAXBUFLEN];
+  char entry[MAXBUFLEN + MAXNAMLEN];
+  size_t len;
+  int i, n;
+
+  len = snprintf(buffer, size,
+		 "{\"returnValue\": true, \"stage\": \"%s\", \"path\": \"%s\", "
+		 "\"directories\": %lu, \"files\": %lu, \"bytes\": %llu, \"errors\": %lu, \"top\": [",
+		 stage, json_escape_buf(tree->root_path, esc),
+		 tree->dirs_scanned, tree->root.total_files, tree->root.total_bytes, tree->errors);
+
+  n = select_top(tree, depth, count, top);
+
+  for (i = 0; i < n; i++) {
+    if (!node_path(top[i], path, sizeof path)) continue;
+    snprintf(full, sizeof full, "%s/%s", tree->root_path, path);
+
+    // Each byte may escape to six; a path too long to escape is left out.
+    if (strlen(full) > (sizeof esc - 1) / 6) continue;
+
+    snprintf(entry, sizeof entry, "%s{\"path\": \"%s\", \"bytes\": %llu, \"files\": %lu}",
+	     i ? ", " : "", json_escape_buf(full, esc), top[i]->total_bytes, top[i]->total_files);
+
+    // Leave room for the trailer; a long list is simply cut short.
+    if (len + strlen(entry) + 64 >= size) break;
+    strcpy(buffer + len, entry);
+    len += strlen(entry);
+  }
+
+  snprintf(buffer + len, size - len, "], \"cached\": %s, \"elapsed\": %ld}",
+	   cached ? "true" : "false", elapsed);
+}
+
+typedef struct {
+  LSMessage *message;
+  char path[MAXLINLEN];
+  int count;
+  int depth;
+  bool refresh;
+} SCAN_REQUEST;
+
+static long msecs_since(struct timeval *start) {
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
+void *scan_usage_thread(void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  SCAN_REQUEST *request = (SCAN_REQUEST *)ctx;
+  char buffer[MAXBUFLEN];
+  USAGE_TREE *tree = NULL;
+  SCAN_TASK *task;
+  struct timeval start;
+  struct stat st;
+  unsigned int hash = mounts_hash();
+
+  gettimeofday(&start, NULL);
+
+  // Answer straight from the cache if nothing has been mounted or unmounted.
+  if (cached_tree && !request->refresh && (cached_tree->mounts_hash == hash) &&
+      !strcmp(cached_tree->root_path, request->path) && (request->depth <= cached_tree->report_depth)) {
+    format_usage(cached_tree, "completed", request->depth, request->count, true, 0, buffer, sizeof buffer);
+    if (!LSMessageRespond(request->message, buffer, &lserror)) goto error;
+    goto end;
+  }
+
+  free_tree(cached_tree);
+  cached_tree = NULL;
+
+  tree = calloc(1, sizeof(USAGE_TREE));
+  if (!tree) goto failed;
+
+  tree->root_fd = -1;
+  pthread_mutex_init(&tree->lock, NULL);
+  strcpy(tree->root_path, request->path);
+  tree->mounts_hash = hash;
+  tree->report_depth = (request->depth > SCAN_DEFAULT_DEPTH) ? request->depth : SCAN_DEFAULT_DEPTH;
+
+  tree->root_fd = open(tree->root_path, O_RDONLY | O_DIRECTORY);
+  if ((tree->root_fd < 0) || fstat(tree->root_fd, &st)) goto failed;
+  tree->root_dev = st.st_dev;
+  tree->root.own_bytes = (unsigned long long)st.st_blocks * 512;
+  tree->root.name = "";
+
+  tree->pool = pool_create(pool_default_threads());
+  if (!tree->pool) goto failed;
+
+  task = malloc(sizeof(SCAN_TASK));
+  if (!task) goto failed;
+  task->tree = tree;
+  task->node = &tree->root;
+  if (!pool_submit(tree->pool, POOL_EXTERNAL, scan_dir_task, task)) {
+    free(task);
+    goto failed;
+  }
+
+  // Stream the largest directories found so far while the workers run.
+  while (!pool_wait_timeout(tree->pool, REPORT_MSECS)) {
+    pthread_mutex_lock(&tree->lock);
+    format_usage(tree, "status", request->depth, request->count, false, msecs_since(&start),
+		 buffer, sizeof buffer);
+    pthread_mutex_unlock(&tree->lock);
+
+    // Keep going even if the subscriber has gone, so the cache is filled.
+    if (!LSMessageRespond(request->message, buffer, &lserror)) {
+      LSErrorPrint(&lserror, stderr);
+      LSErrorFree(&lserror);
+      LSErrorInit(&lserror);
+    }
+  }
+
+  pool_destroy(tree->pool);
+  tree->pool = NULL;
+
+  log_printf(LOG_DEBUG, "Scanned %lu directories under %s in %ld ms\n",
+	 tree->dirs_scanned, tree->root_path, msecs_since(&start));
+
+  format_usage(tree, "completed", request->depth, request->count, false, msecs_since(&start),
+	       buffer, sizeof buffer);
+
+  cached_tree = tree;
+
+  if (!LSMessageRespond(request->message, buffer, &lserror)) goto error;
+
+  goto end;
+
+ failed:
+  if (tree) {
+    if (tree->pool) pool_destroy(tree->pool);
+    free_tree(tree);
+  }
+  if (!LSMessageRespond(request->message,
+			"{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to scan path\", \"stage\": \"failed\"}",
+			&lserror)) goto error;
+  goto end;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  LSMessageUnref(request->message);
+  free(request);
+
+  pthread_mutex_lock(&scan_lock);
+  scan_running = false;
+  pthread_mutex_unlock(&scan_lock);
+
+  return NULL;
+}
+
+//
+// Walk a mount point in parallel, reporting the directories using the most space.
+//
+bool scan_usage_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  SCAN_REQUEST *request;
+  pthread_t thread;
+
+  pthread_mutex_lock(&scan_lock);
+  if (scan_running) {
+    pthread_mutex_unlock(&scan_lock);
+    log_printf(LOG_NOTICE, "Scan thread already running\n");
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  scan_running = true;
+  pthread_mutex_unlock(&scan_lock);
+
+  request = calloc(1, sizeof(SCAN_REQUEST));
+  if (!request) {
+    pthread_mutex_lock(&scan_lock);
+    scan_running = false;
+    pthread_mutex_unlock(&scan_lock);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Out of memory\"}", &lserror)) goto error;
+    return true;
+  }
+
+  strcpy(request->path, "/media/internal");
+  request->count = SCAN_DEFAULT_COUNT;
+  request->depth = SCAN_DEFAULT_DEPTH;
+
+  // Extract the optional arguments from the message
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *path = json_find_first_label(object, "path");
+  json_t *count = json_find_first_label(object, "count");
+  json_t *depth = json_find_first_label(object, "depth");
+  json_t *refresh = json_find_first_label(object, "refresh");
+
+  if (path) {
+    if ((path->child->type != JSON_STRING) || (path->child->text[0] != '/') ||
+	(strlen(path->child->text) >= MAXLINLEN) || strstr(path->child->text, "..") ||
+	(strspn(path->child->text, ALLOWED_CHARS "/") != strlen(path->child->text))) {
+      json_free_value(&object);
+      free(request);
+      pthread_mutex_lock(&scan_lock);
+      scan_running = false;
+      pthread_mutex_unlock(&scan_lock);
+      if (!LSMessageRespond(message,
+			    "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid path\"}",
+			    &lserror)) goto error;
+      return true;
+    }
+    strcpy(request->path, path->child->text);
+  }
+
+  if (count && (count->child->type == JSON_NUMBER)) {
+    request->count = atoi(count->child->text);
+    if (request->count < 1) request->count = 1;
+    if (request->count > SCAN_MAX_COUNT) request->count = SCAN_MAX_COUNT;
+  }
+
+  if (depth && (depth->child->type == JSON_NUMBER)) {
+    request->depth = atoi(depth->child->text);
+    if (request->depth < 1) request->depth = 1;
+    if (request->depth > SCAN_MAX_DEPTH) request->depth = SCAN_MAX_DEPTH;
+  }
+
+  request->refresh = (refresh && (refresh->child->type == JSON_TRUE));
+
+  json_free_value(&object);
+
+  // Ref and save the message for use in scan thread
+  LSMessageRef(message);
+  request->message = message;
+
+  if (pthread_create(&thread, NULL, scan_usage_thread, (void*)request)) {
+    log_printf(LOG_ERR, "Creating scan thread failed\n");
+    pthread_mutex_lock(&scan_lock);
+    scan_running = false;
+    pthread_mutex_unlock(&scan_lock);
+    LSMessageUnref(message);
+    free(request);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to start scan thread\"}", &lserror)) goto error;
+  }
+  else {
+    pthread_detach(thread);
+    if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+  }
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  return false;
+}
@@ -0,0 +1,34 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef SCAN_USAGE_H_
+#define SCAN_USAGE_H_
+
+#include <lunaservice.h>
+
+bool scan_usage_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+// Default and maximum number of directories reported.
+#define SCAN_DEFAULT_COUNT 10
+#define SCAN_MAX_COUNT     25
+
+// Default and maximum depth (below the mount point) of reported directories.
+#define SCAN_DEFAULT_DEPTH 2
+#define SCAN_MAX_DEPTH     4
+
+#endif /* SCAN_USAGE_H_ */
@@ -0,0 +1,125 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+
+bool spawn_command(SPAWN_CHILD *child, const char *command) {
+  return spawn_command_policy(child, command, NULL);
+}
+
+bool spawn_command_policy(SPAWN_CHILD *child, const char *command, const IO_POLICY *policy) {
+  int fds[2];
+  pid_t pid;
+
+  child->pid = 0;
+  child->fp = NULL;
+
+  if (pipe(fds)) return false;
+
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+
+  if (pid == 0) {
+    setpgid(0, 0);
+    io_policy_apply(0, policy);
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    if (fds[1] > STDERR_FILENO) close(fds[1]);
+    execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+    _exit(127);
+  }
+
+  // Set it from this side too, so a kill cannot race the child's setpgid.
+  setpgid(pid, pid);
+
+  close(fds[1]);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+  child->fp = fdopen(fds[0], "r");
+  if (!child->fp) {
+    close(fds[0]);
+    kill(-pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return false;
+  }
+
+  child->pid = pid;
+  return true;
+}
+
+//
+// Close the pipe and reap the child.
+// Returns the exit code, or -1 if the child was killed or could not be reaped.
+//
+int spawn_wait(SPAWN_CHILD *child) {
+  int status;
+
+  if (child->fp) {
+    fclose(child->fp);
+    child->fp = NULL;
+  }
+
+  if (child->pid <= 0) return -1;
+
+  while (waitpid(child->pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      child->pid = 0;
+      return -1;
+    }
+  }
+
+  child->pid = 0;
+
+  if (WIFEXITED(status)) return WEXITSTATUS(status);
+
+  return -1;
+}
+
+void spawn_kill(SPAWN_CHILD *child, int sig) {
+  if (child->pid > 0) kill(-child->pid, sig);
+}
+
+//
+// Pull a percentage out of a progress line, or -1 if there is none.
+//
+int spawn_parse_percent(const char *line) {
+  const char *pct = strrchr(line, '%');
+  const char *p;
+
+  if (!pct || (pct == line)) return -1;
+
+  for (p = pct; (p > line) && ((p[-1] >= '0' && p[-1] <= '9') || p[-1] == '.'); p--);
+  if (p == pct) return -1;
+
+  return atoi(p);
+}
@@ -0,0 +1,47 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef SPAWN_H_
+#define SPAWN_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "io_policy.h"
+
+//
+// Run a shell command with its output (stdout and stderr) on a pipe,
+// like popen, but keeping the child's pid so that it can be signalled.
+// The child leads its own process group, so signals reach the tool as
+// well as the shell running it.  Given a policy, the child (and so the
+// tool) runs in its I/O class.
+//
+typedef struct {
+  pid_t pid;
+  FILE *fp;
+} SPAWN_CHILD;
+
+bool spawn_command(SPAWN_CHILD *child, const char *command);
+bool spawn_command_policy(SPAWN_CHILD *child, const char *command, const IO_POLICY *policy);
+int spawn_wait(SPAWN_CHILD *child);
+void spawn_kill(SPAWN_CHILD *child, int sig);
+
+int spawn_parse_percent(const char *line);
+
+#endif /* SPAWN_H_ */
@@ -0,0 +1,600 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/swap.h>
+#include <linux/fs.h>
+
+#include "luna_service.h"
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "swap.h"
+
+// Most entries /proc/swaps will ever show us.
+#define MAX_SWAPS 8
+
+// Version 1 swap header, as written by mkswap.
+#define SWAP_SIGNATURE "SWAPSPACE2"
+#define SWAP_SIGNATURE_LEN 10
+#define SWAP_BOOTBITS 1024
+
+typedef struct {
+  uint32_t version;
+  uint32_t last_page;
+  uint32_t nr_badpages;
+  unsigned char uuid[16];
+  char volume_name[16];
+} SWAP_HEADER_INFO;
+
+typedef struct {
+  char device[MAXLINLEN];
+  char type[MAXNAMLEN];
+  unsigned long size_kb;
+  unsigned long used_kb;
+  int priority;
+} SWAP_ENTRY;
+
+typedef enum {
+  SWAP_RESIZE,
+  SWAP_PRIORITY,
+  SWAP_ZRAM
+} SWAP_OP;
+
+typedef struct {
+  LSMessage *message;
+  SWAP_OP op;
+  unsigned long size_mb;
+  int priority;
+  bool has_priority;
+  bool zram;
+  bool enable;
+  char algorithm[MAXNAMLEN];
+} SWAP_JOB;
+
+static pthread_mutex_t swap_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool swap_running = false;
+
+//
+// Read /proc/swaps.  Returns the number of entries.
+//
+static int read_swaps(SWAP_ENTRY *entries, int max) {
+  char line[MAXLINLEN];
+  FILE *fp = fopen("/proc/swaps", "r");
+  int n = 0;
+
+  if (!fp) return 0;
+
+  // Skip the heading
+  if (!fgets(line, sizeof line, fp)) {
+    fclose(fp);
+    return 0;
+  }
+
+  while ((n < max) && fgets(line, sizeof line, fp)) {
+    if (sscanf(line, "%1023s %127s %lu %lu %d", entries[n].device, entries[n].type,
+	       &entries[n].size_kb, &entries[n].used_kb, &entries[n].priority) == 5) {
+      n++;
+    }
+  }
+
+  fclose(fp);
+  return n;
+}
+
+//
+// Find the active swap entry for a device, whatever name it was enabled under.
+//
+static bool find_swap(const char *device, SWAP_ENTRY *entry) {
+  SWAP_ENTRY entries[MAX_SWAPS];
+  struct stat want, have;
+  int i, n;
+
+  if (stat(device, &want)) return false;
+
+  n = read_swaps(entries, MAX_SWAPS);
+  for (i = 0; i < n; i++) {
+    if (!stat(entries[i].device, &have) && (have.st_rdev == want.st_rdev)) {
+      *entry = entries[i];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool read_sysfs(const char *file, char *value, size_t size) {
+  FILE *fp = fopen(file, "r");
+  char *nl;
+
+  value[0] = '\0';
+  if (!fp) return false;
+
+  if (!fgets(value, size, fp)) value[0] = '\0';
+  fclose(fp);
+
+  nl = strchr(value, '\n'); if (nl) *nl = 0;
+  return true;
+}
+
+static bool write_sysfs(const char *file, const char *value) {
+  int fd = open(file, O_WRONLY);
+  ssize_t len = strlen(value);
+  bool ok;
+
+  if (fd < 0) return false;
+
+  ok = (write(fd, value, len) == len);
+  close(fd);
+
+  return ok;
+}
+
+//
+// Write a version 1 swap header onto a device, as mkswap would.
+//
+bool swap_format(const char *device) {
+  long pagesize = sysconf(_SC_PAGESIZE);
+  unsigned long long bytes = 0;
+  SWAP_HEADER_INFO *info;
+  char *page;
+  bool ok = false;
+  int fd, rnd;
+
+  fd = open(device, O_RDWR);
+  if (fd < 0) return false;
+
+  if (ioctl(fd, BLKGETSIZE64, &bytes) || (bytes < (unsigned long long)pagesize * 10)) goto done;
+
+  page = calloc(1, pagesize);
+  if (!page) goto done;
+
+  info = (SWAP_HEADER_INFO *)(page + SWAP_BOOTBITS);
+  info->version = 1;
+  info->last_page = (uint32_t)(bytes / pagesize - 1);
+  info->nr_badpages = 0;
+  strncpy(info->volume_name, "tailor", sizeof info->volume_name);
+
+  rnd = open("/dev/urandom", O_RDONLY);
+  if (rnd >= 0) {
+    if (read(rnd, info->uuid, sizeof info->uuid) != sizeof info->uuid) memset(info->uuid, 0, sizeof info->uuid);
+    close(rnd);
+  }
+
+  memcpy(page + pagesize - SWAP_SIGNATURE_LEN, SWAP_SIGNATURE, SWAP_SIGNATURE_LEN);
+
+  ok = (pwrite(fd, page, pagesize, 0) == pagesize) && !fsync(fd);
+
+  free(page);
+ done:
+  close(fd);
+  return ok;
+}
+
+static int swap_flags(int priority) {
+  if (priority < 0) return 0;
+
+  return SWAP_FLAG_PREFER | ((priority << SWAP_FLAG_PRIO_SHIFT) & SWAP_FLAG_PRIO_MASK);
+}
+
+static void respond_status(LSMessage *message, const char *status) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+
+  snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"stage\": \"status\", \"status\": \"%s\"}", status);
+
+  if (!LSMessageRespond(message, buffer, &lserror)) {
+    LSErrorPrint(&lserror, stderr);
+    LSErrorFree(&lserror);
+  }
+}
+
+//
+// Resize the swap volume, rewriting its header in place.
+//
+static const char *resize_swap(SWAP_JOB *job) {
+  char command[MAXLINLEN];
+  char output[MAXLINLEN];
+  SWAP_ENTRY entry;
+  bool active = find_swap(SWAP_DEVICE, &entry);
+  int priority = job->has_priority ? job->priority : (active ? entry.priority : -1);
+
+  if (!lvm_volume_bytes(LVM_GROUP_NAME, SWAP_VOLUME)) return "Swap volume does not exist";
+
+  // Anything swapped out has to come back into memory first.
+  if (active) {
+    respond_status(job->message, "Disabling swap");
+    if (swapoff(SWAP_DEVICE)) return "Unable to disable swap";
+  }
+
+  respond_status(job->message, "Resizing volume");
+  snprintf(command, sizeof command, "/usr/sbin/lvresize -f -L %luM %s/%s",
+	   job->size_mb, LVM_GROUP_NAME, SWAP_VOLUME);
+  if (!lvm_run(command, output, sizeof output)) {
+    log_printf(LOG_ERR, "Swap resize failed: %s\n", output);
+    if (active) swapon(SWAP_DEVICE, swap_flags(priority));
+    return "Unable to resize swap volume";
+  }
+
+  respond_status(job->message, "Writing swap header");
+  if (!swap_format(SWAP_DEVICE)) return "Unable to write swap header";
+
+  if (active || job->enable) {
+    respond_status(job->message, "Enabling swap");
+    if (swapon(SWAP_DEVICE, swap_flags(priority))) return "Unable to enable swap";
+  }
+
+  return NULL;
+}
+
+//
+// Change the priority of an active swap device, which the kernel only
+// allows by disabling and re-enabling it.
+//
+static const char *set_priority(SWAP_JOB *job) {
+  const char *device = job->zram ? ZRAM_DEVICE : SWAP_DEVICE;
+  SWAP_ENTRY entry;
+
+  if (!find_swap(device, &entry)) return "Swap device is not active";
+  if (entry.priority == job->priority) return NULL;
+
+  respond_status(job->message, "Disabling swap");
+  if (swapoff(device)) return "Unable to disable swap";
+
+  respond_status(job->message, "Enabling swap");
+  if (swapon(device, swap_flags(job->priority))) {
+    swapon(device, swap_flags(entry.priority));
+    return "Unable to enable swap";
+  }
+
+  return NULL;
+}
+
+//
+// Set up (or tear down) compressed swap in RAM.
+//
+static const char *configure_zram(SWAP_JOB *job) {
+  char value[MAXNUMLEN];
+  SWAP_ENTRY entry;
+
+  if (access(ZRAM_SYSFS, F_OK)) {
+    if (!job->enable) return NULL;
+    respond_status(job->message, "Loading zram module");
+    if (!lvm_run("/sbin/modprobe zram num_devices=1", NULL, 0) || access(ZRAM_SYSFS, F_OK)) {
+      return "Kernel has no zram support";
+    }
+  }
+
+  if (find_swap(ZRAM_DEVICE, &entry)) {
+    respond_status(job->message, "Disabling zram swap");
+    if (swapoff(ZRAM_DEVICE)) return "Unable to disable zram swap";
+  }
+
+  // The size and algorithm can only be changed on a reset device.
+  if (!write_sysfs(ZRAM_SYSFS "/reset", "1")) return "Unable to reset zram device";
+
+  if (!job->enable) return NULL;
+
+  if (job->algorithm[0] && !write_sysfs(ZRAM_SYSFS "/comp_algorithm", job->algorithm)) {
+    return "Compression algorithm not supported";
+  }
+
+  snprintf(value, sizeof value, "%llu", (unsigned long long)job->size_mb << 20);
+  if (!write_sysfs(ZRAM_SYSFS "/disksize", value)) return "Unable to set zram size";
+
+  respond_status(job->message, "Writing swap header");
+  if (!swap_format(ZRAM_DEVICE)) return "Unable to write swap header";
+
+  respond_status(job->message, "Enabling zram swap");
+  if (swapon(ZRAM_DEVICE, swap_flags(job->has_priority ? job->priority : ZRAM_DEFAULT_PRIORITY))) {
+    return "Unable to enable zram swap";
+  }
+
+  return NULL;
+}
+
+void *swap_thread(void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  SWAP_JOB *job = (SWAP_JOB *)ctx;
+  char buffer[MAXLINLEN];
+  const char *failure = NULL;
+
+  switch (job->op) {
+  case SWAP_RESIZE:   failure = resize_swap(job); break;
+  case SWAP_PRIORITY: failure = set_priority(job); break;
+  case SWAP_ZRAM:     failure = configure_zram(job); break;
+  }
+
+  if (failure) {
+    log_printf(LOG_ERR, "Swap operation failed: %s (%s)\n", failure, strerror(errno));
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}", failure);
+  }
+  else {
+    strcpy(buffer, "{\"returnValue\": true, \"stage\": \"completed\"}");
+  }
+
+  if (!LSMessageRespond(job->message, buffer, &lserror)) goto error;
+
+  goto end;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+ end:
+  if (job->op == SWAP_RESIZE) lvm_release();
+  LSMessageUnref(job->message);
+  free(job);
+
+  pthread_mutex_lock(&swap_lock);
+  swap_running = false;
+  pthread_mutex_unlock(&swap_lock);
+
+  return NULL;
+}
+
+//
+// Start a swap job thread, responding to the message either way.
+//
+static bool start_swap_job(LSMessage *message, SWAP_JOB *job) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  pthread_t thread;
+
+  pthread_mutex_lock(&swap_lock);
+  if (swap_running) {
+    pthread_mutex_unlock(&swap_lock);
+    free(job);
+    log_printf(LOG_NOTICE, "Swap thread already running\n");
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+
+  if ((job->op == SWAP_RESIZE) && !lvm_claim("swap")) {
+    pthread_mutex_unlock(&swap_lock);
+    free(job);
+    log_printf(LOG_NOTICE, "Volume group busy with %s\n", lvm_claimed_by());
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Volume group is busy\", \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  swap_running = true;
+  pthread_mutex_unlock(&swap_lock);
+
+  // Ref and save the message for use in swap thread
+  LSMessageRef(message);
+  job->message = message;
+
+  if (pthread_create(&thread, NULL, swap_thread, (void*)job)) {
+    log_printf(LOG_ERR, "Creating swap thread failed\n");
+    if (job->op == SWAP_RESIZE) lvm_release();
+    pthread_mutex_lock(&swap_lock);
+    swap_running = false;
+    pthread_mutex_unlock(&swap_lock);
+    LSMessageUnref(message);
+    free(job);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Unable to start swap thread\"}", &lserror)) goto error;
+  }
+  else {
+    pthread_detach(thread);
+    if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+  }
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+static bool respond_invalid(LSMessage *message, const char *what) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"Invalid or missing %s\"}", what);
+
+  if (!LSMessageRespond(message, buffer, &lserror)) {
+    LSErrorPrint(&lserror, stderr);
+    LSErrorFree(&lserror);
+    return false;
+  }
+
+  return true;
+}
+
+//
+// Report the swap volume, the zram device and everything in /proc/swaps.
+//
+bool get_swap_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXBUFLEN];
+  char esc[MAXBUFLEN];
+  char value[MAXLINLEN];
+  SWAP_ENTRY entries[MAX_SWAPS];
+  int i, n = read_swaps(entries, MAX_SWAPS);
+  size_t len;
+
+  len = snprintf(buffer, sizeof buffer, "{\"returnValue\": true, \"volumeBytes\": %llu, \"swaps\": [",
+		 lvm_volume_bytes(LVM_GROUP_NAME, SWAP_VOLUME));
+
+  for (i = 0; i < n; i++) {
+    len += snprintf(buffer + len, sizeof buffer - len,
+		    "%s{\"device\": \"%s\", \"type\": \"%s\", \"sizeKB\": %lu, \"usedKB\": %lu, \"priority\": %d}",
+		    i ? ", " : "", json_escape_buf(entries[i].device, esc), entries[i].type,
+		    entries[i].size_kb, entries[i].used_kb, entries[i].priority);
+  }
+
+  len += snprintf(buffer + len, sizeof buffer - len, "]");
+
+  if (!access(ZRAM_SYSFS, F_OK)) {
+    unsigned long long disksize, orig = 0, compr = 0;
+    char algorithm[MAXLINLEN];
+
+    read_sysfs(ZRAM_SYSFS "/disksize", value, sizeof value);
+    disksize = strtoull(value, NULL, 10);
+    read_sysfs(ZRAM_SYSFS "/comp_algorithm", algorithm, sizeof algorithm);
+
+    // Newer kernels report usage in mm_stat, older ones in separate files.
+    if (read_sysfs(ZRAM_SYSFS "/mm_stat", value, sizeof value) && value[0]) {
+      sscanf(value, "%llu %llu", &orig, &compr);
+    }
+    else {
+      read_sysfs(ZRAM_SYSFS "/orig_data_size", value, sizeof value);
+      orig = strtoull(value, NULL, 10);
+      read_sysfs(ZRAM_SYSFS "/compr_data_size", value, sizeof value);
+      compr = strtoull(value, NULL, 10);
+    }
+
+    len += snprintf(buffer + len, sizeof buffer - len,
+		    ", \"zram\": {\"diskBytes\": %llu, \"algorithms\": \"%s\", \"origBytes\": %llu, \"comprBytes\": %llu}",
+		    disksize, json_escape_buf(algorithm, esc), orig, compr);
+  }
+
+  snprintf(buffer + len, sizeof buffer - len, "}");
+
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+//
+// Resize the swap volume, rewriting its header without spawning mkswap.
+//
+bool resize_swap_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  SWAP_JOB *job = calloc(1, sizeof(SWAP_JOB));
+  if (!job) return respond_invalid(message, "memory");
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *size = json_find_first_label(object, "size");
+  json_t *priority = json_find_first_label(object, "priority");
+  json_t *enable = json_find_first_label(object, "enable");
+
+  job->op = SWAP_RESIZE;
+  if (size && ((size->child->type == JSON_STRING) || (size->child->type == JSON_NUMBER)) &&
+      (strspn(size->child->text, ALLOWED_CHARS) == strlen(size->child->text))) {
+    job->size_mb = (unsigned long)(lvm_parse_size(size->child->text) >> 20);
+  }
+  if (priority && (priority->child->type == JSON_NUMBER)) {
+    job->priority = atoi(priority->child->text);
+    job->has_priority = true;
+  }
+  job->enable = enable && (enable->child->type == JSON_TRUE);
+
+  json_free_value(&object);
+
+  if (!job->size_mb) {
+    free(job);
+    return respond_invalid(message, "size");
+  }
+
+  if (job->has_priority && ((job->priority < 0) || (job->priority > SWAP_MAX_PRIORITY))) {
+    free(job);
+    return respond_invalid(message, "priority");
+  }
+
+  return start_swap_job(message, job);
+}
+
+//
+// Change the priority of the swap volume or the zram device.
+//
+bool set_swap_priority_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  SWAP_JOB *job = calloc(1, sizeof(SWAP_JOB));
+  if (!job) return respond_invalid(message, "memory");
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *device = json_find_first_label(object, "device");
+  json_t *priority = json_find_first_label(object, "priority");
+
+  job->op = SWAP_PRIORITY;
+  job->zram = device && (device->child->type == JSON_STRING) && !strcmp(device->child->text, "zram");
+  if (priority && (priority->child->type == JSON_NUMBER)) {
+    job->priority = atoi(priority->child->text);
+    job->has_priority = (job->priority >= 0) && (job->priority <= SWAP_MAX_PRIORITY);
+  }
+
+  json_free_value(&object);
+
+  if (!job->has_priority) {
+    free(job);
+    return respond_invalid(message, "priority");
+  }
+
+  return start_swap_job(message, job);
+}
+
+//
+// Enable compressed swap in RAM with a given size and algorithm, or disable it.
+//
+bool configure_zram_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  SWAP_JOB *job = calloc(1, sizeof(SWAP_JOB));
+  if (!job) return respond_invalid(message, "memory");
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *enable = json_find_first_label(object, "enable");
+  json_t *size = json_find_first_label(object, "size");
+  json_t *algorithm = json_find_first_label(object, "algorithm");
+  json_t *priority = json_find_first_label(object, "priority");
+
+  job->op = SWAP_ZRAM;
+  job->enable = !enable || (enable->child->type != JSON_FALSE);
+  if (size && ((size->child->type == JSON_STRING) || (size->child->type == JSON_NUMBER)) &&
+      (strspn(size->child->text, ALLOWED_CHARS) == strlen(size->child->text))) {
+    job->size_mb = (unsigned long)(lvm_parse_size(size->child->text) >> 20);
+  }
+  if (algorithm && (algorithm->child->type == JSON_STRING) &&
+      (strlen(algorithm->child->text) < MAXNAMLEN) &&
+      (strspn(algorithm->child->text, ALLOWED_CHARS) == strlen(algorithm->child->text))) {
+    strcpy(job->algorithm, algorithm->child->text);
+  }
+  if (priority && (priority->child->type == JSON_NUMBER)) {
+    job->priority = atoi(priority->child->text);
+    job->has_priority = true;
+  }
+
+  json_free_value(&object);
+
+  if (job->enable && !job->size_mb) {
+    free(job);
+    return respond_invalid(message, "size");
+  }
+
+  if (job->has_priority && ((job->priority < 0) || (job->priority > SWAP_MAX_PRIORITY))) {
+    free(job);
+    return respond_invalid(message, "priority");
+  }
+
+  return start_swap_job(message, job);
+}
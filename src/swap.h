@@ -0,0 +1,45 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef SWAP_H_
+#define SWAP_H_
+
+#include <lunaservice.h>
+
+// The swap logical volume in the store group.
+#define SWAP_VOLUME "swap"
+#define SWAP_DEVICE "/dev/store/swap"
+
+// The compressed RAM swap device.
+#define ZRAM_DEVICE "/dev/zram0"
+#define ZRAM_SYSFS  "/sys/block/zram0"
+
+// Swap priority given to zram by default, so it is used before the LV.
+#define ZRAM_DEFAULT_PRIORITY 100
+
+// Highest priority swapon(2) can carry in its flags.
+#define SWAP_MAX_PRIORITY 32767
+
+bool swap_format(const char *device);
+
+bool get_swap_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool resize_swap_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool set_swap_priority_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool configure_zram_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* SWAP_H_ */
@@ -82,9 +82,16 @@ int main(int argc, char *argv[]) {
   if (getopts(argc, argv) == 1)
     return 1;
 
+  log_init(debug);
+
+  // Note any resize which was cut short, before accepting requests.
+  resize_journal_detect();
+
   if (luna_service_initialize("org.webosinternals.tailor"))
     luna_service_start();
 
+  log_shutdown();
+
   return 0;
 
 }
@@ -21,6 +21,8 @@
 
 #include "luna_service.h"
 #include "luna_methods.h"
+#include "resize.h"
+#include "logger.h"
 
 #define DEFAULT_DEBUG_LEVEL 0
 
@@ -0,0 +1,340 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+
+#include "thread_pool.h"
+
+// Initial number of slots in each worker's deque (grows on demand).
+#define DEQUE_INITIAL 256
+
+typedef struct {
+  pool_task_fn fn;
+  void *arg;
+} POOL_TASK;
+
+typedef struct {
+  pthread_mutex_t lock;
+  POOL_TASK *tasks;
+  unsigned int head;		// index of the oldest task (steal end)
+  unsigned int count;		// number of tasks in the ring
+  unsigned int size;		// number of slots in the ring
+} POOL_DEQUE;
+
+typedef struct {
+  thread_pool_t *pool;
+  int index;
+} POOL_WORKER;
+
+struct thread_pool {
+  int nthreads;
+  pthread_t *threads;
+  POOL_WORKER *workers;
+  POOL_DEQUE *deques;
+
+  // Protects everything below.
+  pthread_mutex_t lock;
+  pthread_cond_t work;		// signalled when a task is queued
+  pthread_cond_t done;		// signalled when pending drops to zero
+  unsigned long queued;		// tasks sitting in a deque
+  unsigned long pending;	// tasks queued or running
+  unsigned int next;		// round-robin target for external submits
+  bool shutdown;
+};
+
+//
+// The number of workers to use for an I/O bound job.  Flash latency rather
+// than CPU is the limit, so run a couple of workers per core.
+//
+int pool_default_threads(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads;
+
+  if (cpus < 1) cpus = 1;
+
+  nthreads = (int)cpus * 2;
+  if (nthreads > POOL_MAX_THREADS) nthreads = POOL_MAX_THREADS;
+
+  return nthreads;
+}
+
+static bool deque_push(POOL_DEQUE *deque, pool_task_fn fn, void *arg) {
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->count == deque->size) {
+    unsigned int size = deque->size ? deque->size * 2 : DEQUE_INITIAL;
+    POOL_TASK *tasks = malloc(size * sizeof(POOL_TASK));
+    unsigned int i;
+
+    if (!tasks) {
+      pthread_mutex_unlock(&deque->lock);
+      return false;
+    }
+
+    // Unwrap the ring into the new array.
+    for (i = 0; i < deque->count; i++) {
+      tasks[i] = deque->tasks[(deque->head + i) % deque->size];
+    }
+
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->head = 0;
+    deque->size = size;
+  }
+
+  deque->tasks[(deque->head + deque->count) % deque->size].fn = fn;
+  deque->tasks[(deque->head + deque->count) % deque->size].arg = arg;
+  deque->count++;
+
+  pthread_mutex_unlock(&deque->lock);
+  return true;
+}
+
+// Owner end: newest first.
+static bool deque_pop(POOL_DEQUE *deque, POOL_TASK *task) {
+  bool found = false;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count) {
+    deque->count--;
+    *task = deque->tasks[(deque->head + deque->count) % deque->size];
+    found = true;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+// Thief end: oldest first.
+static bool deque_steal(POOL_DEQUE *deque, POOL_TASK *task) {
+  bool found = false;
+
+  // Do not queue up behind a busy owner, just try the next victim.
+  if (pthread_mutex_trylock(&deque->lock)) return false;
+
+  if (deque->count) {
+    *task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->size;
+    deque->count--;
+    found = true;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return found;
+}
+
+static bool pool_take(thread_pool_t *pool, int self, POOL_TASK *task) {
+  int i;
+
+  if (deque_pop(&pool->deques[self], task)) return true;
+
+  for (i = 1; i < pool->nthreads; i++) {
+    if (deque_steal(&pool->deques[(self + i) % pool->nthreads], task)) return true;
+  }
+
+  return false;
+}
+
+static void *pool_worker(void *ctx) {
+  POOL_WORKER *worker = (POOL_WORKER *)ctx;
+  thread_pool_t *pool = worker->pool;
+  POOL_TASK task;
+
+  while (1) {
+
+    if (pool_take(pool, worker->index, &task)) {
+
+      pthread_mutex_lock(&pool->lock);
+      pool->queued--;
+      pthread_mutex_unlock(&pool->lock);
+
+      task.fn(task.arg, worker->index);
+
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->pending == 0) pthread_cond_broadcast(&pool->done);
+      pthread_mutex_unlock(&pool->lock);
+
+      continue;
+    }
+
+    // Nothing to pop or steal, so sleep until something is queued.
+    // The queued count is raised before the task lands in a deque, so
+    // a waking worker may spin briefly until the push completes.
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->queued && !pool->shutdown) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    if (pool->shutdown && !pool->queued) {
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // Work exists but every deque was busy; let the owners finish.
+    sched_yield();
+  }
+
+  return NULL;
+}
+
+thread_pool_t *pool_create(int nthreads) {
+  thread_pool_t *pool;
+  int i;
+
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > POOL_MAX_THREADS) nthreads = POOL_MAX_THREADS;
+
+  pool = calloc(1, sizeof(thread_pool_t));
+  if (!pool) return NULL;
+
+  pool->threads = calloc(nthreads, sizeof(pthread_t));
+  pool->workers = calloc(nthreads, sizeof(POOL_WORKER));
+  pool->deques = calloc(nthreads, sizeof(POOL_DEQUE));
+  if (!pool->threads || !pool->workers || !pool->deques) goto fail;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&pool->threads[i], NULL, pool_worker, &pool->workers[i])) break;
+    pool->nthreads++;
+  }
+
+  if (!pool->nthreads) goto fail;
+
+  return pool;
+
+ fail:
+  free(pool->threads);
+  free(pool->workers);
+  free(pool->deques);
+  free(pool);
+  return NULL;
+}
+
+//
+// Queue a task.  Workers should pass their own index so that the task
+// lands on their own deque; anything else passes POOL_EXTERNAL.
+//
+bool pool_submit(thread_pool_t *pool, int worker, pool_task_fn fn, void *arg) {
+  int target;
+
+  pthread_mutex_lock(&pool->lock);
+  if (worker >= 0 && worker < pool->nthreads) {
+    target = worker;
+  }
+  else {
+    target = pool->next++ % pool->nthreads;
+  }
+  pool->queued++;
+  pool->pending++;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  if (!deque_push(&pool->deques[target], fn, arg)) {
+    pthread_mutex_lock(&pool->lock);
+    pool->queued--;
+    if (--pool->pending == 0) pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+    return false;
+  }
+
+  return true;
+}
+
+//
+// Wait for the pool to drain, giving up after msecs.
+// Returns true once there is no work queued or running.
+//
+bool pool_wait_timeout(thread_pool_t *pool, int msecs) {
+  struct timeval now;
+  struct timespec until;
+  bool idle;
+
+  gettimeofday(&now, NULL);
+  until.tv_sec = now.tv_sec + msecs / 1000;
+  until.tv_nsec = (now.tv_usec + (msecs % 1000) * 1000) * 1000;
+  if (until.tv_nsec >= 1000000000) {
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending) {
+    if (pthread_cond_timedwait(&pool->done, &pool->lock, &until) == ETIMEDOUT) break;
+  }
+  idle = (pool->pending == 0);
+  pthread_mutex_unlock(&pool->lock);
+
+  return idle;
+}
+
+void pool_wait(thread_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+//
+// Stop the workers and release the pool.  Tasks still queued are run
+// before the workers exit, so jobs being abandoned should have their
+// tasks check a cancel flag and return early.
+//
+void pool_destroy(thread_pool_t *pool) {
+  int i;
+
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->nthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  for (i = 0; i < pool->nthreads; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+
+  free(pool->threads);
+  free(pool->workers);
+  free(pool->deques);
+  free(pool);
+}
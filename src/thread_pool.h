@@ -0,0 +1,52 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <stdbool.h>
+
+//
+// A small work-stealing thread pool.  Each worker owns a deque of tasks;
+// it pushes and pops its own work at the tail (depth first, which keeps
+// directory walks cache friendly) and steals from the head of the other
+// workers' deques when it runs dry (which hands out the oldest, and so
+// usually the largest, pieces of work).
+//
+
+typedef struct thread_pool thread_pool_t;
+
+// A task is handed its argument and the index of the worker running it,
+// so that it can submit follow-on work to its own deque.
+typedef void (*pool_task_fn)(void *arg, int worker);
+
+// Submit from outside the pool (tasks are spread round-robin).
+#define POOL_EXTERNAL -1
+
+// Upper limit on the number of workers in any pool.
+#define POOL_MAX_THREADS 8
+
+int pool_default_threads(void);
+
+thread_pool_t *pool_create(int nthreads);
+bool pool_submit(thread_pool_t *pool, int worker, pool_task_fn fn, void *arg);
+bool pool_wait_timeout(thread_pool_t *pool, int msecs);
+void pool_wait(thread_pool_t *pool);
+void pool_destroy(thread_pool_t *pool);
+
+#endif /* THREAD_POOL_H_ */
@@ -0,0 +1,758 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "luna_methods.h"
+#include "logger.h"
+#include "lvm.h"
+#include "thread_pool.h"
+#include "io_policy.h"
+#include "fs_probe.h"
+#include "fat_check.h"
+#include "ext3_check.h"
+#include "calibrate.h"
+#include "xxh64.h"
+#include "verify.h"
+
+// Size of each worker's getdents64 buffer.
+#define DENTS_BUFLEN 32768
+
+// Interval between streamed progress reports.
+#define REPORT_MSECS 1000
+
+// Directory entry types, as returned by the kernel.
+#define DENT_UNKNOWN 0
+#define DENT_DIR     4
+#define DENT_REG     8
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+typedef struct {
+  char *path;			// relative to the mount point
+  unsigned long long size;
+  uint64_t hash;
+} VERIFY_ENTRY;
+
+// Per-worker state, so that workers never contend on results or buffers.
+typedef struct {
+  VERIFY_ENTRY *entries;
+  size_t count;
+  size_t size;
+  char dents[DENTS_BUFLEN];
+  unsigned char *buffer;
+} VERIFY_WORKER;
+
+typedef struct {
+  LSMessage *message;
+  char volume[MAXNAMLEN];
+  char device[MAXLINLEN];
+  char mountpoint[MAXLINLEN];
+  char manifest[MAXLINLEN];
+  bool record;
+  bool sample;
+  IO_POLICY policy;
+  IO_THROTTLE throttle;
+
+  int root_fd;
+  dev_t root_dev;
+  thread_pool_t *pool;
+  VERIFY_WORKER *workers;
+  int nthreads;
+  size_t chunk;			// each read while hashing a whole file
+
+  // Protects the counters.
+  pthread_mutex_t lock;
+  unsigned long files;
+  unsigned long long bytes;
+  unsigned long errors;
+  unsigned long skipped;
+} VERIFY_JOB;
+
+typedef struct {
+  VERIFY_JOB *job;
+  char *path;
+} VERIFY_TASK;
+
+static pthread_mutex_t verify_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool verify_running = false;
+static bool verify_cancelled = false;
+
+static bool is_cancelled(void) {
+  bool cancelled;
+
+  pthread_mutex_lock(&verify_lock);
+  cancelled = verify_cancelled;
+  pthread_mutex_unlock(&verify_lock);
+
+  return cancelled;
+}
+
+static void count_error(VERIFY_JOB *job, bool skipped) {
+  pthread_mutex_lock(&job->lock);
+  if (skipped) job->skipped++;
+  else job->errors++;
+  pthread_mutex_unlock(&job->lock);
+}
+
+static char *join_path(const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  char *path = malloc(len + strlen(name) + 2);
+
+  if (!path) return NULL;
+  if (len) sprintf(path, "%s/%s", dir, name);
+  else strcpy(path, name);
+
+  return path;
+}
+
+static void hash_file_task(void *arg, int index);
+static void walk_dir_task(void *arg, int index);
+
+static bool submit(VERIFY_JOB *job, int index, pool_task_fn fn, char *path) {
+  VERIFY_TASK *task = malloc(sizeof(VERIFY_TASK));
+
+  if (!task) return false;
+  task->job = job;
+  task->path = path;
+  if (!pool_submit(job->pool, index, fn, task)) {
+    free(task);
+    return false;
+  }
+
+  return true;
+}
+
+//
+// Read a directory, handing each subdirectory and regular file back to
+// the pool.  Nothing is followed off this filesystem or through a link.
+//
+static void walk_dir_task(void *arg, int index) {
+  VERIFY_TASK *task = (VERIFY_TASK *)arg;
+  VERIFY_JOB *job = task->job;
+  VERIFY_WORKER *worker = &job->workers[index];
+  struct stat st;
+  int fd, nread, pos;
+
+  if (is_cancelled()) goto end;
+
+  fd = openat(job->root_fd, task->path[0] ? task->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+  if (fd < 0) {
+    count_error(job, false);
+    goto end;
+  }
+
+  while ((nread = syscall(SYS_getdents64, fd, worker->dents, DENTS_BUFLEN)) > 0) {
+    for (pos = 0; pos < nread; ) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(worker->dents + pos);
+      unsigned char type = d->d_type;
+      char *path;
+
+      pos += d->d_reclen;
+
+      if (d->d_name[0] == '.' &&
+	  (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+	continue;
+      }
+
+      if (type == DENT_UNKNOWN) {
+	if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+	  count_error(job, false);
+	  continue;
+	}
+	type = S_ISDIR(st.st_mode) ? DENT_DIR : S_ISREG(st.st_mode) ? DENT_REG : DENT_UNKNOWN;
+      }
+      if ((type != DENT_DIR) && (type != DENT_REG)) continue;
+
+      // The manifest is one path per line.
+      if (strchr(d->d_name, '\n')) {
+	count_error(job, true);
+	continue;
+      }
+
+      if (type == DENT_DIR) {
+	if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) || (st.st_dev != job->root_dev)) continue;
+      }
+
+      path = join_path(task->path, d->d_name);
+      if (!path || !submit(job, index, (type == DENT_DIR) ? walk_dir_task : hash_file_task, path)) {
+	free(path);
+	count_error(job, false);
+      }
+    }
+  }
+
+  if (nread < 0) count_error(job, false);
+
+  close(fd);
+
+ end:
+  free(task->path);
+  free(task);
+}
+
+static bool hash_range(VERIFY_JOB *job, VERIFY_WORKER *worker, XXH64_STATE *state, int fd,
+		       unsigned long long offset, unsigned long long length) {
+  while (length) {
+    size_t want = (length > job->chunk) ? job->chunk : (size_t)length;
+    ssize_t got = pread(fd, worker->buffer, want, offset);
+
+    if (got <= 0) return false;
+    io_throttle_take(&job->throttle, got);
+    xxh64_update(state, worker->buffer, got);
+    offset += got;
+    length -= got;
+  }
+
+  return true;
+}
+
+//
+// Hash one file, seeded with its size.  In sample mode a large file is
+// hashed from three evenly placed pieces, which finds lost or shifted
+// blocks and truncation at a small fraction of the reading.
+//
+static void hash_file_task(void *arg, int index) {
+  VERIFY_TASK *task = (VERIFY_TASK *)arg;
+  VERIFY_JOB *job = task->job;
+  VERIFY_WORKER *worker = &job->workers[index];
+  unsigned long long size, read_bytes;
+  XXH64_STATE state;
+  struct stat st;
+  bool ok;
+  int fd;
+
+  if (is_cancelled()) goto failed;
+
+  fd = openat(job->root_fd, task->path, O_RDONLY | O_NOFOLLOW);
+  if ((fd < 0) || fstat(fd, &st)) {
+    if (fd >= 0) close(fd);
+    count_error(job, false);
+    goto failed;
+  }
+
+  size = st.st_size;
+  xxh64_init(&state, size);
+
+  if (job->sample && (size > 3 * VERIFY_SAMPLE_BYTES)) {
+    unsigned long long middle = ((size - VERIFY_SAMPLE_BYTES) / 2) & ~4095ULL;
+    ok = hash_range(job, worker, &state, fd, 0, VERIFY_SAMPLE_BYTES) &&
+      hash_range(job, worker, &state, fd, middle, VERIFY_SAMPLE_BYTES) &&
+      hash_range(job, worker, &state, fd, size - VERIFY_SAMPLE_BYTES, VERIFY_SAMPLE_BYTES);
+    read_bytes = 3 * VERIFY_SAMPLE_BYTES;
+  }
+  else {
+    ok = hash_range(job, worker, &state, fd, 0, size);
+    read_bytes = size;
+  }
+
+  close(fd);
+
+  if (!ok) {
+    count_error(job, false);
+    goto failed;
+  }
+
+  if (worker->count == worker->size) {
+    size_t grown = worker->size ? worker->size * 2 : 1024;
+    VERIFY_ENTRY *entries = realloc(worker->entries, grown * sizeof(VERIFY_ENTRY));
+    if (!entries) {
+      count_error(job, false);
+      goto failed;
+    }
+    worker->entries = entries;
+    worker->size = grown;
+  }
+
+  worker->entries[worker->count].path = task->path;
+  worker->entries[worker->count].size = size;
+  worker->entries[worker->count].hash = xxh64_digest(&state);
+  worker->count++;
+
+  pthread_mutex_lock(&job->lock);
+  job->files++;
+  job->bytes += read_bytes;
+  pthread_mutex_unlock(&job->lock);
+
+  free(task);
+  return;
+
+ failed:
+  free(task->path);
+  free(task);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return strcmp(((const VERIFY_ENTRY *)a)->path, ((const VERIFY_ENTRY *)b)->path);
+}
+
+static void free_entries(VERIFY_ENTRY *entries, size_t count) {
+  size_t i;
+
+  for (i = 0; i < count; i++) free(entries[i].path);
+  free(entries);
+}
+
+//
+// Hash every file on the volume, returning the results sorted by path.
+//
+static const char *hash_volume(VERIFY_JOB *job, VERIFY_ENTRY **result, size_t *count) {
+  char buffer[MAXLINLEN];
+  VERIFY_ENTRY *entries;
+  struct stat st;
+  size_t total = 0;
+  int i;
+
+  *result = NULL;
+  *count = 0;
+
+  job->root_fd = open(job->mountpoint, O_RDONLY | O_DIRECTORY);
+  if ((job->root_fd < 0) || fstat(job->root_fd, &st)) return "Unable to open the volume";
+  job->root_dev = st.st_dev;
+
+  job->nthreads = pool_default_threads();
+  job->chunk = calibration_io_size();
+  job->workers = calloc(job->nthreads, sizeof(VERIFY_WORKER));
+  if (!job->workers) return "Out of memory";
+  for (i = 0; i < job->nthreads; i++) {
+    job->workers[i].buffer = malloc(job->chunk);
+    if (!job->workers[i].buffer) return "Out of memory";
+  }
+  job->pool = pool_create(job->nthreads);
+  if (!job->pool) return "Out of memory";
+
+  if (!submit(job, POOL_EXTERNAL, walk_dir_task, strdup(""))) return "Out of memory";
+
+  while (!pool_wait_timeout(job->pool, REPORT_MSECS)) {
+    pthread_mutex_lock(&job->lock);
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"status\", \"files\": %lu, \"bytes\": %llu, \"errors\": %lu}",
+	     job->files, job->bytes, job->errors);
+    pthread_mutex_unlock(&job->lock);
+    respond_quietly(job->message, buffer);
+  }
+
+  pool_destroy(job->pool);
+  job->pool = NULL;
+
+  if (is_cancelled()) return "Cancelled";
+
+  for (i = 0; i < job->nthreads; i++) total += job->workers[i].count;
+
+  entries = malloc((total ? total : 1) * sizeof(VERIFY_ENTRY));
+  if (!entries) return "Out of memory";
+
+  for (i = 0; i < job->nthreads; i++) {
+    memcpy(entries + *count, job->workers[i].entries, job->workers[i].count * sizeof(VERIFY_ENTRY));
+    *count += job->workers[i].count;
+    free(job->workers[i].entries);
+    job->workers[i].entries = NULL;
+    job->workers[i].count = 0;
+  }
+
+  qsort(entries, *count, sizeof(VERIFY_ENTRY), compare_entries);
+  *result = entries;
+
+  return NULL;
+}
+
+static const char *save_manifest(VERIFY_JOB *job, VERIFY_ENTRY *entries, size_t count) {
+  char tmpfile[MAXLINLEN];
+  size_t i;
+  FILE *fp;
+  int fd;
+
+  mkdir(STATE_DIR, 0755);
+  snprintf(tmpfile, sizeof tmpfile, "%s.new", job->manifest);
+
+  fp = fopen(tmpfile, "w");
+  if (!fp) return "Unable to write the manifest";
+
+  fprintf(fp, "#verify %s %lu\n", job->sample ? "sample" : "full", (unsigned long)count);
+  for (i = 0; i < count; i++) {
+    fprintf(fp, "%016llx %llu %s\n", (unsigned long long)entries[i].hash, entries[i].size, entries[i].path);
+  }
+
+  if (fflush(fp) || fsync(fileno(fp)) || ferror(fp)) {
+    fclose(fp);
+    unlink(tmpfile);
+    return "Unable to write the manifest";
+  }
+  fclose(fp);
+
+  if (rename(tmpfile, job->manifest)) return "Unable to write the manifest";
+
+  fd = open(STATE_DIR, O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+
+  return NULL;
+}
+
+//
+// Read a manifest, taking the mode it was recorded in.
+//
+static const char *load_manifest(VERIFY_JOB *job, VERIFY_ENTRY **result, size_t *count) {
+  char line[PATH_MAX + 64];
+  char mode[MAXNAMLEN];
+  VERIFY_ENTRY *entries = NULL;
+  unsigned long long hash, size;
+  unsigned long expected;
+  size_t n = 0;
+  FILE *fp;
+  int at;
+
+  *result = NULL;
+  *count = 0;
+
+  fp = fopen(job->manifest, "r");
+  if (!fp) return "No manifest recorded for this volume";
+
+  if (!fgets(line, sizeof line, fp) || (sscanf(line, "#verify %127s %lu", mode, &expected) != 2)) {
+    fclose(fp);
+    return "Manifest is damaged";
+  }
+  job->sample = !strcmp(mode, "sample");
+
+  entries = malloc((expected ? expected : 1) * sizeof(VERIFY_ENTRY));
+  if (!entries) {
+    fclose(fp);
+    return "Out of memory";
+  }
+
+  while ((n < expected) && fgets(line, sizeof line, fp)) {
+    char *nl = strchr(line, '\n'); if (nl) *nl = 0;
+    if (sscanf(line, "%16llx %llu %n", &hash, &size, &at) != 2) continue;
+    entries[n].path = strdup(line + at);
+    if (!entries[n].path) break;
+    entries[n].hash = hash;
+    entries[n].size = size;
+    n++;
+  }
+
+  fclose(fp);
+
+  if (n != expected) {
+    free_entries(entries, n);
+    return "Manifest is damaged";
+  }
+
+  qsort(entries, n, sizeof(VERIFY_ENTRY), compare_entries);
+  *result = entries;
+  *count = n;
+
+  return NULL;
+}
+
+//
+// Add a path to a list, unless the list is full or the escaped path would
+// not fit in what is left of it.
+//
+static size_t list_path(char *buffer, size_t size, size_t len, int listed, const char *path) {
+  size_t path_len = strlen(path);
+  char *esc;
+
+  if ((listed >= VERIFY_MAX_LISTED) || (len + path_len + 4 >= size)) return len;
+
+  // Any byte may become a six character \u00XX escape.
+  esc = malloc(6 * path_len + 1);
+  if (!esc) return len;
+
+  json_escape_buf(path, esc);
+  if (len + strlen(esc) + 4 < size) {
+    len += snprintf(buffer + len, size - len, "%s\"%s\"", listed ? ", " : "", esc);
+  }
+
+  free(esc);
+  return len;
+}
+
+//
+// Compare a fresh hash of the volume with its manifest, listing the
+// first few paths which changed, went missing or appeared.
+//
+static void compare_manifest(VERIFY_JOB *job, VERIFY_ENTRY *old, size_t old_count,
+			     VERIFY_ENTRY *now, size_t now_count, long msecs) {
+  char changed_list[MAXBUFLEN / 2];
+  char missing_list[MAXBUFLEN / 4];
+  char added_list[MAXBUFLEN / 4];
+  // Room for all three lists as well as the counts around them.
+  char buffer[sizeof changed_list + sizeof missing_list + sizeof added_list + MAXLINLEN];
+  size_t changed_len = 0, missing_len = 0, added_len = 0;
+  unsigned long matched = 0, changed = 0, missing = 0, added = 0;
+  size_t i = 0, j = 0;
+
+  changed_list[0] = missing_list[0] = added_list[0] = '\0';
+
+  while ((i < old_count) || (j < now_count)) {
+    int order = (i == old_count) ? 1 : (j == now_count) ? -1 : strcmp(old[i].path, now[j].path);
+
+    if (order < 0) {
+      missing_len = list_path(missing_list, sizeof missing_list, missing_len, missing++, old[i].path);
+      i++;
+    }
+    else if (order > 0) {
+      added_len = list_path(added_list, sizeof added_list, added_len, added++, now[j].path);
+      j++;
+    }
+    else {
+      if ((old[i].size != now[j].size) || (old[i].hash != now[j].hash)) {
+	changed_len = list_path(changed_list, sizeof changed_list, changed_len, changed++, now[j].path);
+      }
+      else matched++;
+      i++;
+      j++;
+    }
+  }
+
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": true, \"stage\": \"completed\", \"action\": \"compare\", \"mode\": \"%s\", "
+	   "\"clean\": %s, \"matched\": %lu, \"changed\": %lu, \"missing\": %lu, \"added\": %lu, "
+	   "\"errors\": %lu, \"skipped\": %lu, \"bytes\": %llu, \"msecs\": %ld, "
+	   "\"changedFiles\": [%s], \"missingFiles\": [%s], \"addedFiles\": [%s]}",
+	   job->sample ? "sample" : "full", (changed || missing || job->errors) ? "false" : "true",
+	   matched, changed, missing, added, job->errors, job->skipped, job->bytes, msecs,
+	   changed_list, missing_list, added_list);
+  respond_quietly(job->message, buffer);
+
+  if (changed || missing) {
+    log_printf(LOG_WARNING, "Verify of %s: %lu changed, %lu missing\n", job->volume, changed, missing);
+  }
+}
+
+void *verify_thread(void *ctx) {
+  VERIFY_JOB *job = (VERIFY_JOB *)ctx;
+  char buffer[MAXBUFLEN];
+  VERIFY_ENTRY *old = NULL, *now = NULL;
+  size_t old_count = 0, now_count = 0;
+  const char *failure = NULL;
+  struct timespec start, end;
+  long msecs;
+  int i;
+
+  // The pool's workers inherit this.
+  io_policy_apply(0, &job->policy);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Take the mode from the manifest before hashing anything.
+  if (!job->record) {
+    failure = load_manifest(job, &old, &old_count);
+    if (failure) goto end;
+  }
+
+  failure = hash_volume(job, &now, &now_count);
+  if (failure) goto end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  msecs = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+  if (job->record) {
+    failure = save_manifest(job, now, now_count);
+    if (failure) goto end;
+
+    snprintf(buffer, sizeof buffer,
+	     "{\"returnValue\": true, \"stage\": \"completed\", \"action\": \"record\", \"mode\": \"%s\", "
+	     "\"files\": %lu, \"errors\": %lu, \"skipped\": %lu, \"bytes\": %llu, \"msecs\": %ld}",
+	     job->sample ? "sample" : "full", (unsigned long)now_count, job->errors, job->skipped, job->bytes, msecs);
+    respond_quietly(job->message, buffer);
+  }
+  else {
+    compare_manifest(job, old, old_count, now, now_count, msecs);
+  }
+
+ end:
+  if (failure) {
+    log_printf(LOG_ERR, "Verify of %s failed: %s\n", job->volume, failure);
+    snprintf(buffer, sizeof buffer, "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}",
+	     failure);
+    respond_quietly(job->message, buffer);
+  }
+
+  free_entries(old, old_count);
+  free_entries(now, now_count);
+
+  if (job->pool) pool_destroy(job->pool);
+  if (job->workers) {
+    for (i = 0; i < job->nthreads; i++) {
+      free_entries(job->workers[i].entries, job->workers[i].count);
+      free(job->workers[i].buffer);
+    }
+    free(job->workers);
+  }
+  if (job->root_fd >= 0) close(job->root_fd);
+
+  pthread_mutex_lock(&verify_lock);
+  verify_running = false;
+  pthread_mutex_unlock(&verify_lock);
+  lvm_release();
+
+  io_throttle_destroy(&job->throttle);
+  pthread_mutex_destroy(&job->lock);
+  LSMessageUnref(job->message);
+  free(job);
+
+  return NULL;
+}
+
+//
+// Record a manifest of the content of a mounted volume (action "record"),
+// or check the volume against the one recorded (action "compare"), so
+// that a resize or migration can be shown to have kept the data intact.
+//
+bool verify_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  char buffer[MAXLINLEN];
+  const char *problem = NULL;
+  pthread_t thread;
+  VERIFY_JOB *job;
+  bool writable;
+
+  job = calloc(1, sizeof(VERIFY_JOB));
+  if (!job) {
+    problem = "Out of memory";
+    goto refuse;
+  }
+  job->root_fd = -1;
+
+  json_t *object = json_parse_document(LSMessageGetPayload(message));
+  json_t *volume = json_find_first_label(object, "volume");
+  json_t *action = json_find_first_label(object, "action");
+  json_t *sample = json_find_first_label(object, "sample");
+
+  if (volume && (volume->child->type == JSON_STRING) && !strcmp(volume->child->text, "media")) {
+    strcpy(job->volume, "media");
+    strcpy(job->device, FAT_DEFAULT_DEVICE);
+    strcpy(job->mountpoint, "/media/internal");
+  }
+  else if (volume && (volume->child->type == JSON_STRING) && !strcmp(volume->child->text, "ext3fs")) {
+    strcpy(job->volume, "ext3fs");
+    strcpy(job->device, EXT3_DEFAULT_DEVICE);
+    strcpy(job->mountpoint, EXT3_DEFAULT_MOUNTPOINT);
+  }
+  else problem = "Invalid or missing volume";
+
+  if (!problem) {
+    if (action && (action->child->type == JSON_STRING) && !strcmp(action->child->text, "record")) job->record = true;
+    else if (!action || (action->child->type != JSON_STRING) || strcmp(action->child->text, "compare")) {
+      problem = "Invalid or missing action";
+    }
+  }
+  job->sample = sample && (sample->child->type == JSON_TRUE);
+  if (!problem) problem = io_policy_parse(object, &job->policy);
+
+  json_free_value(&object);
+  if (problem) goto refuse;
+
+  snprintf(job->manifest, sizeof job->manifest, VERIFY_MANIFEST, job->volume);
+
+  if (!fs_device_mounted(job->device, &writable)) {
+    problem = "Volume must be mounted";
+    goto refuse;
+  }
+
+  pthread_mutex_lock(&verify_lock);
+  if (verify_running || !lvm_claim("verify")) {
+    pthread_mutex_unlock(&verify_lock);
+    log_printf(LOG_NOTICE, "Verify thread already running\n");
+    free(job);
+    if (!LSMessageRespond(message, "{\"returnValue\": false, \"stage\": \"failed\"}", &lserror)) goto error;
+    return true;
+  }
+  verify_running = true;
+  verify_cancelled = false;
+  pthread_mutex_unlock(&verify_lock);
+
+  pthread_mutex_init(&job->lock, NULL);
+  io_throttle_init(&job->throttle, job->policy.limit);
+
+  // Ref and save the message for use in verify thread
+  LSMessageRef(message);
+  job->message = message;
+
+  if (pthread_create(&thread, NULL, verify_thread, (void*)job)) {
+    LSMessageUnref(message);
+    io_throttle_destroy(&job->throttle);
+    pthread_mutex_destroy(&job->lock);
+    pthread_mutex_lock(&verify_lock);
+    verify_running = false;
+    pthread_mutex_unlock(&verify_lock);
+    lvm_release();
+    problem = "Unable to start verify thread";
+    goto refuse;
+  }
+
+  pthread_detach(thread);
+
+  if (!LSMessageRespond(message, "{\"returnValue\": true, \"stage\": \"start\"}", &lserror)) goto error;
+
+  return true;
+
+ refuse:
+  free(job);
+  snprintf(buffer, sizeof buffer,
+	   "{\"returnValue\": false, \"errorCode\": -1, \"errorText\": \"%s\", \"stage\": \"failed\"}", problem);
+  if (!LSMessageRespond(message, buffer, &lserror)) goto error;
+  return true;
+
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
+
+bool kill_verify_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx) {
+  LSError lserror;
+  LSErrorInit(&lserror);
+  bool running;
+
+  pthread_mutex_lock(&verify_lock);
+  running = verify_running;
+  if (running) verify_cancelled = true;
+  pthread_mutex_unlock(&verify_lock);
+
+  if (!LSMessageRespond(message, running ? "{\"returnValue\": true}" : "{\"returnValue\": false, \"stage\": \"failed\"}",
+			&lserror)) goto error;
+
+  return true;
+ error:
+  LSErrorPrint(&lserror, stderr);
+  LSErrorFree(&lserror);
+  return false;
+}
@@ -0,0 +1,39 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include <lunaservice.h>
+
+#include "luna_methods.h"
+
+// Where the manifest of each volume is kept, by volume name.
+#define VERIFY_MANIFEST STATE_DIR "/verify-%s.manifest"
+
+// In sample mode, files larger than three of these are hashed from their
+// start, middle and end only.
+#define VERIFY_SAMPLE_BYTES (64*1024)
+
+// Most paths listed in each category of a comparison; the rest are only counted.
+#define VERIFY_MAX_LISTED 16
+
+bool verify_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+bool kill_verify_volume_method(LSHandle* lshandle, LSMessage *message, void *ctx);
+
+#endif /* VERIFY_H_ */
@@ -0,0 +1,134 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#include <string.h>
+
+#include "xxh64.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+// Inputs are little-endian, whatever the host.
+static uint64_t read64(const unsigned char *p) {
+  return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+    ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint32_t read32(const unsigned char *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * PRIME2;
+  acc = rotl(acc, 31);
+  return acc * PRIME1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t v) {
+  acc ^= round64(0, v);
+  return acc * PRIME1 + PRIME4;
+}
+
+void xxh64_init(XXH64_STATE *state, uint64_t seed) {
+  state->seed = seed;
+  state->v[0] = seed + PRIME1 + PRIME2;
+  state->v[1] = seed + PRIME2;
+  state->v[2] = seed;
+  state->v[3] = seed - PRIME1;
+  state->total = 0;
+  state->used = 0;
+}
+
+static void consume(XXH64_STATE *state, const unsigned char *p) {
+  state->v[0] = round64(state->v[0], read64(p));
+  state->v[1] = round64(state->v[1], read64(p + 8));
+  state->v[2] = round64(state->v[2], read64(p + 16));
+  state->v[3] = round64(state->v[3], read64(p + 24));
+}
+
+void xxh64_update(XXH64_STATE *state, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+
+  state->total += len;
+
+  if (state->used) {
+    size_t take = 32 - state->used;
+    if (take > len) take = len;
+    memcpy(state->buffer + state->used, p, take);
+    state->used += take;
+    p += take;
+    len -= take;
+    if (state->used < 32) return;
+    consume(state, state->buffer);
+    state->used = 0;
+  }
+
+  for (; len >= 32; p += 32, len -= 32) consume(state, p);
+
+  memcpy(state->buffer, p, len);
+  state->used = len;
+}
+
+uint64_t xxh64_digest(const XXH64_STATE *state) {
+  const unsigned char *p = state->buffer;
+  size_t len = state->used;
+  uint64_t h;
+
+  if (state->total >= 32) {
+    h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+    h = merge_round(h, state->v[0]);
+    h = merge_round(h, state->v[1]);
+    h = merge_round(h, state->v[2]);
+    h = merge_round(h, state->v[3]);
+  }
+  else {
+    h = state->seed + PRIME5;
+  }
+
+  h += state->total;
+
+  for (; len >= 8; p += 8, len -= 8) {
+    h ^= round64(0, read64(p));
+    h = rotl(h, 27) * PRIME1 + PRIME4;
+  }
+  if (len >= 4) {
+    h ^= (uint64_t)read32(p) * PRIME1;
+    h = rotl(h, 23) * PRIME2 + PRIME3;
+    p += 4;
+    len -= 4;
+  }
+  for (; len > 0; p++, len--) {
+    h ^= (*p) * PRIME5;
+    h = rotl(h, 11) * PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME3;
+  h ^= h >> 32;
+
+  return h;
+}
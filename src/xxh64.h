@@ -0,0 +1,41 @@
+/*=============================================================================
+ Copyright (C) 2010 WebOS Internals <support@webos-internals.org>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ =============================================================================*/
+
+#ifndef XXH64_H_
+#define XXH64_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// The XXH64 hash, fed in pieces.  Fast and well distributed, but not
+// cryptographic: it finds corruption, not tampering.
+//
+typedef struct {
+  uint64_t v[4];
+  uint64_t seed;
+  uint64_t total;
+  unsigned char buffer[32];
+  size_t used;
+} XXH64_STATE;
+
+void xxh64_init(XXH64_STATE *state, uint64_t seed);
+void xxh64_update(XXH64_STATE *state, const void *data, size_t len);
+uint64_t xxh64_digest(const XXH64_STATE *state);
+
+#endif /* XXH64_H_ */